@@ -0,0 +1,385 @@
+/**
+ * bench.c
+ *
+ * Times each inspector section against a procfs tree (usually one built by
+ * genprocfs) and reports wall time, peak RSS and syscall counts. Syscalls
+ * are counted with ptrace in a separate run so tracing overhead does not
+ * leak into the timings.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_ARGS 32
+#define MAX_RUNS 1000
+#define MAX_TRACEES 1024
+#define SYSCALL_STOP (SIGTRAP | 0x80)
+
+/* Benchmark settings, filled from the command line */
+struct bench_opts {
+    const char *inspector;
+    const char *procfs;
+    int runs;
+    char *extra[MAX_ARGS];
+    int num_extra;
+};
+
+/* Result of a single untraced run */
+struct run_result {
+    double wall_ms;
+    long max_rss_kb;
+};
+
+/* Syscall counts from the traced run */
+struct syscall_counts {
+    uint64_t total;
+    uint64_t open;
+    uint64_t read;
+    uint64_t getdents;
+    uint64_t close;
+    uint64_t uring;
+};
+
+/* One benchmarked inspector run: the section flag, plus an optional flag
+ * that changes how the section is collected */
+struct bench_section {
+    const char *label;
+    const char *flag;
+    const char *variant;
+};
+
+/* Threads currently being traced and whether each is inside a syscall */
+struct tracee_table {
+    pid_t tids[MAX_TRACEES];
+    bool in_syscall[MAX_TRACEES];
+    int count;
+};
+
+void print_usage(char *argv[]);
+void build_argv(struct bench_opts *opts, const struct bench_section *section,
+    char *argv[]);
+pid_t spawn(char *argv[], bool traced);
+int run_once(char *argv[], struct run_result *result);
+int count_syscalls(char *argv[], struct syscall_counts *counts);
+bool *tracee_state(struct tracee_table *table, pid_t tid);
+void tracee_remove(struct tracee_table *table, pid_t tid);
+int compare_double(const void *a, const void *b);
+double now_ms(void);
+
+/* The task list is run again with its status files read through io_uring,
+ * to compare against the open, read and close per task */
+static const struct bench_section sections[] = {
+    { "-s", "-s", NULL },
+    { "-r", "-r", NULL },
+    { "-t", "-t", NULL },
+    { "-l", "-l", NULL },
+    { "-l uring", "-l", "--uring" },
+};
+
+int main(int argc, char *argv[]) {
+    struct bench_opts opts = {
+        .inspector = "./inspector",
+        .procfs = NULL,
+        .runs = 5,
+        .num_extra = 0,
+    };
+
+    struct option long_options[] = {
+        {"runs", required_argument, NULL, 'n'},
+        {"inspector", required_argument, NULL, 'i'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "+n:i:h", long_options, NULL))
+            != -1) {
+        switch (c) {
+            case 'n':
+                opts.runs = atoi(optarg);
+                break;
+            case 'i':
+                opts.inspector = optarg;
+                break;
+            case 'h':
+            default:
+                print_usage(argv);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind >= argc || opts.runs < 1 || opts.runs > MAX_RUNS) {
+        print_usage(argv);
+        return 1;
+    }
+    opts.procfs = argv[optind++];
+
+    //anything after the tree is passed through to every inspector run
+    while (optind < argc && opts.num_extra < MAX_ARGS - 8) {
+        opts.extra[opts.num_extra++] = argv[optind++];
+    }
+
+    printf("%-8s %10s %10s %10s %10s %8s %8s %8s %8s %8s\n",
+        "section", "min ms", "median ms", "max RSS", "syscalls",
+        "open", "read", "getdents", "close", "uring");
+
+    size_t i;
+    for (i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+        char *run_argv[MAX_ARGS];
+        build_argv(&opts, &sections[i], run_argv);
+
+        double wall[MAX_RUNS];
+        long max_rss_kb = 0;
+        int run;
+        for (run = 0; run < opts.runs; run++) {
+            struct run_result result;
+            if (run_once(run_argv, &result) == -1) {
+                fprintf(stderr, "%s %s failed\n", opts.inspector,
+                    sections[i].label);
+                return 1;
+            }
+            wall[run] = result.wall_ms;
+            if (result.max_rss_kb > max_rss_kb) {
+                max_rss_kb = result.max_rss_kb;
+            }
+        }
+        qsort(wall, opts.runs, sizeof(double), compare_double);
+
+        struct syscall_counts counts;
+        if (count_syscalls(run_argv, &counts) == -1) {
+            fprintf(stderr, "tracing %s %s failed\n", opts.inspector,
+                sections[i].label);
+            return 1;
+        }
+
+        printf("%-8s %10.2f %10.2f %7ld KiB %10lu %8lu %8lu %8lu %8lu %8lu\n",
+            sections[i].label, wall[0], wall[opts.runs / 2], max_rss_kb,
+            (unsigned long) counts.total, (unsigned long) counts.open,
+            (unsigned long) counts.read, (unsigned long) counts.getdents,
+            (unsigned long) counts.close, (unsigned long) counts.uring);
+    }
+
+    return 0;
+}
+
+void print_usage(char *argv[]) {
+    printf("Usage: %s [-n runs] [-i inspector] procfs_dir [inspector args]\n",
+        argv[0]);
+    printf("\n");
+    printf("Options:\n"
+        "    * -n, --runs=N         Timed runs per section (default 5)\n"
+        "    * -i, --inspector=PATH Binary to benchmark (default ./inspector)\n");
+    printf("\n");
+}
+
+/**
+ * Builds the argument vector for one section. The CPU window is disabled so
+ * -r measures collection rather than the sleep between the two samples.
+ */
+void build_argv(struct bench_opts *opts, const struct bench_section *section,
+    char *argv[]) {
+
+    int argc = 0;
+    argv[argc++] = (char *) opts->inspector;
+    argv[argc++] = "-p";
+    argv[argc++] = (char *) opts->procfs;
+    argv[argc++] = "--cpu-window=0";
+    argv[argc++] = (char *) section->flag;
+    if (section->variant != NULL) {
+        argv[argc++] = (char *) section->variant;
+    }
+    int i;
+    for (i = 0; i < opts->num_extra; i++) {
+        argv[argc++] = opts->extra[i];
+    }
+    argv[argc] = NULL;
+}
+
+/**
+ * Forks and execs inspector with its output discarded. A traced child stops
+ * itself before exec so the parent can set ptrace options first.
+ */
+pid_t spawn(char *argv[], bool traced) {
+    pid_t child = fork();
+    if (child != 0) {
+        return child;
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd != -1) {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+    if (traced) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+    }
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+}
+
+int run_once(char *argv[], struct run_result *result) {
+    double start = now_ms();
+    pid_t child = spawn(argv, false);
+    if (child == -1) {
+        return -1;
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) == -1) {
+        return -1;
+    }
+    result->wall_ms = now_ms() - start;
+    result->max_rss_kb = usage.ru_maxrss;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/**
+ * Runs inspector under ptrace, following its worker threads, and counts
+ * syscall entries. Each syscall stops the tracee twice (entry and exit),
+ * so a per-thread flag tells the two apart.
+ */
+int count_syscalls(char *argv[], struct syscall_counts *counts) {
+    memset(counts, 0, sizeof(*counts));
+
+    pid_t child = spawn(argv, true);
+    if (child == -1) {
+        return -1;
+    }
+
+    int status;
+    if (waitpid(child, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, child, NULL, PTRACE_O_TRACESYSGOOD
+        | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+    static struct tracee_table table;
+    table.count = 0;
+    int exit_status = -1;
+
+    for (;;) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            tracee_remove(&table, tid);
+            if (tid == child) {
+                exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            }
+            continue;
+        }
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+
+        int signal = 0;
+        if (WSTOPSIG(status) == SYSCALL_STOP) {
+            bool *in_syscall = tracee_state(&table, tid);
+            if (in_syscall != NULL && !*in_syscall) {
+                struct __ptrace_syscall_info info;
+                long sz = ptrace(PTRACE_GET_SYSCALL_INFO, tid,
+                    (void *) sizeof(info), &info);
+                if (sz > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                    counts->total++;
+                    switch (info.entry.nr) {
+                        case SYS_open:
+                        case SYS_openat:
+                            counts->open++;
+                            break;
+                        case SYS_read:
+                        case SYS_pread64:
+                            counts->read++;
+                            break;
+                        case SYS_getdents64:
+                            counts->getdents++;
+                            break;
+                        case SYS_close:
+                            counts->close++;
+                            break;
+                        case SYS_io_uring_enter:
+                            counts->uring++;
+                            break;
+                    }
+                }
+            }
+            if (in_syscall != NULL) {
+                *in_syscall = !*in_syscall;
+            }
+        } else if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_CLONE << 8))) {
+            //the new thread is traced automatically; nothing to deliver
+        } else if (WSTOPSIG(status) == SIGSTOP || WSTOPSIG(status) == SIGTRAP) {
+            //initial stop of a new thread or the post-exec trap
+        } else {
+            signal = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *) (long) signal);
+    }
+
+    return exit_status == 0 ? 0 : -1;
+}
+
+/**
+ * Finds or adds the in-syscall flag for a traced thread.
+ */
+bool *tracee_state(struct tracee_table *table, pid_t tid) {
+    int i;
+    for (i = 0; i < table->count; i++) {
+        if (table->tids[i] == tid) {
+            return &table->in_syscall[i];
+        }
+    }
+    if (table->count == MAX_TRACEES) {
+        return NULL;
+    }
+    table->tids[table->count] = tid;
+    table->in_syscall[table->count] = false;
+    return &table->in_syscall[table->count++];
+}
+
+void tracee_remove(struct tracee_table *table, pid_t tid) {
+    int i;
+    for (i = 0; i < table->count; i++) {
+        if (table->tids[i] == tid) {
+            table->count--;
+            table->tids[i] = table->tids[table->count];
+            table->in_syscall[i] = table->in_syscall[table->count];
+            return;
+        }
+    }
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
@@ -0,0 +1,519 @@
+/**
+ * genprocfs.c
+ *
+ * Builds a synthetic procfs tree that inspector can read with -p. The tree
+ * mimics a large host: a configurable number of CPUs, a long intr line and
+ * tens of thousands of processes, each with the files a real /proc/<pid>
+ * directory would offer (status, stat, statm and task/<tid>/...).
+ *
+ * The output is deterministic for a given seed so benchmark runs compare.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define MIN_PIDS 1
+#define MAX_PIDS 200000
+#define MAX_CPUS 4096
+#define PID_STRIDE 8 //leaves room for thread ids between processes
+#define MAX_THREADS (PID_STRIDE - 1)
+#define NUM_USERS 8
+
+/* Generator settings, filled from the command line */
+struct gen_opts {
+    const char *dir;
+    unsigned pids;
+    unsigned cpus;
+    unsigned intr;
+    uint64_t seed;
+};
+
+/* One synthetic process */
+struct gen_task {
+    unsigned pid;
+    unsigned ppid;
+    unsigned threads;
+    unsigned uid;
+    char state;
+    const char *name;
+    uint64_t utime;
+    uint64_t stime;
+    uint64_t starttime;
+    uint64_t vsz_pages;
+    uint64_t rss_pages;
+    uint64_t swap_kb;
+};
+
+void print_usage(char *argv[]);
+uint64_t rng_next(uint64_t *state);
+FILE *open_file(const char *fmt, ...);
+void make_dir(const char *fmt, ...);
+void write_stat(struct gen_opts *opts, uint64_t *rng);
+void write_cpuinfo(struct gen_opts *opts);
+void write_static_files(struct gen_opts *opts);
+void write_task_status(FILE *file, struct gen_task *task, unsigned tid);
+void write_task_stat(FILE *file, struct gen_task *task, unsigned tid);
+void write_task(struct gen_opts *opts, struct gen_task *task);
+
+static const char *task_names[] = {
+    "systemd", "kworker/u64:2", "sshd", "bash", "postgres", "nginx",
+    "java", "python3", "containerd-shim", "rsyslogd", "cron", "node",
+    "Web Content", "redis-server", "kthreadd", "dockerd",
+};
+
+static const char state_codes[] = "SSSSSSSRRDIZ";
+
+static const char *state_names[] = {
+    ['R'] = "running", ['S'] = "sleeping", ['D'] = "disk sleep",
+    ['I'] = "idle", ['Z'] = "zombie",
+};
+
+int main(int argc, char *argv[]) {
+    struct gen_opts opts = {
+        .dir = NULL,
+        .pids = 10000,
+        .cpus = 64,
+        .intr = 4096,
+        .seed = 1,
+    };
+
+    struct option long_options[] = {
+        {"pids", required_argument, NULL, 'n'},
+        {"cpus", required_argument, NULL, 'c'},
+        {"intr", required_argument, NULL, 'i'},
+        {"seed", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:c:i:s:h", long_options, NULL))
+            != -1) {
+        switch (c) {
+            case 'n':
+                opts.pids = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                opts.cpus = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                opts.intr = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                opts.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'h':
+            default:
+                print_usage(argv);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1 || opts.pids < MIN_PIDS || opts.pids > MAX_PIDS
+            || opts.cpus < 1 || opts.cpus > MAX_CPUS) {
+        print_usage(argv);
+        return 1;
+    }
+    opts.dir = argv[optind];
+
+    //xorshift misbehaves with an all-zero state
+    uint64_t rng = opts.seed == 0 ? 1 : opts.seed;
+
+    make_dir("%s", opts.dir);
+    write_static_files(&opts);
+    write_stat(&opts, &rng);
+    write_cpuinfo(&opts);
+
+    unsigned i;
+    for (i = 0; i < opts.pids; i++) {
+        struct gen_task task;
+        uint64_t r = rng_next(&rng);
+
+        task.pid = 1 + i * PID_STRIDE;
+        task.ppid = i == 0 ? 0 : 1;
+        //most processes are single-threaded, a few are heavily threaded
+        task.threads = r % 10 == 0 ? 1 + (r >> 8) % MAX_THREADS : 1;
+        task.uid = (r >> 16) % NUM_USERS == 0 ? 0 : 1000 + (r >> 16) % 4;
+        task.state = state_codes[(r >> 24) % (sizeof(state_codes) - 1)];
+        task.name = task_names[(r >> 32) %
+            (sizeof(task_names) / sizeof(task_names[0]))];
+        task.utime = rng_next(&rng) % 1000000;
+        task.stime = rng_next(&rng) % 200000;
+        task.starttime = 100 + i * 3;
+        task.vsz_pages = 1024 + rng_next(&rng) % (1u << 22);
+        task.rss_pages = 16 + rng_next(&rng) % (task.vsz_pages / 4);
+        task.swap_kb = rng_next(&rng) % 8 == 0 ? rng_next(&rng) % 65536 : 0;
+
+        write_task(&opts, &task);
+    }
+
+    printf("%s: %u pids, %u cpus, %u interrupt counters\n",
+        opts.dir, opts.pids, opts.cpus, opts.intr);
+    return 0;
+}
+
+void print_usage(char *argv[]) {
+    printf("Usage: %s [-n pids] [-c cpus] [-i intr] [-s seed] dir\n", argv[0]);
+    printf("\n");
+    printf("Options:\n"
+        "    * -n, --pids=N   Number of processes, %d to %d (default 10000)\n"
+        "    * -c, --cpus=N   Number of CPUs (default 64)\n"
+        "    * -i, --intr=N   Counters on the stat intr line (default 4096)\n"
+        "    * -s, --seed=N   Seed for the generated values (default 1)\n",
+        MIN_PIDS, MAX_PIDS);
+    printf("\n");
+}
+
+/**
+ * xorshift64: cheap and reproducible, which is all the generator needs.
+ */
+uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/**
+ * Opens a file for writing at a printf-style path, exiting on failure.
+ */
+FILE *open_file(const char *fmt, ...) {
+    char path[PATH_MAX];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(path, sizeof(path), fmt, args);
+    va_end(args);
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    return file;
+}
+
+/**
+ * Creates a directory at a printf-style path; existing ones are reused.
+ */
+void make_dir(const char *fmt, ...) {
+    char path[PATH_MAX];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(path, sizeof(path), fmt, args);
+    va_end(args);
+
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror(path);
+        exit(1);
+    }
+}
+
+void write_stat(struct gen_opts *opts, uint64_t *rng) {
+    FILE *file = open_file("%s/stat", opts->dir);
+
+    uint64_t total[10] = { 0 };
+    uint64_t *per_cpu = calloc((size_t) opts->cpus * 10, sizeof(uint64_t));
+    if (per_cpu == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    unsigned cpu, state;
+    for (cpu = 0; cpu < opts->cpus; cpu++) {
+        for (state = 0; state < 10; state++) {
+            //guest time stays zero on most hosts
+            uint64_t value = state >= 8 ? 0 : rng_next(rng) % 100000000;
+            per_cpu[cpu * 10 + state] = value;
+            total[state] += value;
+        }
+    }
+
+    fprintf(file, "cpu ");
+    for (state = 0; state < 10; state++) {
+        fprintf(file, " %" PRIu64, total[state]);
+    }
+    fputc('\n', file);
+    for (cpu = 0; cpu < opts->cpus; cpu++) {
+        fprintf(file, "cpu%u", cpu);
+        for (state = 0; state < 10; state++) {
+            fprintf(file, " %" PRIu64, per_cpu[cpu * 10 + state]);
+        }
+        fputc('\n', file);
+    }
+    free(per_cpu);
+
+    //the intr line is the longest in the file: a total plus one per irq
+    fprintf(file, "intr %" PRIu64, rng_next(rng) % UINT64_C(100000000000));
+    unsigned i;
+    for (i = 0; i < opts->intr; i++) {
+        //real hosts leave most irqs unused
+        fprintf(file, " %" PRIu64,
+            i % 7 == 0 ? rng_next(rng) % 10000000 : (uint64_t) 0);
+    }
+    fputc('\n', file);
+
+    fprintf(file, "ctxt %" PRIu64 "\n", rng_next(rng) % UINT64_C(100000000000));
+    fprintf(file, "btime 1760000000\n");
+    fprintf(file, "processes %" PRIu64 "\n",
+        (uint64_t) opts->pids * PID_STRIDE);
+    fprintf(file, "procs_running %u\n", 1 + opts->cpus / 4);
+    fprintf(file, "procs_blocked 0\n");
+    fprintf(file, "softirq 0 0 0 0 0 0 0 0 0 0 0\n");
+    fclose(file);
+}
+
+void write_cpuinfo(struct gen_opts *opts) {
+    FILE *file = open_file("%s/cpuinfo", opts->dir);
+
+    unsigned cpu;
+    for (cpu = 0; cpu < opts->cpus; cpu++) {
+        fprintf(file,
+            "processor\t: %u\n"
+            "vendor_id\t: GenuineIntel\n"
+            "cpu family\t: 6\n"
+            "model\t\t: 143\n"
+            "model name\t: Intel(R) Xeon(R) Platinum 8480+\n"
+            "stepping\t: 8\n"
+            "microcode\t: 0x2b000590\n"
+            "cpu MHz\t\t: 2000.000\n"
+            "cache size\t: 107520 KB\n"
+            "physical id\t: %u\n"
+            "siblings\t: %u\n"
+            "core id\t\t: %u\n"
+            "cpu cores\t: %u\n"
+            "apicid\t\t: %u\n"
+            "initial apicid\t: %u\n"
+            "fpu\t\t: yes\n"
+            "fpu_exception\t: yes\n"
+            "cpuid level\t: 32\n"
+            "wp\t\t: yes\n"
+            "flags\t\t: fpu vme de pse tsc msr pae mce cx8 apic sep mtrr pge "
+            "mca cmov pat pse36 clflush dts acpi mmx fxsr sse sse2 ss ht tm "
+            "pbe syscall nx pdpe1gb rdtscp lm constant_tsc art arch_perfmon "
+            "pebs bts rep_good nopl xtopology nonstop_tsc cpuid aperfmperf "
+            "pni pclmulqdq dtes64 monitor ds_cpl vmx smx est tm2 ssse3 sdbg "
+            "fma cx16 xtpr pdcm pcid dca sse4_1 sse4_2 x2apic movbe popcnt "
+            "tsc_deadline_timer aes xsave avx f16c rdrand lahf_lm abm "
+            "3dnowprefetch cpuid_fault epb cat_l3 cat_l2 cdp_l3 invpcid_single "
+            "intel_ppin cdp_l2 ssbd mba ibrs ibpb stibp ibrs_enhanced "
+            "tpr_shadow flexpriority ept vpid ept_ad fsgsbase tsc_adjust bmi1 "
+            "avx2 smep bmi2 erms invpcid cqm rdt_a avx512f avx512dq rdseed adx "
+            "smap avx512ifma clflushopt clwb intel_pt avx512cd sha_ni avx512bw "
+            "avx512vl xsaveopt xsavec xgetbv1 xsaves cqm_llc cqm_occup_llc "
+            "cqm_mbm_total cqm_mbm_local split_lock_detect avx_vnni "
+            "avx512_bf16 wbnoinvd dtherm ida arat pln pts hfi vnmi avx512vbmi "
+            "umip pku ospke waitpkg avx512_vbmi2 gfni vaes vpclmulqdq "
+            "avx512_vnni avx512_bitalg tme avx512_vpopcntdq la57 rdpid "
+            "bus_lock_detect cldemote movdiri movdir64b enqcmd fsrm md_clear "
+            "serialize tsxldtrk pconfig arch_lbr ibt amx_bf16 avx512_fp16 "
+            "amx_tile amx_int8 flush_l1d arch_capabilities\n"
+            "bugs\t\t: spectre_v1 spectre_v2 spec_store_bypass swapgs "
+            "eibrs_pbrsb\n"
+            "bogomips\t: 4000.00\n"
+            "clflush size\t: 64\n"
+            "cache_alignment\t: 64\n"
+            "address sizes\t: 46 bits physical, 57 bits virtual\n"
+            "power management:\n"
+            "\n",
+            cpu, cpu / 56, opts->cpus < 112 ? opts->cpus : 112,
+            cpu % 56, opts->cpus < 56 ? opts->cpus : 56, cpu, cpu);
+    }
+    fclose(file);
+}
+
+void write_static_files(struct gen_opts *opts) {
+    FILE *file;
+
+    file = open_file("%s/version", opts->dir);
+    fprintf(file, "Linux version 6.8.0-bench (builder@genprocfs) "
+        "(gcc (GCC) 13.2.0, GNU ld (GNU Binutils) 2.42) #1 SMP "
+        "PREEMPT_DYNAMIC\n");
+    fclose(file);
+
+    file = open_file("%s/uptime", opts->dir);
+    fprintf(file, "1234567.89 %u.00\n", 1234567 * opts->cpus / 2);
+    fclose(file);
+
+    file = open_file("%s/loadavg", opts->dir);
+    fprintf(file, "%u.12 %u.34 %u.56 %u/%u %u\n",
+        opts->cpus / 2, opts->cpus / 3, opts->cpus / 4,
+        1 + opts->cpus / 4, opts->pids, opts->pids * PID_STRIDE);
+    fclose(file);
+
+    file = open_file("%s/meminfo", opts->dir);
+    static const char *meminfo[] = {
+        "MemTotal:       1056561152 kB", "MemFree:         85322752 kB",
+        "MemAvailable:   823431168 kB", "Buffers:          4268032 kB",
+        "Cached:         700125184 kB", "SwapCached:         12288 kB",
+        "Active:         412231680 kB", "Inactive:       498925568 kB",
+        "Active(anon):   205209600 kB", "Inactive(anon):    184320 kB",
+        "Active(file):   207022080 kB", "Inactive(file): 498741248 kB",
+        "Unevictable:        65536 kB", "Mlocked:            65536 kB",
+        "SwapTotal:        8388604 kB", "SwapFree:         8126460 kB",
+        "Zswap:                  0 kB", "Zswapped:               0 kB",
+        "Dirty:               5120 kB", "Writeback:              0 kB",
+        "AnonPages:      206946304 kB", "Mapped:           3309568 kB",
+        "Shmem:            1056768 kB", "KReclaimable:    30408704 kB",
+        "Slab:            41943040 kB", "SReclaimable:    30408704 kB",
+        "SUnreclaim:      11534336 kB", "KernelStack:       262144 kB",
+        "PageTables:       1048576 kB", "SecPageTables:          0 kB",
+        "NFS_Unstable:           0 kB", "Bounce:                 0 kB",
+        "WritebackTmp:           0 kB", "CommitLimit:    536669180 kB",
+        "Committed_AS:   315621376 kB", "VmallocTotal:   34359738367 kB",
+        "VmallocUsed:      1048576 kB", "VmallocChunk:           0 kB",
+        "Percpu:            917504 kB", "HardwareCorrupted:      0 kB",
+        "AnonHugePages:   52428800 kB", "ShmemHugePages:         0 kB",
+        "ShmemPmdMapped:         0 kB", "FileHugePages:          0 kB",
+        "FilePmdMapped:          0 kB", "HugePages_Total:        0",
+        "HugePages_Free:         0", "HugePages_Rsvd:         0",
+        "HugePages_Surp:         0", "Hugepagesize:       2048 kB",
+        "Hugetlb:                0 kB", "DirectMap4k:      8388608 kB",
+        "DirectMap2M:    134217728 kB", "DirectMap1G:    935329792 kB",
+    };
+    size_t i;
+    for (i = 0; i < sizeof(meminfo) / sizeof(meminfo[0]); i++) {
+        fprintf(file, "%s\n", meminfo[i]);
+    }
+    fclose(file);
+
+    make_dir("%s/sys", opts->dir);
+    make_dir("%s/sys/kernel", opts->dir);
+    file = open_file("%s/sys/kernel/hostname", opts->dir);
+    fprintf(file, "bench-host\n");
+    fclose(file);
+}
+
+void write_task_status(FILE *file, struct gen_task *task, unsigned tid) {
+    fprintf(file,
+        "Name:\t%s\n"
+        "Umask:\t0022\n"
+        "State:\t%c (%s)\n"
+        "Tgid:\t%u\n"
+        "Ngid:\t0\n"
+        "Pid:\t%u\n"
+        "PPid:\t%u\n"
+        "TracerPid:\t0\n"
+        "Uid:\t%u\t%u\t%u\t%u\n"
+        "Gid:\t%u\t%u\t%u\t%u\n"
+        "FDSize:\t64\n"
+        "Groups:\t \n"
+        "NStgid:\t%u\n"
+        "NSpid:\t%u\n"
+        "NSpgid:\t%u\n"
+        "NSsid:\t%u\n"
+        "Kthread:\t0\n"
+        "VmPeak:\t%8" PRIu64 " kB\n"
+        "VmSize:\t%8" PRIu64 " kB\n"
+        "VmLck:\t       0 kB\n"
+        "VmPin:\t       0 kB\n"
+        "VmHWM:\t%8" PRIu64 " kB\n"
+        "VmRSS:\t%8" PRIu64 " kB\n"
+        "RssAnon:\t%8" PRIu64 " kB\n"
+        "RssFile:\t       0 kB\n"
+        "RssShmem:\t       0 kB\n"
+        "VmData:\t    2048 kB\n"
+        "VmStk:\t     132 kB\n"
+        "VmExe:\t    1024 kB\n"
+        "VmLib:\t    4096 kB\n"
+        "VmPTE:\t      92 kB\n"
+        "VmSwap:\t%8" PRIu64 " kB\n"
+        "HugetlbPages:\t       0 kB\n"
+        "CoreDumping:\t0\n"
+        "THP_enabled:\t1\n"
+        "untag_mask:\t0xffffffffffffffff\n"
+        "Threads:\t%u\n"
+        "SigQ:\t0/4126243\n"
+        "SigPnd:\t0000000000000000\n"
+        "ShdPnd:\t0000000000000000\n"
+        "SigBlk:\t0000000000000000\n"
+        "SigIgn:\t0000000000001000\n"
+        "SigCgt:\t0000000180004a02\n"
+        "CapInh:\t0000000000000000\n"
+        "CapPrm:\t0000000000000000\n"
+        "CapEff:\t0000000000000000\n"
+        "CapBnd:\t000001ffffffffff\n"
+        "CapAmb:\t0000000000000000\n"
+        "NoNewPrivs:\t0\n"
+        "Seccomp:\t0\n"
+        "Seccomp_filters:\t0\n"
+        "Speculation_Store_Bypass:\tthread vulnerable\n"
+        "SpeculationIndirectBranch:\tconditional enabled\n"
+        "Cpus_allowed:\tffffffff,ffffffff\n"
+        "Cpus_allowed_list:\t0-63\n"
+        "Mems_allowed:\t00000000,00000003\n"
+        "Mems_allowed_list:\t0-1\n"
+        "voluntary_ctxt_switches:\t%" PRIu64 "\n"
+        "nonvoluntary_ctxt_switches:\t%" PRIu64 "\n",
+        task->name, task->state, state_names[(unsigned char) task->state],
+        task->pid, tid, task->ppid,
+        task->uid, task->uid, task->uid, task->uid,
+        task->uid, task->uid, task->uid, task->uid,
+        task->pid, tid, task->pid, task->pid,
+        task->vsz_pages * 4, task->vsz_pages * 4,
+        task->rss_pages * 4, task->rss_pages * 4, task->rss_pages * 4,
+        task->swap_kb, task->threads,
+        task->utime / 3, task->stime / 7);
+}
+
+void write_task_stat(FILE *file, struct gen_task *task, unsigned tid) {
+    fprintf(file,
+        "%u (%s) %c %u %u %u 0 -1 4194560 1234 0 12 0 "
+        "%" PRIu64 " %" PRIu64 " 0 0 20 0 %u 0 %" PRIu64 " %" PRIu64
+        " %" PRIu64 " 18446744073709551615 1 1 0 0 0 0 0 4096 17003 0 0 0 "
+        "17 %u 0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+        tid, task->name, task->state, task->ppid, task->pid, task->pid,
+        task->utime, task->stime, task->threads, task->starttime,
+        task->vsz_pages * 4096, task->rss_pages, tid % 64);
+}
+
+void write_task(struct gen_opts *opts, struct gen_task *task) {
+    FILE *file;
+
+    make_dir("%s/%u", opts->dir, task->pid);
+
+    file = open_file("%s/%u/status", opts->dir, task->pid);
+    write_task_status(file, task, task->pid);
+    fclose(file);
+
+    file = open_file("%s/%u/stat", opts->dir, task->pid);
+    write_task_stat(file, task, task->pid);
+    fclose(file);
+
+    file = open_file("%s/%u/statm", opts->dir, task->pid);
+    fprintf(file, "%" PRIu64 " %" PRIu64 " 256 256 0 512 0\n",
+        task->vsz_pages, task->rss_pages);
+    fclose(file);
+
+    file = open_file("%s/%u/comm", opts->dir, task->pid);
+    fprintf(file, "%s\n", task->name);
+    fclose(file);
+
+    //every thread gets its own task directory, the leader included
+    make_dir("%s/%u/task", opts->dir, task->pid);
+    unsigned i;
+    for (i = 0; i < task->threads; i++) {
+        unsigned tid = task->pid + i;
+        make_dir("%s/%u/task/%u", opts->dir, task->pid, tid);
+
+        file = open_file("%s/%u/task/%u/status", opts->dir, task->pid, tid);
+        write_task_status(file, task, tid);
+        fclose(file);
+
+        file = open_file("%s/%u/task/%u/stat", opts->dir, task->pid, tid);
+        write_task_stat(file, task, tid);
+        fclose(file);
+    }
+}
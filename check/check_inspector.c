@@ -0,0 +1,301 @@
+/**
+ * Tests for the command line side of the inspector: the recording ring and
+ * replay seeks, option parsing and JSON output. The program is built on
+ * top of inspector.c itself, with its main() renamed, so the tests can call
+ * its internal functions directly.
+ */
+
+#define main inspector_main
+#include "../inspector.c"
+#undef main
+
+/* Counts every failed check; the program exits with 1 if any failed */
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/* An in-memory ring of 'data_size' bytes and 'index_cap' index slots,
+ * standing in for a mapped recording file */
+struct test_ring {
+    struct recorder rec;
+    struct ring_header header;
+    struct ring_entry *index;
+    char *data;
+};
+
+void test_ring_init(struct test_ring *ring, uint64_t data_size,
+    uint64_t index_cap) {
+
+    memset(ring, 0, sizeof(*ring));
+    ring->index = calloc(index_cap, sizeof(struct ring_entry));
+    ring->data = calloc(1, data_size);
+    ring->header.index_cap = index_cap;
+    ring->header.data_size = data_size;
+    ring->rec.fd = -1;
+    ring->rec.map = ring->data;
+    ring->rec.header = &ring->header;
+    ring->rec.index = ring->index;
+    ring->rec.data = ring->data;
+}
+
+void test_ring_free(struct test_ring *ring) {
+    free(ring->index);
+    free(ring->data);
+}
+
+/**
+ * Appends a sample of 'len' bytes, all set to the low byte of its sequence
+ * number, taken 'seq' seconds in.
+ */
+int test_ring_append(struct test_ring *ring, size_t len) {
+    uint64_t seq = ring->header.head;
+    char *sample = malloc(len);
+    memset(sample, (int) (seq & 0xff), len);
+    struct timespec time = { .tv_sec = seq, .tv_nsec = 0 };
+    int result = recorder_append(&ring->rec, &time, sample, len, 0);
+    free(sample);
+    return result;
+}
+
+/**
+ * Checks that every sample between 'tail' and 'head' is still intact: in
+ * range, not overlapping any other live sample, and holding its own bytes.
+ */
+void check_ring_intact(struct test_ring *ring) {
+    struct ring_header *header = &ring->header;
+    CHECK(header->tail <= header->head);
+    CHECK(header->head - header->tail <= header->index_cap);
+
+    uint64_t seq;
+    for (seq = header->tail; seq < header->head; seq++) {
+        struct ring_entry *entry = &ring->index[seq % header->index_cap];
+        CHECK(entry->offset + entry->len <= header->data_size);
+        CHECK(entry->time_ns == seq * 1000000000);
+
+        uint64_t other;
+        for (other = seq + 1; other < header->head; other++) {
+            struct ring_entry *next = &ring->index[other % header->index_cap];
+            CHECK(entry->offset + entry->len <= next->offset
+                || next->offset + next->len <= entry->offset);
+        }
+
+        uint32_t i;
+        for (i = 0; i < entry->len; i++) {
+            if ((unsigned char) ring->data[entry->offset + i] != (seq & 0xff)) {
+                fprintf(stderr, "sample %" PRIu64 " was overwritten\n", seq);
+                failures++;
+                break;
+            }
+        }
+    }
+}
+
+void test_ring_wrap(void) {
+    struct test_ring ring;
+
+    //the 450 byte sample wraps with the 400 byte one at 600 still the
+    //oldest, and lands on the newer samples at 0 and 300
+    size_t sizes[] = { 300, 300, 400, 300, 300, 450 };
+    test_ring_init(&ring, 1000, 16);
+    size_t i;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        CHECK(test_ring_append(&ring, sizes[i]) == 0);
+        check_ring_intact(&ring);
+    }
+    CHECK(ring.header.head == 6);
+    CHECK(ring.header.tail == 5);
+    test_ring_free(&ring);
+
+    //samples of every size, including ones that fill the whole ring
+    test_ring_init(&ring, 1000, 16);
+    uint32_t state = 1;
+    for (i = 0; i < 5000; i++) {
+        state = state * 1103515245 + 12345;
+        CHECK(test_ring_append(&ring, 1 + (state >> 16) % 1000) == 0);
+        check_ring_intact(&ring);
+        CHECK(ring.header.tail < ring.header.head);
+    }
+    test_ring_free(&ring);
+
+    //a full index drops samples that would still fit in the data ring
+    test_ring_init(&ring, 1000, 4);
+    for (i = 0; i < 10; i++) {
+        CHECK(test_ring_append(&ring, 10) == 0);
+        check_ring_intact(&ring);
+    }
+    CHECK(ring.header.head - ring.header.tail == 4);
+
+    //and a sample bigger than the ring is refused outright
+    CHECK(test_ring_append(&ring, 1001) == -1);
+    CHECK(ring.header.head == 10);
+    test_ring_free(&ring);
+}
+
+void test_ring_seek(void) {
+    struct test_ring ring;
+
+    //seek over a ring that has wrapped many times, with gaps in the times
+    test_ring_init(&ring, 1000, 16);
+    uint32_t state = 7;
+    size_t i;
+    for (i = 0; i < 500; i++) {
+        state = state * 1103515245 + 12345;
+        CHECK(test_ring_append(&ring, 50 + (state >> 16) % 300) == 0);
+    }
+    uint64_t tail = ring.header.tail;
+    uint64_t head = ring.header.head;
+    CHECK(tail > 0);
+
+    //sample 'seq' was taken 'seq' seconds in; ask for times on and between
+    //them, and before and after the whole ring
+    uint64_t time_ns;
+    for (time_ns = 0; time_ns <= (head + 1) * 1000000000; time_ns += 250000000) {
+        uint64_t expected = tail;
+        while (expected < head && expected * 1000000000 < time_ns) {
+            expected++;
+        }
+        CHECK(ring_lower_bound(&ring.rec, tail, head, time_ns) == expected);
+    }
+
+    //and over part of the ring, or none of it
+    CHECK(ring_lower_bound(&ring.rec, tail + 1, head - 1, 0) == tail + 1);
+    CHECK(ring_lower_bound(&ring.rec, tail + 1, head - 1, UINT64_MAX)
+        == head - 1);
+    CHECK(ring_lower_bound(&ring.rec, head, head, 0) == head);
+    test_ring_free(&ring);
+}
+
+void test_parse_options(void) {
+    long value = -1;
+    CHECK(parse_long("0", 0, 10, &value) == 0 && value == 0);
+    CHECK(parse_long("10", 0, 10, &value) == 0 && value == 10);
+    CHECK(parse_long("-5", -10, 10, &value) == 0 && value == -5);
+    CHECK(parse_long("11", 0, 10, &value) == -1);
+    CHECK(parse_long("-5", 0, 10, &value) == -1);
+    CHECK(parse_long("5x", 0, 10, &value) == -1);
+    CHECK(parse_long("abc", 0, 10, &value) == -1);
+    CHECK(parse_long("", 0, 10, &value) == -1);
+    CHECK(parse_long(" 5", 0, 10, &value) == -1);
+    CHECK(parse_long("5 ", 0, 10, &value) == -1);
+    CHECK(parse_long("0x5", 0, 10, &value) == -1);
+    CHECK(parse_long("99999999999999999999", 0, LONG_MAX, &value) == -1);
+    CHECK(parse_long("-99999999999999999999", LONG_MIN, 0, &value) == -1);
+    //a rejected argument leaves the value alone
+    CHECK(value == -5);
+
+    double real = -1;
+    CHECK(parse_double("0.5", 0, 10, &real) == 0 && real == 0.5);
+    CHECK(parse_double("2", 0, 10, &real) == 0 && real == 2);
+    CHECK(parse_double("1e1", 0, 10, &real) == 0 && real == 10);
+    CHECK(parse_double("10.5", 0, 10, &real) == -1);
+    CHECK(parse_double("-1", 0, 10, &real) == -1);
+    CHECK(parse_double("1s", 0, 10, &real) == -1);
+    CHECK(parse_double("", 0, 10, &real) == -1);
+    CHECK(parse_double(" 1", 0, 10, &real) == -1);
+    CHECK(parse_double("nan", 0, 10, &real) == -1);
+    CHECK(parse_double("inf", 0, INFINITY, &real) == -1);
+    CHECK(parse_double("1e999", 0, INFINITY, &real) == -1);
+    CHECK(real == 10);
+
+    pid_t pid_min = -1;
+    pid_t pid_max = -1;
+    CHECK(parse_pid_range("10-20", &pid_min, &pid_max) == 0
+        && pid_min == 10 && pid_max == 20);
+    CHECK(parse_pid_range("10-", &pid_min, &pid_max) == 0
+        && pid_min == 10 && pid_max == 0);
+    CHECK(parse_pid_range("-20", &pid_min, &pid_max) == 0
+        && pid_min == 0 && pid_max == 20);
+    CHECK(parse_pid_range("20-10", &pid_min, &pid_max) == -1);
+    CHECK(parse_pid_range("10", &pid_min, &pid_max) == -1);
+    CHECK(parse_pid_range("1x-20", &pid_min, &pid_max) == -1);
+    CHECK(parse_pid_range("10-2x", &pid_min, &pid_max) == -1);
+    CHECK(parse_pid_range("10-0", &pid_min, &pid_max) == -1);
+
+    enum task_column order[NUM_TASK_COLS];
+    size_t count = 0;
+    CHECK(parse_task_columns("pid,name,pid,cpu", order, &count) == 0);
+    CHECK(count == 3);
+    CHECK(order[0] == TASK_COL_PID && order[1] == TASK_COL_NAME
+        && order[2] == TASK_COL_CPU);
+    count = 0;
+    CHECK(parse_task_columns("pid,bogus", order, &count) == -1);
+}
+
+/**
+ * Checks that writing 'value' through out_put_float() gives 'expected'.
+ */
+void check_json_float(float value, const char *expected) {
+    struct out_buf ob;
+    CHECK(out_buf_init(&ob, -1) == 0);
+    out_put_float(&ob, value);
+    CHECK(ob.len == strlen(expected)
+        && memcmp(ob.data, expected, ob.len) == 0);
+    out_buf_free(&ob);
+}
+
+/**
+ * Checks that writing 'str' through out_put_json_str() gives 'expected'.
+ */
+void check_json_str(const char *str, const char *expected) {
+    struct out_buf ob;
+    CHECK(out_buf_init(&ob, -1) == 0);
+    out_put_json_str(&ob, str);
+    if (ob.len != strlen(expected) || memcmp(ob.data, expected, ob.len) != 0) {
+        fprintf(stderr, "json string: expected %s, got %.*s\n", expected,
+            (int) ob.len, ob.data);
+        failures++;
+    }
+    out_buf_free(&ob);
+}
+
+void test_json(void) {
+    check_json_float(1.5, "1.50");
+    check_json_float(-0.125, "-0.12");
+    check_json_float(NAN, "null");
+    check_json_float(INFINITY, "null");
+    check_json_float(-INFINITY, "null");
+
+    check_json_str("", "\"\"");
+    check_json_str("bash", "\"bash\"");
+    check_json_str("a\"b\\c", "\"a\\\"b\\\\c\"");
+    check_json_str("tab\there\n", "\"tab\\there\\n\"");
+    check_json_str("\x01\x1f", "\"\\u0001\\u001f\"");
+
+    //well-formed UTF-8 is copied as it is
+    check_json_str("h\xc3\xa9 \xe4\xb8\xad \xf0\x9f\x98\x80",
+        "\"h\xc3\xa9 \xe4\xb8\xad \xf0\x9f\x98\x80\"");
+    check_json_str("\xef\xbf\xbf\xf4\x8f\xbf\xbf",
+        "\"\xef\xbf\xbf\xf4\x8f\xbf\xbf\"");
+
+    //anything else is replaced byte by byte
+    check_json_str("\xff", "\"\\ufffd\"");
+    check_json_str("a\x80" "b", "\"a\\ufffdb\"");
+    check_json_str("cut\xe2\x82", "\"cut\\ufffd\\ufffd\"");
+    check_json_str("\xc0\xaf", "\"\\ufffd\\ufffd\"");
+    check_json_str("\xe0\x80\xaf", "\"\\ufffd\\ufffd\\ufffd\"");
+    check_json_str("\xed\xa0\x80", "\"\\ufffd\\ufffd\\ufffd\"");
+    check_json_str("\xf4\x90\x80\x80",
+        "\"\\ufffd\\ufffd\\ufffd\\ufffd\"");
+    check_json_str("\xc3\"", "\"\\ufffd\\\"\"");
+}
+
+int main(void) {
+    test_ring_wrap();
+    test_ring_seek();
+    test_parse_options();
+    test_json();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("check_inspector: all checks passed\n");
+    return 0;
+}
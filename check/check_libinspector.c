@@ -0,0 +1,301 @@
+/**
+ * Tests for the collectors: the SWAR number parser, the top-K task order
+ * and the --diff state table. The program is built on top of
+ * libinspector.c itself, so the tests can call its internal functions
+ * directly.
+ */
+
+#include "../libinspector.c"
+
+/* Counts every failed check; the program exits with 1 if any failed */
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/* A small deterministic generator, so every run checks the same inputs */
+static uint64_t rand_state = 88172645463325252ULL;
+
+uint64_t test_rand(void) {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+/**
+ * Counts the leading digits of a chunk one byte at a time.
+ */
+int plain_digit_count(uint64_t chunk) {
+    int n;
+    for (n = 0; n < 8; n++) {
+        unsigned char c = chunk >> (8 * n);
+        if (c < '0' || c > '9') {
+            break;
+        }
+    }
+    return n;
+}
+
+void test_swar_digits(void) {
+
+    //every non-digit byte after every run of digits, with junk behind it
+    int stop;
+    for (stop = 0; stop < 256; stop++) {
+        if (stop >= '0' && stop <= '9') {
+            continue;
+        }
+        int n;
+        for (n = 0; n < 8; n++) {
+            uint64_t chunk = test_rand();
+            uint64_t value = 0;
+            int i;
+            for (i = 0; i < n; i++) {
+                int digit = test_rand() % 10;
+                value = value * 10 + digit;
+                chunk &= ~(0xffULL << (8 * i));
+                chunk |= (uint64_t) ('0' + digit) << (8 * i);
+            }
+            chunk &= ~(0xffULL << (8 * n));
+            chunk |= (uint64_t) stop << (8 * n);
+
+            CHECK(swar_digit_count(chunk) == n);
+            if (n > 0) {
+                CHECK(swar_parse_digits(chunk, n) == value);
+            }
+        }
+    }
+
+    //eight digits, and random chunks against the plain count
+    CHECK(swar_digit_count(0x3837363534333231ULL) == 8);
+    CHECK(swar_parse_digits(0x3837363534333231ULL, 8) == 12345678);
+    int i;
+    for (i = 0; i < 1000000; i++) {
+        uint64_t chunk = test_rand();
+        CHECK(swar_digit_count(chunk) == plain_digit_count(chunk));
+    }
+}
+
+/**
+ * Runs view_parse_u64() over 'text' (followed by slack bytes, as in a
+ * proc_buf) and checks the value and how much of the view is left.
+ */
+void check_parse(const char *text, size_t len, uint64_t value, size_t left) {
+    char buf[64 + PROC_BUF_SLACK];
+    memset(buf, 'x', sizeof(buf));
+    memcpy(buf, text, len);
+
+    struct str_view rest = { buf, len };
+    CHECK(view_parse_u64(&rest) == value);
+    CHECK(rest.len == left);
+    CHECK(rest.ptr == buf + len - left);
+}
+
+void test_view_parse(void) {
+    check_parse("", 0, 0, 0);
+    check_parse("  \t", 3, 0, 0);
+    check_parse("abc", 3, 0, 3);
+    check_parse("0", 1, 0, 0);
+    check_parse(" 42 17", 6, 42, 3);
+    check_parse("12345678", 8, 12345678, 0);
+    check_parse("123456789", 9, 123456789, 0);
+    check_parse("1234567812345678 ", 17, 1234567812345678ULL, 1);
+    check_parse("18446744073709551615", 20, UINT64_MAX, 0);
+
+    //the view can end in the middle of a number
+    check_parse("12345678901", 5, 12345, 0);
+    check_parse("12345678901", 10, 1234567890, 0);
+
+    //every length of number, with and without something after it
+    char text[32];
+    int i;
+    for (i = 0; i < 200000; i++) {
+        uint64_t value = test_rand() >> (test_rand() % 64);
+        int len = snprintf(text, sizeof(text), "%*s%" PRIu64 "%s",
+            (int) (test_rand() % 3), "", value, i % 2 ? " 99" : "kB");
+        check_parse(text, len, value, i % 2 ? 3 : 2);
+    }
+}
+
+/**
+ * Fills 'rows' with tasks whose sort columns are drawn from small ranges,
+ * so there are plenty of ties, and some tasks without a cpu measurement.
+ */
+void fill_task_rows(struct task_row *rows, size_t num_rows) {
+    memset(rows, 0, num_rows * sizeof(struct task_row));
+    size_t i;
+    for (i = 0; i < num_rows; i++) {
+        rows[i].pid = 1 + test_rand() % 100000;
+        rows[i].threads = 1 + test_rand() % 8;
+        rows[i].rss_kb = test_rand() % 4 == 0 ? test_rand() : test_rand() % 64;
+        rows[i].cpu_usage = test_rand() % 5 == 0 ? -1
+            : (test_rand() % 400) / 4.0;
+    }
+}
+
+void test_top_k(void) {
+    enum task_sort sorts[] = { SORT_CPU, SORT_MEM, SORT_THREADS, SORT_PID };
+    size_t sizes[] = { 0, 1, 2, 7, 100, 1000 };
+    size_t max_rows = 1000;
+
+    struct task_row *rows = malloc(max_rows * sizeof(struct task_row));
+    uint64_t *expected = malloc(max_rows * sizeof(uint64_t));
+    uint64_t *keys = malloc((max_rows + 1) * sizeof(uint64_t));
+
+    size_t s;
+    for (s = 0; s < sizeof(sorts) / sizeof(sorts[0]); s++) {
+        size_t r;
+        for (r = 0; r < sizeof(sizes) / sizeof(sizes[0]); r++) {
+            size_t num_rows = sizes[r];
+            fill_task_rows(rows, num_rows);
+
+            //the order a full sort of every key gives
+            size_t i;
+            for (i = 0; i < num_rows; i++) {
+                expected[i] = task_sort_key(&rows[i], sorts[s], i);
+            }
+            qsort(expected, num_rows, sizeof(uint64_t), compare_u64);
+
+            size_t wanted[] = { 0, 1, 2, 3, 10, num_rows / 2, num_rows - 1,
+                num_rows, num_rows + 1 };
+            size_t w;
+            for (w = 0; w < sizeof(wanted) / sizeof(wanted[0]); w++) {
+                size_t n = wanted[w];
+                if (n > num_rows + 1) {
+                    continue;
+                }
+                size_t count = sort_task_keys(rows, num_rows, n, sorts[s],
+                    keys);
+                CHECK(count == (n < num_rows ? n : num_rows));
+                CHECK(memcmp(keys, expected, count * sizeof(uint64_t)) == 0);
+            }
+        }
+    }
+
+    //busiest first, unmeasured last, ties in directory order
+    struct task_row cpu_rows[4];
+    memset(cpu_rows, 0, sizeof(cpu_rows));
+    cpu_rows[0].cpu_usage = -1;
+    cpu_rows[1].cpu_usage = 5;
+    cpu_rows[2].cpu_usage = 50;
+    cpu_rows[3].cpu_usage = 5;
+    size_t count = sort_task_keys(cpu_rows, 4, 3, SORT_CPU, keys);
+    CHECK(count == 3);
+    CHECK((uint32_t) keys[0] == 2);
+    CHECK((uint32_t) keys[1] == 1);
+    CHECK((uint32_t) keys[2] == 3);
+
+    free(rows);
+    free(expected);
+    free(keys);
+}
+
+/**
+ * Counts the changes of one kind for one task.
+ */
+size_t count_diffs(struct task_diff *diffs, size_t num_diffs,
+    enum task_change change, pid_t pid) {
+
+    size_t count = 0;
+    size_t i;
+    for (i = 0; i < num_diffs; i++) {
+        if (diffs[i].change == change && diffs[i].row.pid == pid) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void test_diff_states(void) {
+    struct inspector *insp = calloc(1, sizeof(struct inspector));
+    insp->task_columns = COL_BIT(TASK_COL_STATE) | COL_BIT(TASK_COL_NAME);
+
+    //enough tasks that the table has to grow past its first size
+    size_t num_rows = TASK_STATE_INIT * 2;
+    struct task_row *rows = calloc(num_rows, sizeof(struct task_row));
+    size_t i;
+    for (i = 0; i < num_rows; i++) {
+        rows[i].pid = 100 + i;
+        rows[i].start_time = 1000 + i;
+        rows[i].state_code = 'S';
+        strcpy(rows[i].task_name, "task");
+    }
+    insp->rows = rows;
+
+    //everything is new the first time, and nothing has changed after that
+    ssize_t changes = diff_task_rows(insp, num_rows);
+    CHECK(changes == (ssize_t) num_rows);
+    for (i = 0; i < (size_t) changes; i++) {
+        CHECK(insp->diffs[i].change == TASK_ADDED);
+    }
+    CHECK(diff_task_rows(insp, num_rows) == 0);
+    CHECK(insp->task_states.count == num_rows);
+
+    //a column that isn't shown doesn't count as a change
+    rows[0].state_code = 'R';
+    rows[1].threads = 9;
+    strcpy(rows[2].task_name, "renamed");
+    //a reused pid is a new task, and the old one is gone
+    rows[3].start_time = 99999;
+    //a task without a start time exited while it was being read
+    rows[4].start_time = 0;
+    changes = diff_task_rows(insp, num_rows);
+    CHECK(changes == 5);
+    CHECK(count_diffs(insp->diffs, changes, TASK_CHANGED, 100) == 1);
+    CHECK(count_diffs(insp->diffs, changes, TASK_CHANGED, 101) == 0);
+    CHECK(count_diffs(insp->diffs, changes, TASK_CHANGED, 102) == 1);
+    CHECK(count_diffs(insp->diffs, changes, TASK_ADDED, 103) == 1);
+    CHECK(count_diffs(insp->diffs, changes, TASK_EXITED, 103) == 1);
+    CHECK(count_diffs(insp->diffs, changes, TASK_EXITED, 104) == 1);
+
+    //the exited task's row is the one it was last seen with
+    for (i = 0; i < (size_t) changes; i++) {
+        if (insp->diffs[i].change == TASK_EXITED
+            && insp->diffs[i].row.pid == 103) {
+            CHECK(insp->diffs[i].row.start_time == 1003);
+        }
+    }
+
+    //the table now holds this collection, and an exited task is gone
+    CHECK(insp->task_states.count == num_rows - 1);
+    CHECK(task_state_find(&insp->task_states, 104) == NULL);
+    CHECK(task_state_find(&insp->task_states, 100)->row.state_code == 'R');
+    CHECK(diff_task_rows(insp, num_rows) == 0);
+
+    //threads are tracked by their tid
+    memset(rows, 0, 2 * sizeof(struct task_row));
+    rows[0].pid = 100;
+    rows[0].tid = 100;
+    rows[0].start_time = 1000;
+    rows[1].pid = 100;
+    rows[1].tid = 5000;
+    rows[1].start_time = 1000;
+    changes = diff_task_rows(insp, 2);
+    CHECK(task_state_find(&insp->task_states, 5000) != NULL);
+    CHECK(count_diffs(insp->diffs, changes, TASK_ADDED, 100) == 1);
+
+    task_state_free(&insp->task_states);
+    free(insp->diffs);
+    free(insp);
+    free(rows);
+}
+
+int main(void) {
+    test_swar_digits();
+    test_view_parse();
+    test_top_k();
+    test_diff_states();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("check_libinspector: all checks passed\n");
+    return 0;
+}
@@ -1,69 +1,515 @@
 #include <ctype.h>
-#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <math.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
-#define BUF_SZ 128
+#include "inspector_private.h"
+
+/* Number of cells on each row of the per-cpu heatmap */
+#define HEATMAP_WIDTH 64
+
+/* Size of the output buffer used by --format=jsonl|binary, the room left
+ * for one formatted float, and the version stamped on binary records */
+#define OUT_BUF_SZ (1024 * 1024)
+#define FLOAT_STR_SZ 32
+#define RECORD_VERSION 4
+
+/* Recording files: the magic and version in their header, the size of the
+ * header page, and the default span and size cap of a new recording */
+#define RING_MAGIC "INSPRING"
+#define RING_VERSION 1
+#define RING_HEADER_SZ 4096
+#define RECORD_HOURS 24
+#define RECORD_MAX_MB 1024
+
+/* Room for a formatted date and time, or a time argument of --range */
+#define TIME_STR_SZ 64
+
+/* Daemon mode: the sampling interval without -w, and how many events each
+ * epoll_wait() call takes */
+#define SERVE_INTERVAL_MS 1000
+#define SERVE_EVENTS 64
+
+/* Values returned by getopt_long() for options that have no short form */
+enum long_opts {
+    OPT_CPU_WINDOW = 256,
+    OPT_CPU_STATE,
+    OPT_FORMAT,
+    OPT_RECORD,
+    OPT_RECORD_HOURS,
+    OPT_RECORD_MAX_MB,
+    OPT_REPLAY,
+    OPT_AT,
+    OPT_RANGE,
+    OPT_SELF_STATS,
+    OPT_TOP,
+    OPT_SORT,
+    OPT_USER,
+    OPT_STATE,
+    OPT_PID_RANGE,
+    OPT_NAME,
+    OPT_SERVE,
+    OPT_SHM,
+    OPT_SHM_READ,
+    OPT_URING,
+    OPT_DIFF,
+};
 
-/* Preprocessor Directives */
-#ifndef DEBUG
-#define DEBUG 1
-#endif
+/* How a task list column is shown: its -o key, header and width */
+struct task_column_info {
+    const char *key;
+    const char *header;
+    int width;
+};
 
-/**
- * Logging functionality. Set DEBUG to 1 to enable logging, 0 to disable.
- */
-#define LOG(fmt, ...) \
-do { if (DEBUG) fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, \
-    __LINE__, __func__, __VA_ARGS__); } while (0)
+/* How the collected sections are written out */
+enum output_format {
+    FORMAT_TEXT,
+    FORMAT_JSONL,
+    FORMAT_BINARY,
+};
+
+/* The single buffer the jsonl and binary formats are serialised into. It is
+ * written to 'fd' whenever it fills up and at the end of every sample, so
+ * each sample costs a handful of write calls however many tasks it has. */
+struct out_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    int fd;
+};
+
+/* Record types of the binary format */
+enum record_type {
+    REC_SAMPLE = 1,
+    REC_SYSTEM,
+    REC_HARDWARE,
+    REC_CPU,
+    REC_TASK_SUMMARY,
+    REC_TASK,
+    REC_STAT,
+    REC_MEMINFO,
+    REC_LOADAVG,
+    REC_TASK_CHANGE,
+};
+
+/* Every binary record starts with this header. 'len' covers the header and
+ * the payload, and is always a multiple of 8, so a consumer can step from
+ * one record to the next (skipping types it doesn't know) and decode the
+ * payloads in place. All fields are in host byte order. */
+struct rec_header {
+    uint32_t len;
+    uint16_t type;
+    uint16_t version;
+};
+
+/* Starts each sample: the wall clock time it was taken at */
+struct rec_sample {
+    uint64_t time_ns;
+};
+
+struct rec_system {
+    uint64_t uptime;
+    char hostname[HOSTNAME_SZ];
+    char version[BUF_SZ];
+};
+
+struct rec_hardware {
+    uint64_t mem_total;
+    uint64_t mem_used;
+    float load_avg[3];
+    float cpu_usage;
+    uint32_t proc_units;
+    char cpu_model[BUF_SZ];
+};
+
+/* Only written with -c, one per cpu */
+struct rec_cpu {
+    uint32_t id;
+    float busy;
+    float user;
+    float system;
+    float iowait;
+    float steal;
+};
+
+struct rec_task_summary {
+    uint64_t interrupts;
+    uint64_t c_switch;
+    uint64_t forks;
+    uint32_t task_running;
+};
+
+/* 'uid' is NO_UID if the status file had none; names aren't resolved.
+ * 'cpu_usage' (version 2) is -1 unless the task's cpu time was sampled;
+ * the sizes (version 3) are in kB, and 0 unless they were read; 'tid'
+ * (version 4) is 0 unless the row is one thread of a -L listing. */
+struct rec_task {
+    int32_t pid;
+    uint32_t uid;
+    uint32_t threads;
+    char state[STATE_SZ];
+    char task_name[TASK_NAME_SZ];
+    float cpu_usage;
+    uint64_t rss_kb;
+    uint64_t vsz_kb;
+    uint64_t swap_kb;
+    int32_t tid;
+};
+
+/* Written instead of task records with --diff. 'change' is an enum
+ * task_change; an exited task's record holds its row as last seen. */
+struct rec_task_change {
+    uint32_t change;
+    struct rec_task task;
+};
+
+/* The aggregate cpu line and counters of the stat file (recordings only) */
+struct rec_stat {
+    uint64_t cpu[NUM_CPU_STATES];
+    uint64_t intr;
+    uint64_t ctxt;
+    uint64_t btime;
+    uint64_t processes;
+    uint64_t procs_running;
+    uint64_t procs_blocked;
+};
+
+/* Recordings only */
+struct rec_meminfo {
+    struct meminfo mem;
+};
+
+/* Recordings only */
+struct rec_loadavg {
+    struct loadavg load;
+};
+
+/* The first page of a recording. The index of samples follows it, and the
+ * data ring (the samples themselves, as binary records) follows the index.
+ * 'head' counts every sample ever written and 'tail' is the oldest one
+ * still intact; sample 'seq' is described by index slot seq % index_cap.
+ * The writer publishes a sample by storing 'head' last, so a reader that
+ * loads 'head' first only ever sees complete samples. The fields that never
+ * change between samples are stored here once, after the first sample. */
+struct ring_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t interval_ms;
+    uint64_t index_cap;
+    uint64_t data_off;
+    uint64_t data_size;
+    uint64_t write_pos;
+    uint64_t head;
+    uint64_t tail;
+    uint32_t proc_units;
+    char hostname[HOSTNAME_SZ];
+    char kernel_version[BUF_SZ];
+    char cpu_model[BUF_SZ];
+};
+
+/* Where one recorded sample lives in the data ring */
+struct ring_entry {
+    uint64_t time_ns;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t num_tasks;
+};
+
+/* A recording file mapped into memory. The ring is only sized (and the
+ * file created) once the first sample shows how big a sample is; samples
+ * are serialised into 'buf' and copied into the ring. Nothing is ever
+ * synced explicitly: the kernel writes the pages back on its own, so the
+ * recorder never blocks on the disk. */
+struct recorder {
+    const char *path;
+    long interval_ms;
+    long hours;
+    size_t max_sz;
+    int fd;
+    char *map;
+    size_t map_sz;
+    struct ring_header *header;
+    struct ring_entry *index;
+    char *data;
+    struct out_buf buf;
+};
+
+/* The fixed records at the front of one recorded sample, pointing into the
+ * mapping. 'tasks' is the first task row record, or NULL if there are none. */
+struct replay_sample {
+    uint64_t time_ns;
+    uint32_t num_tasks;
+    const struct rec_stat *stat;
+    const struct meminfo *mem;
+    const struct loadavg *load;
+    const char *tasks;
+    const char *end;
+};
+
+/* Minimum, maximum and running total of one value over a replayed range */
+struct range_stat {
+    double min;
+    double max;
+    double sum;
+    size_t count;
+};
+
+/* Everything printed for a replayed range */
+struct range_summary {
+    uint64_t from_ns;
+    uint64_t to_ns;
+    size_t samples;
+    struct range_stat cpu;
+    struct range_stat mem;
+    struct range_stat tasks;
+    struct range_stat load;
+};
+
+/* Everything the command keeps between samples besides the collector
+ * itself: what to show and how, the buffer the non-text formats go
+ * through, and the recording being written, if any. */
+struct cli {
+    struct inspector *insp;
+    struct inspector_sections options;
+
+    /* Task list columns in the order shown, and the same as a mask of
+     * COL_BITs */
+    enum task_column column_order[NUM_TASK_COLS];
+    size_t num_columns;
+    unsigned int task_columns;
+
+    /* Output format, and the buffer the non-text formats go through */
+    enum output_format format;
+    struct out_buf out;
+
+    /* Set when recording instead of printing */
+    struct recorder *recorder;
+
+    /* Set when publishing samples in shared memory */
+    struct inspector_shm *shm;
+
+    /* Set when printing how the tasks changed since the previous sample
+     * instead of the task list (--diff) */
+    bool diff;
+
+    /* Rows decoded from a replayed sample */
+    struct task_row *replay_rows;
+    size_t replay_cap;
+};
+
+/* One rendered watch mode frame, or a line of one */
+struct frame {
+    char *text;
+    size_t len;
+};
+
+/* The sample a daemon (--serve) sends its clients, rendered once. When the
+ * next sample replaces it while clients are still being sent it, it is
+ * 'retired' and lives on until the last of them is done. */
+struct serve_response {
+    struct out_buf buf;
+    int readers;
+    bool retired;
+};
+
+/* A connected client, and how much of its response it has been sent */
+struct serve_client {
+    int fd;
+    struct serve_response *response;
+    size_t sent;
+    struct serve_client *prev;
+    struct serve_client *next;
+};
+
+/* A daemon: its listening socket, the timer that paces the samples, the
+ * epoll instance that waits on both and on the clients, and the response
+ * being served. 'spare' is an old response kept for reuse, so a daemon
+ * whose clients keep up allocates nothing per sample. */
+struct server {
+    const char *path;
+    int listen_fd;
+    int timer_fd;
+    int epoll_fd;
+    struct serve_response *current;
+    struct serve_response *spare;
+    struct serve_client *clients;
+};
+
+/* Set by SIGINT/SIGTERM to end watch mode */
+volatile sig_atomic_t watch_stop = 0;
 
 
 /* Function prototypes */
 void print_usage(char *argv[]);
-char *next_token(char **str_ptr, const char *delim);
-void get_hostname(char* host_location, char* hostname);
-void get_kernel_version(char* version_location, char* version);
-void get_uptime(char* procfs_loc, char* uptime);
-void get_CPU_mode(char* procfs_loc, char* CPU_mode);
-int get_proc_unit(char* procfs_loc);
-void get_load_avg(char* procfs_loc, char* load_avg_1, char* load_avg_5, char* load_avg_15);
-int get_task_running(char* procfs_loc);
-int is_digit(char d_name[], int len);
-void get_interrupts(char* procfs_loc, char interrupts[], char c_switch[], char fork[]);
-void get_task_list(char* procfs_loc, char* process, char state[], char task_name[], char user[], char task[]);
-void get_memo_info(char* procfs_loc, char total[], char used[]);
-float get_cpu_usage(char* procfs_loc);
-
-/* This struct is a collection of booleans that controls whether or not the
- * various sections of the output are enabled. */
-struct view_opts {
-    bool hardware;
-    bool system;
-    bool task_list;
-    bool task_summary;
-};
+int run_sample(struct cli *cli, FILE *out);
+int collect_sample(struct cli *cli, struct inspector_snapshot *snap);
+int emit_sample(struct cli *cli, FILE *out, struct inspector_snapshot *snap);
+void handle_stop(int signo);
+void install_stop_handlers(void);
+void wait_for_tick(struct timespec *tick, long interval_ms);
+int run_watch(struct cli *cli, long interval_ms);
+double timeval_diff(struct timeval *end, struct timeval *start);
+void draw_frame(FILE *out, struct frame *prev, struct frame *next, bool tty, bool full, struct winsize *size);
+bool frame_next_line(struct frame *rest, struct frame *line);
+int serve_open(struct server *srv, long interval_ms);
+void serve_close(struct server *srv);
+int serve_render(struct cli *cli, struct server *srv);
+void serve_accept(struct server *srv);
+bool serve_write(struct serve_client *client);
+void serve_release(struct server *srv, struct serve_client *client);
+int run_serve(struct cli *cli, struct server *srv, long interval_ms);
+int run_publish(struct cli *cli, long interval_ms);
+int run_shm_read(struct cli *cli, const char *name, FILE *out);
+void print_system_info(FILE *out, struct system_info *info);
+void print_hardware_info(FILE *out, struct hardware_info *info, struct cpu_breakdown *breakdown);
+void print_cpu_heatmap(FILE *out, struct cpu_breakdown *breakdown);
+void print_cpu_breakdown(FILE *out, struct cpu_breakdown *breakdown, bool heatmap);
+void print_task_summary(FILE *out, struct task_summary *summary);
+void print_task_list(FILE *out, struct task_row *rows, size_t num_rows, struct inspector *insp, const enum task_column *columns, size_t num_columns);
+void print_task_diffs(FILE *out, struct task_diff *diffs, size_t num_diffs, struct inspector *insp, const enum task_column *columns, size_t num_columns);
+void print_task_header(FILE *out, const enum task_column *columns, size_t num_columns, bool marked);
+void print_task_row(FILE *out, struct task_row *row, struct inspector *insp, const enum task_column *columns, size_t num_columns, const char *marker);
+const char *format_task_cell(struct task_row *row, enum task_column column, struct inspector *insp, char *buf, size_t buf_sz);
+int out_buf_init(struct out_buf *ob, int fd);
+void out_buf_free(struct out_buf *ob);
+int out_buf_flush(struct out_buf *ob);
+char *out_buf_reserve(struct out_buf *ob, size_t size);
+void out_put(struct out_buf *ob, const char *data, size_t len);
+void out_put_str(struct out_buf *ob, const char *str);
+void out_put_u64(struct out_buf *ob, uint64_t value);
+void out_put_float(struct out_buf *ob, float value);
+void out_put_json_str(struct out_buf *ob, const char *str);
+size_t utf8_seq_len(const unsigned char *str);
+void write_jsonl(struct out_buf *ob, struct inspector_snapshot *snap, struct inspector *insp, unsigned int columns);
+void write_task_jsonl(struct out_buf *ob, struct task_row *row, struct inspector *insp, unsigned int columns, const char *change);
+void *out_buf_record(struct out_buf *ob, enum record_type type, size_t payload_sz);
+void write_task_records(struct out_buf *ob, struct task_row *rows, size_t num_rows);
+void write_task_changes(struct out_buf *ob, struct task_diff *diffs, size_t num_diffs);
+void fill_task_record(struct rec_task *rec, const struct task_row *row);
+int recorder_open(struct recorder *rec);
+int recorder_check(struct recorder *rec, off_t file_sz);
+int recorder_map(struct recorder *rec, size_t map_sz, int prot);
+int recorder_create(struct recorder *rec, size_t sample_len);
+int recorder_append(struct recorder *rec, struct timespec *time, const char *sample, size_t len, uint32_t num_tasks);
+void recorder_close(struct recorder *rec);
+void write_record_sample(struct out_buf *ob, struct inspector_snapshot *snap);
+int record_sample(struct cli *cli);
+int run_record(struct cli *cli, long interval_ms);
+int recorder_load(struct recorder *rec);
+uint64_t ring_lower_bound(struct recorder *rec, uint64_t first, uint64_t last, uint64_t time_ns);
+int replay_decode(struct recorder *rec, uint64_t seq, struct replay_sample *sample);
+size_t replay_tasks(struct replay_sample *sample, struct task_row *rows);
+float replay_cpu_usage(struct recorder *rec, uint64_t seq, struct replay_sample *sample);
+int parse_replay_time(const char *arg, uint64_t latest_ns, uint64_t *time_ns);
+void format_time_ns(uint64_t time_ns, char *buf, size_t buf_sz);
+void range_add(struct range_stat *stat, double value);
+double range_avg(struct range_stat *stat);
+void print_range_summary(FILE *out, struct range_summary *summary);
+void write_range_jsonl(struct out_buf *ob, struct range_summary *summary);
+int replay_range(struct cli *cli, struct recorder *rec, FILE *out, uint64_t from_ns, uint64_t to_ns);
+int replay_at(struct cli *cli, struct recorder *rec, FILE *out, uint64_t time_ns);
+int run_replay(struct cli *cli, struct recorder *rec, FILE *out, const char *at, const char *range);
+void write_binary(struct out_buf *ob, struct inspector_snapshot *snap);
+int parse_user(const char *arg, uid_t *uid);
+int parse_pid_range(const char *arg, pid_t *pid_min, pid_t *pid_max);
+int parse_long(const char *arg, long min, long max, long *value);
+int parse_double(const char *arg, double min, double max, double *value);
+int parse_task_columns(const char *arg, enum task_column order[], size_t *count);
+void add_task_column(enum task_column order[], size_t *count, enum task_column column);
 
 void print_usage(char *argv[])
 {
-    printf("Usage: %s [-ahlrst] [-p procfs_dir]\n" , argv[0]);
+    printf("Usage: %s [-achlLmrst] [-j workers] [-o columns] [-p procfs_dir]\n"
+        "       [-w interval] [--cpu-window=ms] [--cpu-state=file] [--format=fmt]\n"
+        "       [--record=file [--record-hours=h] [--record-max-mb=mb]]\n"
+        "       [--replay=file [--at=time | --range=from,[to]]]\n"
+        "       [--self-stats] [--top=N] [--sort=key]\n"
+        "       [--user=user] [--state=letters] [--pid-range=min-max] [--name=prefix]\n"
+        "       [--serve=socket] [--shm[=name]] [--shm-read[=name]] [--uring]\n"
+        "       [--diff]\n" , argv[0]);
     printf("\n");
     printf("Options:\n"
         "    * -a              Display all (equivalent to -lrst, default)\n"
+        "    * -c              Per-CPU Breakdown (adds a per-core heatmap to -r)\n"
         "    * -h              Help/usage information\n"
+        "    * -j workers      Scan the task list with this many threads\n"
+        "                      (0: one per online CPU, default: 1)\n"
         "    * -l              Task List\n"
+        "    * -L              Task list of every thread, with its TID and CPU usage\n"
+        "    * -m              Add RSS, VSZ and swap columns to the task list\n"
+        "    * -o columns      Task list of these columns, in this order: pid, tid,\n"
+        "                      state, name, user, threads, cpu, rss, vsz, swap\n"
         "    * -p procfs_dir   Change the expected procfs mount point (default: /proc)\n"
         "    * -r              Hardware Information\n"
         "    * -s              System Information\n"
-        "    * -t              Task Information\n");
+        "    * -t              Task Information\n"
+        "    * -w interval     Watch mode: refresh every 'interval' seconds\n"
+        "    * --cpu-window=ms Length of the CPU usage sampling window (default: 1000)\n"
+        "    * --cpu-state=file\n"
+        "                      Persist the last CPU sample in 'file' and measure\n"
+        "                      usage since the previous run, without waiting\n"
+        "    * --format=fmt    Output format: text (default), jsonl (one JSON\n"
+        "                      object per line) or binary (length-prefixed records)\n"
+        "    * --record=file   Append samples to a recording instead of printing\n"
+        "                      (once, or every -w interval)\n"
+        "    * --record-hours=h\n"
+        "                      Hours of samples a new recording holds (default: 24)\n"
+        "    * --record-max-mb=mb\n"
+        "                      Upper bound on a new recording's size (default: 1024)\n"
+        "    * --replay=file   Show a recorded sample instead of the live system\n"
+        "    * --at=time       Replay the sample at 'time' (default: the newest)\n"
+        "    * --range=from,[to]\n"
+        "                      Replay min/avg/max over a range of samples\n"
+        "                      Times are seconds since the epoch, or offsets back\n"
+        "                      from the newest sample such as -90, -15m, -2h, -1d\n"
+        "    * --self-stats    Report the time, opens, reads, bytes read and\n"
+        "                      allocations of each collector on stderr\n"
+        "    * --top=N         Task list of the N busiest tasks, with their CPU usage\n"
+        "                      over the sampling window\n"
+        "    * --sort=key      Order the task list by mem (RSS), cpu, pid or threads\n"
+        "    * --user=user     Only list the tasks of this user (name or uid), matched\n"
+        "                      on their effective uid; the user column shows the\n"
+        "                      real uid, so setuid tasks may show another user\n"
+        "    * --state=letters Only list tasks in one of these states, e.g. D or RD\n"
+        "    * --pid-range=min-max\n"
+        "                      Only list tasks with PIDs in this range (either end\n"
+        "                      may be left out)\n"
+        "    * --name=prefix   Only list tasks whose name starts with prefix\n"
+        "    * --serve=socket  Daemon mode: collect every -w interval (default: 1s)\n"
+        "                      and send the latest sample, in the --format chosen,\n"
+        "                      to every client that connects to this Unix socket\n"
+        "    * --shm[=name]    Publish the -s, -r and -t sections of every sample\n"
+        "                      in shared memory segment 'name' (default: /inspector),\n"
+        "                      every -w interval (default: 1s), without printing\n"
+        "    * --shm-read[=name]\n"
+        "                      Show the sample published in shared memory\n"
+        "    * --uring         Read the task status files in batches through\n"
+        "                      io_uring, where the kernel allows it\n"
+        "    * --diff          Only list the tasks that were added, exited or\n"
+        "                      changed state, name, user or thread count since\n"
+        "                      the previous sample (every -w interval)\n");
     printf("\n");
 }
 
@@ -77,21 +523,138 @@ int main(int argc, char *argv[])
     /* Set to true if we are using a non-default proc location */
     bool alt_proc = false;
 
-    struct view_opts all_on = { true, true, true, true };
-    struct view_opts options = { false, false, false, false };
+    /* Set to true once any section has been requested explicitly */
+    bool sections_given = false;
+
+    /* Number of threads used to build the task list, and whether they
+     * read status files through io_uring */
+    int num_workers = 1;
+    bool uring = false;
+    long workers_arg;
+
+    /* Refresh interval for watch mode (0: run once), given in seconds */
+    long watch_ms = 0;
+    double watch_secs;
+
+    /* How the sections are written out */
+    enum output_format format = FORMAT_TEXT;
+
+    /* Recording to write samples to instead of printing, if any */
+    struct recorder recorder = {
+        .hours = RECORD_HOURS,
+        .max_sz = (size_t) RECORD_MAX_MB * 1024 * 1024,
+        .fd = -1,
+    };
+    long record_max_mb;
+
+    /* Recording to replay instead of reading procfs, and what to show */
+    struct recorder replay = { .fd = -1 };
+    const char *replay_at_arg = NULL;
+    const char *replay_range_arg = NULL;
+
+    /* Number of busiest tasks to list (0: list every task) */
+    long top_n = 0;
+
+    /* Task list order, the columns picked with -o, and the ones the other
+     * options add to them */
+    enum task_sort sort = SORT_NONE;
+    enum task_column column_order[NUM_TASK_COLS];
+    size_t num_columns = 0;
+    unsigned int task_columns = 0;
+
+    /* Which tasks to list (by default, all of them), and whether to list
+     * each of their threads */
+    struct task_filter filter = { .uid = NO_UID };
+    bool list_threads = false;
+
+    /* CPU usage sampling window and optional persisted sample */
+    long cpu_window_ms = CPU_WINDOW_MS;
+    const char *cpu_state = NULL;
+
+    /* Socket to serve samples on instead of printing them, if any */
+    struct server server = { .path = NULL };
+
+    /* Shared memory segments to publish samples to, or to print the
+     * published sample of */
+    const char *shm_name = NULL;
+    const char *shm_read_name = NULL;
+
+    /* List the task changes between samples instead of the tasks */
+    bool diff = false;
+
+    static struct option long_options[] = {
+        { "cpu-window", required_argument, NULL, OPT_CPU_WINDOW },
+        { "cpu-state", required_argument, NULL, OPT_CPU_STATE },
+        { "format", required_argument, NULL, OPT_FORMAT },
+        { "record", required_argument, NULL, OPT_RECORD },
+        { "record-hours", required_argument, NULL, OPT_RECORD_HOURS },
+        { "record-max-mb", required_argument, NULL, OPT_RECORD_MAX_MB },
+        { "replay", required_argument, NULL, OPT_REPLAY },
+        { "at", required_argument, NULL, OPT_AT },
+        { "range", required_argument, NULL, OPT_RANGE },
+        { "self-stats", no_argument, NULL, OPT_SELF_STATS },
+        { "top", required_argument, NULL, OPT_TOP },
+        { "sort", required_argument, NULL, OPT_SORT },
+        { "user", required_argument, NULL, OPT_USER },
+        { "state", required_argument, NULL, OPT_STATE },
+        { "pid-range", required_argument, NULL, OPT_PID_RANGE },
+        { "name", required_argument, NULL, OPT_NAME },
+        { "serve", required_argument, NULL, OPT_SERVE },
+        { "shm", optional_argument, NULL, OPT_SHM },
+        { "shm-read", optional_argument, NULL, OPT_SHM_READ },
+        { "uring", no_argument, NULL, OPT_URING },
+        { "diff", no_argument, NULL, OPT_DIFF },
+        { NULL, 0, NULL, 0 }
+    };
+
+    struct inspector_sections all_on = { true, true, true, true, false };
+    struct inspector_sections options = { false, false, false, false, false };
 
     int c;
     opterr = 0;
-    while ((c = getopt(argc, argv, "ahlp:rst")) != -1) {
+    while ((c = getopt_long(argc, argv, "achj:lLmo:p:rstw:", long_options, NULL)) != -1) {
         switch (c) {
             case 'a':
             options = all_on;
+            sections_given = true;
+            break;
+            case 'c':
+            options.per_cpu = true;
+            sections_given = true;
             break;
             case 'h':
             print_usage(argv);
             return 0;
+            case 'j':
+            if (parse_long(optarg, 0, LONG_MAX, &workers_arg) == -1) {
+                fprintf(stderr, "Invalid worker count `%s'.\n", optarg);
+                return 1;
+            }
+            //0 asks for one per online cpu
+            if (workers_arg == 0) {
+                workers_arg = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            num_workers = workers_arg > MAX_WORKERS ? MAX_WORKERS : workers_arg;
+            break;
             case 'l':
             options.task_list = true;
+            sections_given = true;
+            break;
+            case 'L':
+            list_threads = true;
+            task_columns |= COL_BIT(TASK_COL_TID) | COL_BIT(TASK_COL_CPU);
+            options.task_list = true;
+            sections_given = true;
+            break;
+            case 'm':
+            task_columns |= TASK_COLS_MEM;
+            break;
+            case 'o':
+            if (parse_task_columns(optarg, column_order, &num_columns) == -1) {
+                return 1;
+            }
+            options.task_list = true;
+            sections_given = true;
             break;
             case 'p':
             procfs_loc = optarg;
@@ -99,17 +662,159 @@ int main(int argc, char *argv[])
             break;
             case 'r':
             options.hardware = true;
+            sections_given = true;
             break;
             case 's':
             options.system = true;
+            sections_given = true;
             break;
             case 't':
             options.task_summary = true;
+            sections_given = true;
+            break;
+            case 'w':
+            if (parse_double(optarg, 0, LONG_MAX / 1000, &watch_secs) == -1
+                || watch_secs * 1000 < 1) {
+                fprintf(stderr, "Invalid watch interval `%s'.\n", optarg);
+                return 1;
+            }
+            watch_ms = watch_secs * 1000;
+            break;
+            case OPT_CPU_WINDOW:
+            if (parse_long(optarg, 0, LONG_MAX, &cpu_window_ms) == -1) {
+                fprintf(stderr, "Invalid CPU window `%s'.\n", optarg);
+                return 1;
+            }
+            break;
+            case OPT_CPU_STATE:
+            cpu_state = optarg;
+            break;
+            case OPT_FORMAT:
+            if (strcmp(optarg, "text") == 0) {
+                format = FORMAT_TEXT;
+            } else if (strcmp(optarg, "jsonl") == 0) {
+                format = FORMAT_JSONL;
+            } else if (strcmp(optarg, "binary") == 0) {
+                format = FORMAT_BINARY;
+            } else {
+                fprintf(stderr, "Unknown output format `%s'.\n", optarg);
+                return 1;
+            }
+            break;
+            case OPT_RECORD:
+            recorder.path = optarg;
+            break;
+            case OPT_RECORD_HOURS:
+            if (parse_long(optarg, 1, INT_MAX / 3600, &recorder.hours) == -1) {
+                fprintf(stderr, "Invalid recording length `%s'.\n", optarg);
+                return 1;
+            }
+            break;
+            case OPT_RECORD_MAX_MB:
+            if (parse_long(optarg, 1, SIZE_MAX / (1024 * 1024), &record_max_mb) == -1) {
+                fprintf(stderr, "Invalid recording size `%s'.\n", optarg);
+                return 1;
+            }
+            recorder.max_sz = (size_t) record_max_mb * 1024 * 1024;
+            break;
+            case OPT_REPLAY:
+            replay.path = optarg;
+            break;
+            case OPT_AT:
+            replay_at_arg = optarg;
+            break;
+            case OPT_RANGE:
+            replay_range_arg = optarg;
+            break;
+            case OPT_SELF_STATS:
+            if (SELF_STATS == 0) {
+                fprintf(stderr, "Built without self-stats support.\n");
+                return 1;
+            }
+            self_stats_on = true;
+            break;
+            case OPT_TOP:
+            if (parse_long(optarg, 1, LONG_MAX, &top_n) == -1) {
+                fprintf(stderr, "Invalid task count `%s'.\n", optarg);
+                return 1;
+            }
+            options.task_list = true;
+            sections_given = true;
+            task_columns |= COL_BIT(TASK_COL_CPU);
+            break;
+            case OPT_SORT:
+            if (strcmp(optarg, "mem") == 0) {
+                sort = SORT_MEM;
+                task_columns |= TASK_COLS_MEM;
+            } else if (strcmp(optarg, "cpu") == 0) {
+                sort = SORT_CPU;
+                task_columns |= COL_BIT(TASK_COL_CPU);
+            } else if (strcmp(optarg, "pid") == 0) {
+                sort = SORT_PID;
+            } else if (strcmp(optarg, "threads") == 0) {
+                sort = SORT_THREADS;
+            } else {
+                fprintf(stderr, "Unknown sort key `%s'.\n", optarg);
+                return 1;
+            }
+            options.task_list = true;
+            sections_given = true;
+            break;
+            case OPT_USER:
+            if (parse_user(optarg, &filter.uid) == -1) {
+                fprintf(stderr, "Unknown user `%s'.\n", optarg);
+                return 1;
+            }
+            options.task_list = true;
+            sections_given = true;
+            break;
+            case OPT_STATE:
+            if (optarg[0] == '\0' || strlen(optarg) >= STATE_SZ) {
+                fprintf(stderr, "Invalid state list `%s'.\n", optarg);
+                return 1;
+            }
+            strcpy(filter.states, optarg);
+            options.task_list = true;
+            sections_given = true;
+            break;
+            case OPT_PID_RANGE:
+            if (parse_pid_range(optarg, &filter.pid_min, &filter.pid_max) == -1) {
+                fprintf(stderr, "Invalid PID range `%s'.\n", optarg);
+                return 1;
+            }
+            options.task_list = true;
+            sections_given = true;
+            break;
+            case OPT_NAME:
+            filter.name = optarg;
+            filter.name_len = strlen(optarg);
+            options.task_list = true;
+            sections_given = true;
+            break;
+            case OPT_SERVE:
+            server.path = optarg;
+            break;
+            case OPT_SHM:
+            shm_name = optarg != NULL ? optarg : SHM_NAME;
+            break;
+            case OPT_SHM_READ:
+            shm_read_name = optarg != NULL ? optarg : SHM_NAME;
+            break;
+            case OPT_URING:
+            uring = true;
+            break;
+            case OPT_DIFF:
+            diff = true;
+            options.task_list = true;
+            sections_given = true;
             break;
             case '?':
-            if (optopt == 'p') {
+            if (optopt == 'p' || optopt == 'j' || optopt == 'o' || optopt == 'w') {
                 fprintf(stderr,
                     "Option -%c requires an argument.\n", optopt);
+            } else if (optopt == 0 || optopt >= OPT_CPU_WINDOW) {
+                fprintf(stderr, "Unknown option or missing argument `%s'.\n",
+                    argv[optind - 1]);
             } else if (isprint(optopt)) {
                 fprintf(stderr, "Unknown option `-%c'.\n", optopt);
             } else {
@@ -125,955 +830,2489 @@ int main(int argc, char *argv[])
 
     if (alt_proc == true) {
         LOG("Using alternative proc directory: %s\n", procfs_loc);
-
-        /* Remove two arguments from the count: one for -p, one for the
-         * directory passed in: */
-        argc = argc - 2;
     }
 
-    if (argc <= 1) {
-        /* No args (or -p only). Enable all options: */
+    if (sections_given == false) {
+        /* No section flags (only -p or -j, if anything). Enable all options: */
         options = all_on;
     }
 
-    LOG("Options selected: %s%s%s%s\n",
+    LOG("Options selected: %s%s%s%s%s\n",
         options.hardware ? "hardware " : "",
+        options.per_cpu ? "per_cpu " : "",
         options.system ? "system " : "",
         options.task_list ? "task_list " : "",
         options.task_summary ? "task_summary" : "");
 
-    //read the given directory if provided
-    //if does not exist, exit
-    int procfs_fd = open(procfs_loc, O_RDONLY);
-    if (procfs_fd == -1) {
-        perror("open");
-        close(procfs_fd);
-        return EXIT_FAILURE;
+    //without -o the base columns come first
+    int col;
+    if (num_columns == 0) {
+        task_columns |= TASK_COLS_BASE;
     }
-
-    if(options.system) {
-        //read the hostname
-        char *hostname = calloc(40, sizeof(char));
-        get_hostname(procfs_loc, hostname);
-
-        //read the kernel version
-        char *version = calloc(1024, sizeof(char));
-        get_kernel_version(procfs_loc, version);
-
-        //read uptime
-        char *temp = calloc(1024, sizeof(char));
-        get_uptime(procfs_loc, temp);
-        int uptime = atof(temp);
-        int uptime_temp = uptime;
-
-        //calculate year day hour min sec
-        int year = uptime_temp/31536000;
-        if(year > 0) {
-            uptime_temp-=year*31536000;
-        }
-
-        int day = uptime_temp/86400;
-        if(day > 0){
-            uptime_temp-=day*86400;
-        }
-
-        int hour = uptime_temp/3600;
-        if(hour > 0) {
-            uptime_temp-=hour*3600;
-        }
-
-        int min = uptime_temp/60;
-        if(min > 0) {
-            uptime_temp-=min*60;
+    for (col = 0; col < NUM_TASK_COLS; col++) {
+        if (task_columns & COL_BIT(col)) {
+            add_task_column(column_order, &num_columns, col);
         }
+    }
+    task_columns = 0;
+    size_t i;
+    for (i = 0; i < num_columns; i++) {
+        task_columns |= COL_BIT(column_order[i]);
+    }
 
-        int second = uptime_temp;
-        printf("System Information\n");
-        printf("------------------\n" );
-        printf("Hostname: %s\n", hostname);
-        printf("Kernel Version: %s\n", version);
-        printf("Uptime: ");
-        if(year > 0) {
-            printf("%d years, ", year);
-        }
-        if(day > 0) {
-            printf("%d days, ", day);
-        }
-        if(hour > 0) {
-            printf("%d hours, ", hour);
-        }
-        if(min > 0) {
-            printf("%d minutes, ", min);
-        }
-        if(second > 0) {
-            printf("%d seconds", second);
-        }
-        printf("\n");
+    //a daemon or publisher samples once a second unless told otherwise
+    bool daemon = server.path != NULL || shm_name != NULL;
+    if (daemon && watch_ms == 0) {
+        watch_ms = SERVE_INTERVAL_MS;
+    }
 
-        free(hostname);
-        free(version);
-        free(temp);
+    struct inspector_config config = {
+        .procfs = procfs_loc,
+        .sections = options,
+        .hold_files = watch_ms > 0,
+        .num_workers = num_workers,
+        .uring = uring,
+        .cpu_window_ms = cpu_window_ms,
+        .cpu_state = cpu_state,
+        .list_threads = list_threads,
+        .task_columns = task_columns,
+        .sort = sort,
+        .top_n = top_n,
+        .filter = filter,
+        .diff = diff,
+    };
+
+    //consecutive refreshes measure cpu usage against each other
+    if (watch_ms > 0 && config.cpu_window_ms > watch_ms) {
+        config.cpu_window_ms = watch_ms;
     }
 
-    if(options.hardware) {
+    //a daemon's samples are an interval apart give or take the time they
+    //take, and it mustn't sleep through a window with clients waiting
+    if (daemon && config.cpu_window_ms > watch_ms / 2) {
+        config.cpu_window_ms = watch_ms / 2;
+    }
 
-        //read cpu mode
-        char *CPU_mode = calloc(50, sizeof(char));
-        get_CPU_mode(procfs_loc, CPU_mode);
+    //a publisher on its own only publishes the sections that fit in the
+    //segment
+    if (shm_name != NULL && server.path == NULL) {
+        config.sections.task_list = false;
+        config.sections.per_cpu = false;
+    }
 
-        //read process unit
-        int proc_unit = get_proc_unit(procfs_loc);
+    //a recording keeps the raw counters and every column a task record
+    //has but the cpu usage, in directory order
+    if (recorder.path != NULL) {
+        config.sections = (struct inspector_sections) { .task_list = true };
+        config.raw = true;
+        config.task_columns = (TASK_COLS_BASE | task_columns)
+            & ~COL_BIT(TASK_COL_CPU);
+        config.sort = SORT_NONE;
+        config.top_n = 0;
+    }
 
-        //read load avg
-        char *load_avg_1 = calloc(10, sizeof(char));
-        char *load_avg_5 = calloc(10, sizeof(char));
-        char *load_avg_15 = calloc(10, sizeof(char));
-        get_load_avg(procfs_loc, load_avg_1, load_avg_5, load_avg_15);
+    //a daemon's clients and a recording each get samples on their own,
+    //with no previous one to compare against
+    if (daemon || recorder.path != NULL) {
+        config.diff = false;
+    }
 
-        //read meminfo
-        char total[10];
-        char used[10];
-        get_memo_info(procfs_loc, total, used);
+    struct cli cli = {
+        .options = options,
+        .num_columns = num_columns,
+        .task_columns = task_columns,
+        .format = format,
+        .diff = config.diff,
+    };
+    memcpy(cli.column_order, column_order, sizeof(column_order));
 
-        //calculate memo
-        float result = ((float)(atoi(used)))/atoi(total)*100;
-        float total_float = ((float) atoi(total))/1024/1024;
-        float used_float = ((float) atoi(used))/1024/1024;
-        int num = result/5;
-        int remain = 20-num;
-        int i;
+    //read the given directory if provided
+    //if does not exist, exit (a published sample needs no collector)
+    if (shm_read_name == NULL) {
+        cli.insp = inspector_init(&config);
+        if (cli.insp == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
 
-        //read cpu usage
-        float usage = get_cpu_usage(procfs_loc)*100;
-        int usage_num = usage/5;
-        int usage_remain = 20-usage_num;
+    //from here on, a failure still goes through the cleanup below
+    int result = 0;
+    if (shm_name != NULL) {
+        cli.shm = inspector_shm_create(shm_name);
+        if (cli.shm == NULL) {
+            result = -1;
+        }
+    }
 
-        printf("Hardware Information\n");
-        printf("------------------\n" );
-        printf("CPU Model: %s\n", CPU_mode);
-        printf("Processing Units: %d\n", proc_unit);
-        printf("Load Average (1/5/15 min) %s %s %s\n", load_avg_1, load_avg_5, load_avg_15);
-        printf("CPU Usage:\t[");
+    if (result == 0 && format != FORMAT_TEXT
+        && out_buf_init(&cli.out, STDOUT_FILENO) == -1) {
+        result = -1;
+    }
 
-        for(i = 0; i < usage_num; i++) {
-            printf("#");
-        }
-        for(i = 0; i < usage_remain; i++) {
-            printf("-");
+    //samples are recorded at the watch interval, or sized as if once a second
+    if (result == 0 && recorder.path != NULL) {
+        recorder.interval_ms = watch_ms > 0 ? watch_ms : 1000;
+        if (recorder_open(&recorder) == -1) {
+            recorder_close(&recorder);
+            result = -1;
+        } else {
+            cli.recorder = &recorder;
         }
-        printf("] %.1f%%\n", usage);
+    }
 
-        printf("Memory Usage:\t[");
-        
-        for (i = 0; i < num; i++) {
-            printf("#");
+    if (result == -1) {
+        //nothing to run
+    } else if (shm_read_name != NULL) {
+        result = run_shm_read(&cli, shm_read_name, stdout);
+    } else if (replay.path != NULL) {
+        result = recorder_load(&replay);
+        if (result == 0) {
+            result = run_replay(&cli, &replay, stdout, replay_at_arg,
+                replay_range_arg);
         }
-        for(i = 0; i < remain; i++) {
-            printf("-");
-        }
-        printf("] %.1f%% (%.1f GB / %.1f GB)\n", result, used_float, total_float);
-        printf("\n");
+        recorder_close(&replay);
+    } else if (cli.recorder != NULL) {
+        result = run_record(&cli, watch_ms);
+    } else if (server.path != NULL) {
+        result = run_serve(&cli, &server, watch_ms);
+    } else if (shm_name != NULL) {
+        result = run_publish(&cli, watch_ms);
+    } else if (watch_ms > 0) {
+        result = run_watch(&cli, watch_ms);
+    } else {
+        result = run_sample(&cli, stdout);
+    }
+
+    if (self_stats_on) {
+        print_self_stats(stderr);
+    }
 
-        free(CPU_mode);
-        free(load_avg_1);
-        free(load_avg_5);
-        free(load_avg_15);
+    inspector_free(cli.insp);
+    free(cli.replay_rows);
+    out_buf_free(&cli.out);
+    if (cli.recorder != NULL) {
+        recorder_close(cli.recorder);
+    }
+    if (cli.shm != NULL) {
+        //readers shouldn't mistake the last sample for a live one
+        inspector_shm_detach(cli.shm);
+        shm_unlink(shm_name);
     }
+    return result == -1 ? EXIT_FAILURE : 0;
+}
 
+/**
+ * Collects every enabled section and prints it to 'out'. In watch mode this
+ * runs once per refresh with the same collector, so open files, the uid
+ * cache and the previous cpu sample all carry over.
+ */
+int run_sample(struct cli *cli, FILE *out) {
 
-    if(options.task_summary) {
+    struct inspector_snapshot snap;
+    if (collect_sample(cli, &snap) == -1) {
+        return -1;
+    }
 
-        //read number of task
-        int task_running = get_task_running(procfs_loc);
+    struct self_timer timer;
+    SELF_BEGIN(&timer, SELF_OUTPUT);
+    int result = emit_sample(cli, out, &snap);
+    SELF_END(&timer);
+    return result;
+}
 
-        //read task info
-        char interrupts[20];
-        char c_switch[20];
-        char fork[20];
-        get_interrupts(procfs_loc, interrupts, c_switch, fork);
+/**
+ * Collects a sample, publishing it in shared memory as well with --shm.
+ */
+int collect_sample(struct cli *cli, struct inspector_snapshot *snap) {
 
-        printf("Task Information\n");
-        printf("------------------\n" );
-        printf("Tasks running: %d\n", task_running);
-        printf("Since boot:\n");
-        printf("\tInterrupts: %s\n", interrupts);
-        printf("\tContext Switches: %s\n", c_switch);
-        printf("\tForks: %s\n", fork);
-        printf("\n");
+    if (inspector_collect(cli->insp, snap) == -1) {
+        return -1;
     }
+    if (cli->shm != NULL) {
+        inspector_shm_publish(cli->shm, snap);
+    }
+    return 0;
+}
 
-    if(options.task_list) {
+/**
+ * Writes out one sample in the selected format. Sections that weren't
+ * collected are NULL in the snapshot.
+ */
+int emit_sample(struct cli *cli, FILE *out, struct inspector_snapshot *snap) {
+
+    if (cli->format == FORMAT_JSONL) {
+        write_jsonl(&cli->out, snap, cli->insp, cli->task_columns);
+        return out_buf_flush(&cli->out);
+    } else if (cli->format == FORMAT_BINARY) {
+        write_binary(&cli->out, snap);
+        return out_buf_flush(&cli->out);
+    }
 
-        //read task list
-        char state[15];
-        char task_name[30];
-        char user[20];
-        char task[5];
+    if (snap->system != NULL) {
+        print_system_info(out, snap->system);
+    }
+    if (snap->hardware != NULL) {
+        print_hardware_info(out, snap->hardware, snap->breakdown);
+    }
+    if (snap->breakdown != NULL) {
+        //the heatmap is already next to the usage bar when -r is on
+        print_cpu_breakdown(out, snap->breakdown, snap->hardware == NULL);
+    }
+    if (snap->summary != NULL) {
+        print_task_summary(out, snap->summary);
+    }
+    if (cli->options.task_list && snap->diffs != NULL) {
+        print_task_diffs(out, snap->diffs, snap->num_diffs, cli->insp,
+            cli->column_order, cli->num_columns);
+    } else if (cli->options.task_list) {
+        print_task_list(out, snap->rows, snap->num_rows, cli->insp,
+            cli->column_order, cli->num_columns);
+    }
+    return 0;
+}
 
-        printf("%5s | %12s | %25s | %15s | %s \n", "PID", "State", "Task Name", "User", "Tasks");
-        printf("------+--------------+---------------------------+-----------------+-------\n");
+/* Task list columns, in enum task_column order */
+const struct task_column_info task_column_info[NUM_TASK_COLS] = {
+    [TASK_COL_PID] = { "pid", "PID", 5 },
+    [TASK_COL_TID] = { "tid", "TID", 5 },
+    [TASK_COL_STATE] = { "state", "State", 12 },
+    [TASK_COL_NAME] = { "name", "Task Name", 25 },
+    [TASK_COL_USER] = { "user", "User", 15 },
+    [TASK_COL_THREADS] = { "threads", "Tasks", 5 },
+    [TASK_COL_CPU] = { "cpu", "CPU%", 6 },
+    [TASK_COL_RSS] = { "rss", "RSS kB", 10 },
+    [TASK_COL_VSZ] = { "vsz", "VSZ kB", 10 },
+    [TASK_COL_SWAP] = { "swap", "Swap kB", 10 },
+};
 
-        DIR *directory;
-        if ((directory = opendir(procfs_loc)) == NULL) {
-            perror("opendir");
-            closedir(directory);
-            return EXIT_FAILURE;
+/**
+ * Parses a -o column list such as "pid,name,cpu" into 'order', skipping
+ * columns already in it.
+ */
+int parse_task_columns(const char *arg, enum task_column order[],
+    size_t *count) {
+
+    while (*arg != '\0') {
+        size_t len = strcspn(arg, ",");
+        int col;
+        for (col = 0; col < NUM_TASK_COLS; col++) {
+            const char *key = task_column_info[col].key;
+            if (strlen(key) == len && strncmp(arg, key, len) == 0) {
+                break;
+            }
         }
+        if (col == NUM_TASK_COLS) {
+            fprintf(stderr, "Unknown column `%.*s'.\n", (int) len, arg);
+            return -1;
+        }
+        add_task_column(order, count, col);
+        arg += len;
+        if (*arg == ',') {
+            arg++;
+        }
+    }
+    return 0;
+}
 
-        struct dirent *entry;
-        while ((entry = readdir(directory)) != NULL) {
-            if((is_digit(entry->d_name, strlen(entry->d_name)) == 1) && (entry->d_type == 4)) {
-
-                entry->d_name[strlen(entry->d_name)] = '\0';
+void add_task_column(enum task_column order[], size_t *count,
+    enum task_column column) {
 
-                get_task_list(procfs_loc, entry->d_name, state, task_name, 
-                    user, task);
+    size_t i;
+    for (i = 0; i < *count; i++) {
+        if (order[i] == column) {
+            return;
+        }
+    }
+    order[(*count)++] = column;
+}
 
-                struct passwd *pwd = getpwuid(atoi(user));
+void handle_stop(int signo) {
+    watch_stop = 1;
+}
 
-                printf("%5s | %12s | %25s | %15s | %s \n", entry->d_name, state, 
-                    task_name, pwd == NULL ? user:pwd->pw_name, task);
-            }
-        }
+void install_stop_handlers(void) {
+    struct sigaction action = { .sa_handler = handle_stop };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
 
-        closedir(directory);
+/**
+ * Advances 'tick' by one interval and sleeps until then (or until a stop
+ * signal). Ticks are absolute, so time spent working doesn't add drift.
+ */
+void wait_for_tick(struct timespec *tick, long interval_ms) {
+    tick->tv_sec += interval_ms / 1000;
+    tick->tv_nsec += (interval_ms % 1000) * 1000000;
+    if (tick->tv_nsec >= 1000000000) {
+        tick->tv_sec++;
+        tick->tv_nsec -= 1000000000;
     }
-    return 0;
+    while (watch_stop == 0 && clock_nanosleep(CLOCK_MONOTONIC,
+        TIMER_ABSTIME, tick, NULL) == EINTR);
 }
 
+/**
+ * Top-like mode: refreshes every 'interval_ms' until interrupted. Each frame
+ * is rendered to memory and compared line by line with the previous one;
+ * on a terminal only the lines that changed are redrawn, and only as many
+ * task rows as fit on the screen are collected.
+ */
+int run_watch(struct cli *cli, long interval_ms) {
 
-float get_cpu_usage(char* procfs_loc){
+    install_stop_handlers();
 
-    char fp[255];
-    strcpy(fp, procfs_loc);
-    strcat(fp, "/stat");
+    bool tty = cli->format == FORMAT_TEXT && isatty(STDOUT_FILENO);
+    struct frame prev = { NULL, 0 };
+    struct winsize prev_size = { 0 };
 
-    int fd = open(fp, O_RDONLY);
-    ssize_t read_sz;
-    char buf[1];
-    char one_line[100];
-    int length = 0;
+    struct timespec next_tick;
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
 
-    char one_cpu[80];
-    char two_cpu[80];
+    struct rusage prev_usage;
+    getrusage(RUSAGE_SELF, &prev_usage);
+    struct timespec prev_time = next_tick;
+    double self_cpu = 0.0;
 
-    //read idel 1 and total 1
-    while((read_sz = read(fd, buf, 1)) >0) {
-        if(buf[0] == '\n') {
-            //if readed one line
-            one_line[length] = '\0';
+    int result = 0;
+    bool first_frame = true;
+    while (watch_stop == 0) {
+
+        if (cli->format != FORMAT_TEXT || cli->diff) {
+            //records (and changes) are streamed as they are, there's no
+            //screen to manage
+            if (run_sample(cli, stdout) == -1) {
+                result = -1;
+                break;
+            }
+        } else {
+            struct winsize size = { 0 };
+            if (tty && (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1
+                || size.ws_row == 0)) {
+                size.ws_row = 24;
+                size.ws_col = 80;
+            }
+            //no point reading statuses for rows that won't be on screen
+            inspector_limit_rows(cli->insp, tty ? size.ws_row : 0);
+
+            struct frame next = { NULL, 0 };
+            FILE *mem = open_memstream(&next.text, &next.len);
+            if (mem == NULL) {
+                perror("open_memstream");
+                result = -1;
+                break;
+            }
 
-            strcpy(one_cpu, one_line);
-            one_line[0] = '\0';
-            length = 0;
-            break;
+            fprintf(mem, "inspector: every %.1fs, self CPU %.2f%%\n",
+                interval_ms / 1000.0, self_cpu);
+            if (run_sample(cli, mem) == -1) {
+                fclose(mem);
+                free(next.text);
+                result = -1;
+                break;
+            }
+            fclose(mem);
+
+            //a resized terminal gets a full redraw
+            bool full = tty && (size.ws_row != prev_size.ws_row
+                || size.ws_col != prev_size.ws_col);
+            draw_frame(stdout, &prev, &next, tty, full, &size);
+            free(prev.text);
+            prev = next;
+            prev_size = size;
+        }
 
-        } else {
-            //in the middle of the line
-            one_line[length] = buf[0];
-            length++;
+        //the first frame sat through a sampling window of its own; ticking
+        //on from its start would make the second window next to empty
+        if (first_frame) {
+            clock_gettime(CLOCK_MONOTONIC, &next_tick);
+            first_frame = false;
         }
+        wait_for_tick(&next_tick, interval_ms);
+
+        //our own cpu time as a share of the wall time since the last frame
+        struct rusage usage;
+        struct timespec now;
+        getrusage(RUSAGE_SELF, &usage);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double busy = timeval_diff(&usage.ru_utime, &prev_usage.ru_utime)
+            + timeval_diff(&usage.ru_stime, &prev_usage.ru_stime);
+        double wall = (now.tv_sec - prev_time.tv_sec)
+            + (now.tv_nsec - prev_time.tv_nsec) / 1e9;
+        self_cpu = wall > 0 ? busy / wall * 100 : 0.0;
+        prev_usage = usage;
+        prev_time = now;
     }
-    close(fd);
 
-    sleep(1);
+    if (tty) {
+        //leave the cursor below the last frame
+        printf("\033[%d;1H\033[?25h\n", prev_size.ws_row);
+    }
+    free(prev.text);
+    return result;
+}
 
-    //read idel 2 and total 2
-    fd = open(fp, O_RDONLY);
+double timeval_diff(struct timeval *end, struct timeval *start) {
+    return (end->tv_sec - start->tv_sec)
+        + (end->tv_usec - start->tv_usec) / 1e6;
+}
 
-    while((read_sz = read(fd, buf, 1)) >0) {
+/**
+ * Writes 'next' to 'out'. On a terminal, only the lines that differ from
+ * 'prev' (or all of them, if 'full' is set) are rewritten in place, and the
+ * frame is clipped to the terminal size; otherwise the frame is written as
+ * is. Either way the output goes out with a single write.
+ */
+void draw_frame(FILE *out, struct frame *prev, struct frame *next, bool tty,
+    bool full, struct winsize *size) {
 
-        if(buf[0] == '\n') {
-            //if read one line
-            one_line[length] = '\0';
-            strcpy(two_cpu, one_line);
-            one_line[0] = '\0';
-            length = 0;
-            break;
+    if (tty == false) {
+        fwrite(next->text, 1, next->len, out);
+        fflush(out);
+        return;
+    }
 
-        } else {
-            //in the middle of the line
-            one_line[length] = buf[0];
-            length++;
-        }
+    char *screen_text = NULL;
+    size_t screen_len = 0;
+    FILE *screen = open_memstream(&screen_text, &screen_len);
+    if (screen == NULL) {
+        perror("open_memstream");
+        return;
     }
-    close(fd);
 
-    char *one_tok = one_cpu;
-    char *one_temp;
-    long one_total = 0;
-    int token = 0;
-    long idel1;
+    if (full) {
+        fputs("\033[?25l\033[H\033[2J", screen);
+    }
 
-    //token string
-    while((one_temp = next_token(&one_tok, " ")) != NULL){
-        if(token == 4) {
-            idel1 = atol(one_temp);
-        }
-        if(token > 0){
-            one_total+=atol(one_temp);
+    struct frame old_rest = { prev->text, full ? 0 : prev->len };
+    struct frame new_rest = { next->text, next->len };
+    struct frame old_line;
+    struct frame new_line;
+    int row;
+    for (row = 1; row <= size->ws_row; row++) {
+        bool have_old = frame_next_line(&old_rest, &old_line);
+        bool have_new = frame_next_line(&new_rest, &new_line);
+        if (have_old == false && have_new == false) {
+            break;
         }
-        token++;
-    }
 
-    long two_total = 0;
-    long idel2;
-    char *two_tok = two_cpu;
-    char *two_temp;
-    token = 0;
+        if (have_new == false) {
+            //the frame got shorter: blank out the leftover line
+            fprintf(screen, "\033[%d;1H\033[K", row);
+        } else if (have_old == false || old_line.len != new_line.len
+            || memcmp(old_line.text, new_line.text, new_line.len) != 0) {
 
-    while((two_temp = next_token(&two_tok, " ")) != NULL){
-        if(token == 4) {
-            idel2 = atol(two_temp);
-        }
-        if(token > 0){
-            two_total+=atol(two_temp);
+            int width = new_line.len < size->ws_col ? new_line.len : size->ws_col;
+            fprintf(screen, "\033[%d;1H%.*s\033[K", row, width, new_line.text);
         }
-        token++;
-    }
-
-    //calculate usage
-    float usage = 1-(float)(idel2-idel1)/(two_total-one_total);
-    if (isnan(usage)) {
-        return 0.0;
-    } else {
-        return usage;
     }
 
+    fclose(screen);
+    fwrite(screen_text, 1, screen_len, out);
+    fflush(out);
+    free(screen_text);
 }
 
-void get_memo_info(char* procfs_loc, char total[], char used[]){
-
-    char *total_pre = "MemTotal:";
-    char *active_pre = "Active:";
+/**
+ * Splits the next line (without its trailing newline) off the front of
+ * 'rest'. Returns false once 'rest' is exhausted.
+ */
+bool frame_next_line(struct frame *rest, struct frame *line) {
 
-    char total_line[30];
-    char active_line[30];
+    if (rest->len == 0) {
+        return false;
+    }
 
-    char fp[255];
-    strcpy(fp, procfs_loc);
-    strcat(fp, "/meminfo");
+    char *nl = memchr(rest->text, '\n', rest->len);
+    line->text = rest->text;
+    line->len = nl == NULL ? rest->len : (size_t) (nl - rest->text);
 
-    int fd = open(fp, O_RDONLY);
-    ssize_t read_sz;
-    char buf[1];
-    char one_line[100];
-    int length = 0;
+    //skip over the newline, if there was one
+    size_t consumed = nl == NULL ? line->len : line->len + 1;
+    rest->text += consumed;
+    rest->len -= consumed;
+    return true;
+}
 
-    while((read_sz = read(fd, buf, 1)) >0) {
+/**
+ * Creates the listening socket at 'srv->path' (replacing a stale socket
+ * left there by an earlier daemon), the sampling timer and the epoll
+ * instance that waits on both and on every client.
+ */
+int serve_open(struct server *srv, long interval_ms) {
 
-        if(buf[0] == '\n') {
-            //read one line
-            one_line[length] = '\0';
+    srv->listen_fd = -1;
+    srv->epoll_fd = -1;
+    srv->timer_fd = -1;
 
-            if(strncmp(total_pre, one_line, strlen(total_pre)) == 0) {
-                //if the line is start with "MemTotal:"
-                strcpy(total_line, one_line);
-            }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(srv->path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path `%s' is too long.\n", srv->path);
+        return -1;
+    }
+    strcpy(addr.sun_path, srv->path);
 
-            if(strncmp(active_pre, one_line, strlen(active_pre)) == 0) {
-                //if the line is start with "Active:"
-                strcpy(active_line, one_line);
-            }
+    struct stat st;
+    if (lstat(srv->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(srv->path);
+    }
 
-            one_line[0] = '\0';
-            length = 0;
-        } else {
-            //in the middle of the line
-            one_line[length] = buf[0];
-            length++;
-        }
+    srv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (srv->listen_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(srv->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("bind");
+        return -1;
+    }
+    if (listen(srv->listen_fd, SOMAXCONN) == -1) {
+        perror("listen");
+        return -1;
     }
-    close(fd);
 
-    //token string
-    int i;
-    int flag = 0;
-    int index = 0;
-    for(i = 0; total_line[i] != '\0'; i++) {
+    srv->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (srv->timer_fd == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
+    struct itimerspec period = {
+        .it_interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000 },
+    };
+    period.it_value = period.it_interval;
+    if (timerfd_settime(srv->timer_fd, 0, &period, NULL) == -1) {
+        perror("timerfd_settime");
+        return -1;
+    }
 
-        if(flag == 1) {
-            total[index] = total_line[i];
-            index++;
-        } else if(total_line[i] > 47 && total_line[i] < 58) {
-            total[index] = total_line[i];
-            flag = 1;
-            index++;
-        }
-        if(total_line[i] == 32) {
-            flag = 0;
-        }
+    srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv->epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    //the two fds are told apart from clients by their address
+    struct epoll_event listen_event = { .events = EPOLLIN,
+        .data.ptr = &srv->listen_fd };
+    struct epoll_event timer_event = { .events = EPOLLIN,
+        .data.ptr = &srv->timer_fd };
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->listen_fd, &listen_event) == -1
+        || epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->timer_fd, &timer_event) == -1) {
+        perror("epoll_ctl");
+        return -1;
     }
+    return 0;
+}
 
-    total[index] = '\0';
-    index = 0;
-    flag = 0;
+/**
+ * Disconnects every client, frees the responses and removes the socket.
+ */
+void serve_close(struct server *srv) {
 
-    for(i = 0; active_line[i] != '\0'; i++) {
+    while (srv->clients != NULL) {
+        serve_release(srv, srv->clients);
+    }
+    if (srv->listen_fd != -1) {
+        close(srv->listen_fd);
+        unlink(srv->path);
+    }
+    if (srv->timer_fd != -1) {
+        close(srv->timer_fd);
+    }
+    if (srv->epoll_fd != -1) {
+        close(srv->epoll_fd);
+    }
+    if (srv->current != NULL) {
+        out_buf_free(&srv->current->buf);
+        free(srv->current);
+    }
+    if (srv->spare != NULL) {
+        out_buf_free(&srv->spare->buf);
+        free(srv->spare);
+    }
+}
 
-        if(flag == 1) {
-            used[index] = active_line[i];
-            index++;
-        } else if(active_line[i] > 47 && total_line[i] < 58) {
-            used[index] = active_line[i];
-            flag = 1;
-            index++;
+/**
+ * Collects a sample and renders it into the response every client from now
+ * on is sent. The current response is rewritten in place unless a client
+ * is still being sent it; then the spare one (or a new one) takes over, and
+ * the old one is kept for the clients reading it. A sample that can't be
+ * collected leaves the last good response in place.
+ */
+int serve_render(struct cli *cli, struct server *srv) {
+
+    struct inspector_snapshot snap;
+    if (collect_sample(cli, &snap) == -1) {
+        fprintf(stderr, "Couldn't collect a sample, serving the last one.\n");
+        return 0;
+    }
+
+    struct self_timer timer;
+    SELF_BEGIN(&timer, SELF_OUTPUT);
+    struct serve_response *resp = srv->current;
+    if (resp == NULL || resp->readers > 0) {
+        resp = srv->spare;
+        srv->spare = NULL;
+    }
+    if (resp == NULL) {
+        resp = calloc(1, sizeof(struct serve_response));
+        SELF_COUNT(allocs, 1);
+        if (resp == NULL) {
+            perror("calloc");
+            SELF_END(&timer);
+            return -1;
         }
-        if(active_line[i] == 32) {
-            if(index > 0) {
-                break;
-            }
-            flag = 0;
+        if (out_buf_init(&resp->buf, -1) == -1) {
+            free(resp);
+            SELF_END(&timer);
+            return -1;
         }
     }
-    used[index] = '\0';
-}
+    if (resp != srv->current && srv->current != NULL) {
+        //freed by the last client still reading it
+        srv->current->retired = true;
+    }
+    resp->retired = false;
+    resp->buf.len = 0;
+    srv->current = resp;
 
-void get_task_list(char* procfs_loc, char* process, char state[], 
-    char task_name[], char user[], char task[]) {
+    int result = 0;
+    if (cli->format == FORMAT_JSONL) {
+        write_jsonl(&resp->buf, &snap, cli->insp, cli->task_columns);
+    } else if (cli->format == FORMAT_BINARY) {
+        write_binary(&resp->buf, &snap);
+    } else {
+        char *text = NULL;
+        size_t text_len = 0;
+        FILE *mem = open_memstream(&text, &text_len);
+        if (mem == NULL) {
+            perror("open_memstream");
+            result = -1;
+        } else {
+            result = emit_sample(cli, mem, &snap);
+            fclose(mem);
+            out_put(&resp->buf, text, text_len);
+            free(text);
+        }
+    }
+    SELF_END(&timer);
+    return result;
+}
 
-    char *thread_pre = "Threads:";
-    char *state_pre = "State:";
-    char *uid_pre = "Uid:";
-    char *name_pre = "Name:";
+/**
+ * Accepts every pending connection and starts sending each one the current
+ * response. Clients that can't take all of it at once are left to epoll.
+ */
+void serve_accept(struct server *srv) {
 
-    char state_line[30];
-    char uid_line[30];
-    char thread_line[15];
-    char name_line[99];
+    while (true) {
+        int fd = accept(srv->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
 
-    char fp[255];
-    strcpy(fp, procfs_loc);
-    strcat(fp, "/");
-    strcat(fp, process);
-    strcat(fp, "/status");
-    int fd = open(fp, O_RDONLY);
-    ssize_t read_sz;
-    char buf[1];
-    char one_line[100];
-    int length = 0;
+        //no sample has been collected yet, so there's nothing to send
+        if (srv->current == NULL) {
+            close(fd);
+            continue;
+        }
 
-    while((read_sz = read(fd, buf, 1)) >0) {
-        if(buf[0] == '\n') {
-            one_line[length] = '\0';
+        struct serve_client *client = calloc(1, sizeof(struct serve_client));
+        if (client == NULL) {
+            perror("calloc");
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->response = srv->current;
+        client->response->readers++;
+        client->next = srv->clients;
+        if (srv->clients != NULL) {
+            srv->clients->prev = client;
+        }
+        srv->clients = client;
 
-            if(strncmp(thread_pre, one_line, strlen(thread_pre)) == 0) {
-                //if the line is start with "Threads:"
-                strcpy(thread_line, one_line);
-                //no information needed after this line
-                break;
-            }
+        if (serve_write(client)) {
+            serve_release(srv, client);
+            continue;
+        }
+        struct epoll_event event = { .events = EPOLLOUT, .data.ptr = client };
+        if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("epoll_ctl");
+            serve_release(srv, client);
+        }
+    }
+}
 
-            if(strncmp(name_pre, one_line, strlen(name_pre)) == 0) {
-                strcpy(name_line, one_line);
+/**
+ * Sends a client as much of its response as the socket takes without
+ * blocking. Returns true once the client is done with, either because it
+ * has the whole response or because it went away.
+ */
+bool serve_write(struct serve_client *client) {
+
+    struct out_buf *buf = &client->response->buf;
+    while (client->sent < buf->len) {
+        ssize_t sent = send(client->fd, buf->data + client->sent,
+            buf->len - client->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
             }
+            return errno != EAGAIN && errno != EWOULDBLOCK;
+        }
+        client->sent += sent;
+    }
+    return true;
+}
 
-            if(strncmp(state_pre, one_line, strlen(state_pre)) == 0) {
-                strcpy(state_line, one_line);
-            }
+/**
+ * Disconnects a client. A retired response goes back to being the spare
+ * once its last reader is gone.
+ */
+void serve_release(struct server *srv, struct serve_client *client) {
 
-            if(strncmp(uid_pre, one_line, strlen(uid_pre)) == 0) {
-                strcpy(uid_line, one_line);
-            }
+    close(client->fd);
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else {
+        srv->clients = client->next;
+    }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
+    }
 
-            one_line[0] = '\0';
-            length = 0;
+    struct serve_response *resp = client->response;
+    resp->readers--;
+    if (resp->retired && resp->readers == 0) {
+        if (srv->spare == NULL) {
+            srv->spare = resp;
         } else {
-            //in the middle of the line
-            one_line[length] = buf[0];
-            length++;
+            out_buf_free(&resp->buf);
+            free(resp);
         }
+    }
+    free(client);
+}
 
+/**
+ * Daemon mode (--serve): collects a sample every 'interval_ms' and sends
+ * the latest one to every client that connects, until interrupted. Each
+ * sample is rendered once in the selected format, however many clients
+ * read it, and a single thread serves them all from one epoll loop.
+ */
+int run_serve(struct cli *cli, struct server *srv, long interval_ms) {
+
+    install_stop_handlers();
+
+    int result = serve_open(srv, interval_ms);
+    if (result == 0) {
+        result = serve_render(cli, srv);
     }
-    close(fd);
 
-    //token string
-    int i;
-    int flag = 0;
-    int index = 0;
-    for(i = 0; i < 31; i++) {
-        if(flag == 1) {
-            task_name[index] = name_line[i];
-            index++;
+    struct epoll_event events[SERVE_EVENTS];
+    while (result == 0 && watch_stop == 0) {
+        int num_events = epoll_wait(srv->epoll_fd, events, SERVE_EVENTS, -1);
+        if (num_events == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                result = -1;
+            }
+            continue;
         }
-        if(name_line[i] == 9) {
-            flag = 1;
+
+        int i;
+        for (i = 0; i < num_events && result == 0; i++) {
+            void *source = events[i].data.ptr;
+            if (source == &srv->timer_fd) {
+                //a late tick only means samples were missed
+                uint64_t expirations;
+                if (read(srv->timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    result = serve_render(cli, srv);
+                }
+            } else if (source == &srv->listen_fd) {
+                serve_accept(srv);
+            } else if (serve_write(source)) {
+                serve_release(srv, source);
+            }
         }
     }
 
-    task_name[index] = '\0';
-    index = 0;
-    flag = 0;
+    serve_close(srv);
+    return result;
+}
+
+/**
+ * Publisher mode (--shm without --serve): collects a sample every
+ * 'interval_ms' and publishes it in shared memory, printing nothing, until
+ * interrupted.
+ */
+int run_publish(struct cli *cli, long interval_ms) {
+
+    install_stop_handlers();
 
-    for(i = 0; state_line[i] != 41; i++) {
-        if(flag == 1) {
-            state[index] = state_line[i];
-            index++;
+    struct timespec next_tick;
+    bool first_sample = true;
+    while (watch_stop == 0) {
+        struct inspector_snapshot snap;
+        if (collect_sample(cli, &snap) == -1) {
+            return -1;
         }
-        if(state_line[i] == 40) {
-            flag = 1;
+
+        //the first sample sat through a cpu window of its own
+        if (first_sample) {
+            clock_gettime(CLOCK_MONOTONIC, &next_tick);
+            first_sample = false;
         }
+        wait_for_tick(&next_tick, interval_ms);
     }
+    return 0;
+}
 
-    state[index] = '\0';
-    index = 0;
-    flag = 0;
+/**
+ * Prints the sample published in shared memory segment 'name' (--shm-read),
+ * as the same sections and in the same format as a live one. Only the
+ * system, hardware and task summary sections are published.
+ */
+int run_shm_read(struct cli *cli, const char *name, FILE *out) {
 
-    for(i = 0; thread_line[i] != '\0'; i++) {
-        if(flag == 1) {
-            task[index] = thread_line[i];
-            index++;
-        }
-        if(thread_line[i] == 9) {
-            flag = 1;
-        }
+    struct inspector_shm *shm = inspector_shm_attach(name);
+    if (shm == NULL) {
+        return -1;
+    }
+    struct inspector_published pub;
+    int result = inspector_shm_read(shm, &pub);
+    inspector_shm_detach(shm);
+    if (result == -1) {
+        fprintf(stderr, "No sample has been published in %s.\n", name);
+        return -1;
+    }
+
+    struct inspector_snapshot snap = {
+        .time = { pub.time_ns / 1000000000, pub.time_ns % 1000000000 },
+    };
+    if (pub.has_system && cli->options.system) {
+        snap.system = &pub.system;
+    }
+    if (pub.has_hardware && cli->options.hardware) {
+        snap.hardware = &pub.hardware;
+    }
+    if (pub.has_summary && cli->options.task_summary) {
+        snap.summary = &pub.summary;
+    }
+    cli->options.task_list = false;
+    return emit_sample(cli, out, &snap);
+}
+
+void print_system_info(FILE *out, struct system_info *info) {
+
+    int uptime = info->uptime;
+    int uptime_temp = uptime;
+
+    //calculate year day hour min sec
+    int year = uptime_temp/31536000;
+    if(year > 0) {
+        uptime_temp-=year*31536000;
+    }
+
+    int day = uptime_temp/86400;
+    if(day > 0){
+        uptime_temp-=day*86400;
+    }
+
+    int hour = uptime_temp/3600;
+    if(hour > 0) {
+        uptime_temp-=hour*3600;
     }
 
-    task[index] = '\0';
-    index = 0;
-    flag = 0;
+    int min = uptime_temp/60;
+    if(min > 0) {
+        uptime_temp-=min*60;
+    }
+
+    int second = uptime_temp;
+    fprintf(out, "System Information\n");
+    fprintf(out, "------------------\n" );
+    fprintf(out, "Hostname: %s\n", info->hostname);
+    fprintf(out, "Kernel Version: %s\n", info->version);
+    fprintf(out, "Uptime: ");
+    if(year > 0) {
+        fprintf(out, "%d years, ", year);
+    }
+    if(day > 0) {
+        fprintf(out, "%d days, ", day);
+    }
+    if(hour > 0) {
+        fprintf(out, "%d hours, ", hour);
+    }
+    if(min > 0) {
+        fprintf(out, "%d minutes, ", min);
+    }
+    if(second > 0) {
+        fprintf(out, "%d seconds", second);
+    }
+    fprintf(out, "\n");
+}
 
-    for(i = 0; uid_line[i] != '\0'; i++) {
-        if(flag == 1) {
-            user[index] = uid_line[i];
-            index++;
+void print_hardware_info(FILE *out, struct hardware_info *info,
+    struct cpu_breakdown *breakdown) {
+
+    //calculate memo
+    float result = ((float) info->mem_used)/info->mem_total*100;
+    float total_float = ((float) info->mem_total)/1024/1024;
+    float used_float = ((float) info->mem_used)/1024/1024;
+    int num = result/5;
+    int remain = 20-num;
+    int i;
+
+    float usage = info->cpu_usage*100;
+    int usage_num = usage/5;
+    int usage_remain = 20-usage_num;
+
+    fprintf(out, "Hardware Information\n");
+    fprintf(out, "------------------\n" );
+    fprintf(out, "CPU Model: %s\n", info->cpu_model);
+    fprintf(out, "Processing Units: %d\n", info->proc_units);
+    fprintf(out, "Load Average (1/5/15 min) %.2f %.2f %.2f\n",
+        info->load_avg[0], info->load_avg[1], info->load_avg[2]);
+    fprintf(out, "CPU Usage:\t[");
+
+    for(i = 0; i < usage_num; i++) {
+        fprintf(out, "#");
+    }
+    for(i = 0; i < usage_remain; i++) {
+        fprintf(out, "-");
+    }
+    fprintf(out, "] %.1f%%\n", usage);
+
+    if (breakdown != NULL) {
+        print_cpu_heatmap(out, breakdown);
+    }
+
+    fprintf(out, "Memory Usage:\t[");
+
+    for (i = 0; i < num; i++) {
+        fprintf(out, "#");
+    }
+    for(i = 0; i < remain; i++) {
+        fprintf(out, "-");
+    }
+    fprintf(out, "] %.1f%% (%.1f GB / %.1f GB)\n", result, used_float, total_float);
+    fprintf(out, "\n");
+}
+
+/**
+ * Prints the busy percentage of every cpu as one shaded cell per cpu, from
+ * ' ' (idle) to '@' (fully busy), HEATMAP_WIDTH cells to a row.
+ */
+void print_cpu_heatmap(FILE *out, struct cpu_breakdown *breakdown) {
+
+    static const char shades[] = " .:-=+*#%@";
+    int max_shade = sizeof(shades) - 2;
+
+    size_t i;
+    for (i = 0; i < breakdown->count; i++) {
+        if (i % HEATMAP_WIDTH == 0) {
+            fprintf(out, i == 0 ? "Per-CPU Usage:\t[" : "\t\t[");
         }
-        if(uid_line[i] == 9) {
-            flag = 1;
+
+        int shade = breakdown->busy[i] / 10;
+        if (shade < 0) {
+            shade = 0;
+        } else if (shade > max_shade) {
+            shade = max_shade;
+        }
+        fputc(shades[shade], out);
+
+        if (i % HEATMAP_WIDTH == HEATMAP_WIDTH - 1 || i == breakdown->count - 1) {
+            fprintf(out, "]\n");
         }
     }
+}
 
-    user[index] = '\0';
+void print_cpu_breakdown(FILE *out, struct cpu_breakdown *breakdown,
+    bool heatmap) {
 
-    for(i = 0; user[i] != 9; i++) {
-        if(user[i+1] == 9){
-            user[i+1] = '\0';
-            break;
-        }
+    fprintf(out, "Per-CPU Breakdown\n");
+    fprintf(out, "------------------\n" );
+    if (heatmap) {
+        print_cpu_heatmap(out, breakdown);
     }
+    fprintf(out, "%5s %6s %6s %6s %6s %6s\n",
+        "CPU", "Busy", "User", "System", "IOWait", "Steal");
+
+    size_t i;
+    for (i = 0; i < breakdown->count; i++) {
+        fprintf(out, "%5u %5.1f%% %5.1f%% %5.1f%% %5.1f%% %5.1f%%\n",
+            breakdown->ids[i], breakdown->busy[i], breakdown->user[i],
+            breakdown->system[i], breakdown->iowait[i], breakdown->steal[i]);
+    }
+    fprintf(out, "\n");
 }
 
+void print_task_summary(FILE *out, struct task_summary *summary) {
 
-void get_interrupts(char* procfs_loc, char interrupts[], char c_switch[], 
-    char fork[]) {
+    fprintf(out, "Task Information\n");
+    fprintf(out, "------------------\n" );
+    fprintf(out, "Tasks running: %d\n", summary->task_running);
+    fprintf(out, "Since boot:\n");
+    fprintf(out, "\tInterrupts: %" PRIu64 "\n", summary->interrupts);
+    fprintf(out, "\tContext Switches: %" PRIu64 "\n", summary->c_switch);
+    fprintf(out, "\tForks: %" PRIu64 "\n", summary->forks);
+    fprintf(out, "\n");
+}
 
-    char *inter_pre = "intr";
-    char *c_switch_pre = "ctxt";
-    char *fork_pre = "processes";
-    char fp[255];
-    strcpy(fp, procfs_loc);
-    strcat(fp, "/stat");
+void print_task_list(FILE *out, struct task_row *rows, size_t num_rows,
+    struct inspector *insp, const enum task_column *columns,
+    size_t num_columns) {
 
-    char one_line[12000];
-    char inte_line[12000];
-    char c_switch_line[50];
-    char fork_line[50];
-    int length = 0;
-    char buf[1];
-    
-    ssize_t read_sz;
+    print_task_header(out, columns, num_columns, false);
+    size_t i;
+    for (i = 0; i < num_rows; i++) {
+        print_task_row(out, &rows[i], insp, columns, num_columns, "");
+    }
+}
 
-    int fd = open(fp, O_RDONLY);
-    while((read_sz = read(fd, buf, 1)) >0) {
+/**
+ * Prints the task changes of a --diff sample, each row marked with how it
+ * changed: '+' added, '-' exited (as last seen), '~' changed. A sample with
+ * no changes prints nothing.
+ */
+void print_task_diffs(FILE *out, struct task_diff *diffs, size_t num_diffs,
+    struct inspector *insp, const enum task_column *columns,
+    size_t num_columns) {
 
-        if(buf[0] == '\n') {
-            //one line has been read
-            one_line[length] = '\0';
-            if(strncmp(inter_pre, one_line, strlen(inter_pre)) == 0) {
-                strcpy(inte_line, one_line);
-            }
+    if (num_diffs == 0) {
+        return;
+    }
+    print_task_header(out, columns, num_columns, true);
+    size_t i;
+    for (i = 0; i < num_diffs; i++) {
+        const char *marker = diffs[i].change == TASK_ADDED ? "+ "
+            : diffs[i].change == TASK_EXITED ? "- " : "~ ";
+        print_task_row(out, &diffs[i].row, insp, columns, num_columns,
+            marker);
+    }
+}
+
+/**
+ * Prints the task list header and its underline, 'marked' leaving room
+ * for the --diff change markers in front.
+ */
+void print_task_header(FILE *out, const enum task_column *columns,
+    size_t num_columns, bool marked) {
+
+    size_t c;
+    fprintf(out, "%s", marked ? "  " : "");
+    for (c = 0; c < num_columns; c++) {
+        const struct task_column_info *info = &task_column_info[columns[c]];
+        fprintf(out, "%s%*s", c == 0 ? "" : " | ", info->width, info->header);
+    }
+    fprintf(out, " \n");
+    fprintf(out, "%s", marked ? "--" : "");
+    for (c = 0; c < num_columns; c++) {
+        //the first column has no space in front of it
+        int dashes = task_column_info[columns[c]].width + (c == 0 ? 1 : 2);
+        fprintf(out, "%s%.*s", c == 0 ? "" : "+", dashes,
+            "------------------------------");
+    }
+    fprintf(out, "\n");
+}
+
+void print_task_row(FILE *out, struct task_row *row, struct inspector *insp,
+    const enum task_column *columns, size_t num_columns, const char *marker) {
+
+    fprintf(out, "%s", marker);
+    size_t c;
+    for (c = 0; c < num_columns; c++) {
+        char buf[NUM_SZ];
+        const char *cell = format_task_cell(row, columns[c], insp, buf,
+            sizeof(buf));
+
+        //a trailing thread count has always been left unpadded
+        int width = task_column_info[columns[c]].width;
+        if (columns[c] == TASK_COL_THREADS && c == num_columns - 1) {
+            width = 0;
+        }
+        fprintf(out, "%s%*s", c == 0 ? "" : " | ", width, cell);
+    }
+    fprintf(out, " \n");
+}
+
+/**
+ * Returns the text of one task list cell, formatted into 'buf' if it isn't
+ * already a string in the row. Values that weren't read (a task that
+ * exited, an unmeasured cpu usage) are left blank.
+ */
+const char *format_task_cell(struct task_row *row, enum task_column column,
+    struct inspector *insp, char *buf, size_t buf_sz) {
 
-            if(strncmp(c_switch_pre, one_line, strlen(c_switch_pre)) == 0) {
-                strcpy(c_switch_line, one_line);
+    buf[0] = '\0';
+    switch (column) {
+        case TASK_COL_PID:
+            snprintf(buf, buf_sz, "%d", row->pid);
+            break;
+        case TASK_COL_TID:
+            if (row->tid != 0) {
+                snprintf(buf, buf_sz, "%d", row->tid);
+            }
+            break;
+        case TASK_COL_STATE:
+            return task_state_name(row->state_code);
+        case TASK_COL_NAME:
+            return row->task_name;
+        case TASK_COL_USER:
+            if (row->uid != NO_UID) {
+                const char *username = inspector_username(insp, row->uid);
+                if (username != NULL) {
+                    return username;
+                }
+                snprintf(buf, buf_sz, "%u", (unsigned int) row->uid);
+            }
+            break;
+        case TASK_COL_THREADS:
+            if (row->threads > 0) {
+                snprintf(buf, buf_sz, "%u", row->threads);
+            }
+            break;
+        case TASK_COL_CPU:
+            if (row->cpu_usage >= 0) {
+                snprintf(buf, buf_sz, "%.1f", row->cpu_usage);
             }
+            break;
+        case TASK_COL_RSS:
+            snprintf(buf, buf_sz, "%" PRIu64, row->rss_kb);
+            break;
+        case TASK_COL_VSZ:
+            snprintf(buf, buf_sz, "%" PRIu64, row->vsz_kb);
+            break;
+        case TASK_COL_SWAP:
+            snprintf(buf, buf_sz, "%" PRIu64, row->swap_kb);
+            break;
+        case NUM_TASK_COLS:
+            break;
+    }
+    return buf;
+}
 
-            if(strncmp(fork_pre, one_line, strlen(fork_pre)) == 0) {
-                strcpy(fork_line, one_line);
+int out_buf_init(struct out_buf *ob, int fd) {
+    ob->data = malloc(OUT_BUF_SZ);
+    if (ob->data == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    ob->len = 0;
+    ob->cap = OUT_BUF_SZ;
+    ob->fd = fd;
+    return 0;
+}
+
+void out_buf_free(struct out_buf *ob) {
+    free(ob->data);
+    ob->data = NULL;
+    ob->len = 0;
+    ob->cap = 0;
+}
+
+int out_buf_flush(struct out_buf *ob) {
+    size_t written = 0;
+    while (written < ob->len) {
+        ssize_t write_sz = write(ob->fd, ob->data + written, ob->len - written);
+        if (write_sz == -1) {
+            if (errno == EINTR) {
+                continue;
             }
+            perror("write");
+            ob->len = 0;
+            return -1;
+        }
+        written += write_sz;
+    }
+    ob->len = 0;
+    return 0;
+}
 
-            one_line[0] = '\0';
-            length = 0;
+/**
+ * Returns room for 'size' more bytes at the end of the buffer, flushing it
+ * first if they don't fit. The caller advances 'len' by what it used.
+ */
+char *out_buf_reserve(struct out_buf *ob, size_t size) {
+    if (ob->cap - ob->len < size) {
+        //a buffer with no fd just keeps growing
+        size_t new_cap = size;
+        if (ob->fd == -1) {
+            new_cap = ob->cap * 2 > ob->len + size ? ob->cap * 2 : ob->len + size;
         } else {
-            //in the middle of the line
-            one_line[length] = buf[0];
-            length++;
+            out_buf_flush(ob);
         }
+        if (ob->cap - ob->len < size) {
+            char *new_data = realloc(ob->data, new_cap);
+            SELF_COUNT(allocs, 1);
+            if (new_data == NULL) {
+                perror("realloc");
+                return NULL;
+            }
+            ob->data = new_data;
+            ob->cap = new_cap;
+        }
+    }
+    return ob->data + ob->len;
+}
 
+void out_put(struct out_buf *ob, const char *data, size_t len) {
+    char *dst = out_buf_reserve(ob, len);
+    if (dst != NULL) {
+        memcpy(dst, data, len);
+        ob->len += len;
     }
-    close(fd);
+}
+
+void out_put_str(struct out_buf *ob, const char *str) {
+    out_put(ob, str, strlen(str));
+}
 
-    //token string
-    int i, inter_index;
-    for(i = 0; i < 12000; i++) {
-        if(inte_line[i] > 47 && inte_line[i] < 58) {
-            //is number
+void out_put_u64(struct out_buf *ob, uint64_t value) {
+    char digits[20];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    out_put(ob, digits + i, sizeof(digits) - i);
+}
 
-            interrupts[inter_index] = inte_line[i];
-            inter_index++;
+/**
+ * Writes a float with two decimals, or null if it isn't finite (JSON has
+ * no NaN or infinity).
+ */
+void out_put_float(struct out_buf *ob, float value) {
+    if (!isfinite(value)) {
+        out_put(ob, "null", 4);
+        return;
+    }
+    char *dst = out_buf_reserve(ob, FLOAT_STR_SZ);
+    if (dst != NULL) {
+        int len = snprintf(dst, FLOAT_STR_SZ, "%.2f", value);
+        if (len > 0 && len < FLOAT_STR_SZ) {
+            ob->len += len;
         }
-        if(inte_line[i] == 32 && inte_line[i-1] != 114) {
-            //if this index is space and next is 'r'
-            interrupts[inter_index] = '\0';
-            break;
+    }
+}
+
+/**
+ * Returns the length of the well-formed UTF-8 sequence at the start of
+ * 'str' (a byte of 0x80 or more), or 0 if it isn't one: stray continuation
+ * bytes, overlong forms, surrogates, code points past U+10FFFF and
+ * sequences cut short all count as invalid.
+ */
+size_t utf8_seq_len(const unsigned char *str) {
+
+    //the range of the second byte depends on the first
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xbf;
+    size_t len;
+    if (str[0] >= 0xc2 && str[0] <= 0xdf) {
+        len = 2;
+    } else if (str[0] >= 0xe0 && str[0] <= 0xef) {
+        len = 3;
+        if (str[0] == 0xe0) {
+            lo = 0xa0;
+        } else if (str[0] == 0xed) {
+            hi = 0x9f;
+        }
+    } else if (str[0] >= 0xf0 && str[0] <= 0xf4) {
+        len = 4;
+        if (str[0] == 0xf0) {
+            lo = 0x90;
+        } else if (str[0] == 0xf4) {
+            hi = 0x8f;
         }
+    } else {
+        return 0;
     }
 
-    int index;
-    for(i = 0; i < 50; i++) {
-        if(c_switch_line[i] > 47 && c_switch_line[i] < 58) {
+    if (str[1] < lo || str[1] > hi) {
+        return 0;
+    }
+    size_t i;
+    for (i = 2; i < len; i++) {
+        if (str[i] < 0x80 || str[i] > 0xbf) {
+            return 0;
+        }
+    }
+    return len;
+}
 
-            c_switch[index] = c_switch_line[i];
-            index++;
+/**
+ * Writes a string as a quoted JSON string. Task names come from the
+ * processes themselves, so quotes, backslashes and control characters are
+ * all escaped, and bytes that aren't valid UTF-8 (including sequences the
+ * kernel cut short at the end of a name) are replaced with U+FFFD.
+ */
+void out_put_json_str(struct out_buf *ob, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+
+    out_put(ob, "\"", 1);
+    const char *run = str;
+    while (*str != '\0') {
+        unsigned char c = *str;
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+            str++;
+            continue;
         }
-        if(c_switch_line[i] == 0) {
-            //if null terminater
-            c_switch[index] = '\0';
-            break;
+        size_t seq_len = c >= 0x80 ? utf8_seq_len((const unsigned char *) str) : 0;
+        if (seq_len > 0) {
+            str += seq_len;
+            continue;
         }
+        out_put(ob, run, str - run);
+        str++;
+        run = str;
+
+        char escape[6] = { '\\', c, 0, 0, 0, 0 };
+        size_t escape_len = 2;
+        if (c == '\n') {
+            escape[1] = 'n';
+        } else if (c == '\t') {
+            escape[1] = 't';
+        } else if (c >= 0x80) {
+            memcpy(escape, "\\ufffd", 6);
+            escape_len = 6;
+        } else if (c < 0x20) {
+            memcpy(escape, "\\u00", 4);
+            escape[4] = hex[c >> 4];
+            escape[5] = hex[c & 0xf];
+            escape_len = 6;
+        }
+        out_put(ob, escape, escape_len);
+    }
+    out_put(ob, run, str - run);
+    out_put(ob, "\"", 1);
+}
+
+/**
+ * Writes every collected section as JSON Lines: a "sample" object with the
+ * time, followed by one object per section, cpu and task. Sections that
+ * weren't collected are passed as NULL.
+ */
+void write_jsonl(struct out_buf *ob, struct inspector_snapshot *snap,
+    struct inspector *insp, unsigned int columns) {
+
+    struct system_info *sys_info = snap->system;
+    struct hardware_info *hw_info = snap->hardware;
+    struct cpu_breakdown *breakdown = snap->breakdown;
+    struct task_summary *summary = snap->summary;
+    struct task_row *rows = snap->rows;
+    size_t num_rows = snap->num_rows;
+
+    out_put_str(ob, "{\"type\":\"sample\",\"time_ns\":");
+    out_put_u64(ob, (uint64_t) snap->time.tv_sec * 1000000000
+        + snap->time.tv_nsec);
+    out_put_str(ob, "}\n");
+
+    if (sys_info != NULL) {
+        out_put_str(ob, "{\"type\":\"system\",\"hostname\":");
+        out_put_json_str(ob, sys_info->hostname);
+        out_put_str(ob, ",\"version\":");
+        out_put_json_str(ob, sys_info->version);
+        out_put_str(ob, ",\"uptime\":");
+        out_put_u64(ob, sys_info->uptime);
+        out_put_str(ob, "}\n");
+    }
+
+    if (hw_info != NULL) {
+        out_put_str(ob, "{\"type\":\"hardware\",\"cpu_model\":");
+        out_put_json_str(ob, hw_info->cpu_model);
+        out_put_str(ob, ",\"proc_units\":");
+        out_put_u64(ob, hw_info->proc_units);
+        out_put_str(ob, ",\"load_avg\":[");
+        out_put_float(ob, hw_info->load_avg[0]);
+        out_put_str(ob, ",");
+        out_put_float(ob, hw_info->load_avg[1]);
+        out_put_str(ob, ",");
+        out_put_float(ob, hw_info->load_avg[2]);
+        out_put_str(ob, "],\"cpu_usage\":");
+        out_put_float(ob, hw_info->cpu_usage * 100);
+        out_put_str(ob, ",\"mem_total_kb\":");
+        out_put_u64(ob, hw_info->mem_total);
+        out_put_str(ob, ",\"mem_used_kb\":");
+        out_put_u64(ob, hw_info->mem_used);
+        out_put_str(ob, "}\n");
+    }
+
+    size_t i;
+    for (i = 0; breakdown != NULL && i < breakdown->count; i++) {
+        out_put_str(ob, "{\"type\":\"cpu\",\"id\":");
+        out_put_u64(ob, breakdown->ids[i]);
+        out_put_str(ob, ",\"busy\":");
+        out_put_float(ob, breakdown->busy[i]);
+        out_put_str(ob, ",\"user\":");
+        out_put_float(ob, breakdown->user[i]);
+        out_put_str(ob, ",\"system\":");
+        out_put_float(ob, breakdown->system[i]);
+        out_put_str(ob, ",\"iowait\":");
+        out_put_float(ob, breakdown->iowait[i]);
+        out_put_str(ob, ",\"steal\":");
+        out_put_float(ob, breakdown->steal[i]);
+        out_put_str(ob, "}\n");
     }
 
-    index = 0;
-    for(i = 0; i < 50; i++) {
-        if(fork_line[i] > 47 && fork_line[i] < 58) {
+    if (summary != NULL) {
+        out_put_str(ob, "{\"type\":\"task_summary\",\"tasks_running\":");
+        out_put_u64(ob, summary->task_running);
+        out_put_str(ob, ",\"interrupts\":");
+        out_put_u64(ob, summary->interrupts);
+        out_put_str(ob, ",\"context_switches\":");
+        out_put_u64(ob, summary->c_switch);
+        out_put_str(ob, ",\"forks\":");
+        out_put_u64(ob, summary->forks);
+        out_put_str(ob, "}\n");
+    }
 
-            fork[index] = fork_line[i];
-            index++;
+    //with --diff, only the tasks that changed are written
+    if (snap->diffs != NULL) {
+        for (i = 0; i < snap->num_diffs; i++) {
+            struct task_diff *diff = &snap->diffs[i];
+            const char *change = diff->change == TASK_ADDED ? "added"
+                : diff->change == TASK_EXITED ? "exited" : "changed";
+            write_task_jsonl(ob, &diff->row, insp, columns, change);
         }
-        if(fork_line[i] == 0) {
-            fork[index] = '\0';
-            break;
+        return;
+    }
+    for (i = 0; i < num_rows; i++) {
+        write_task_jsonl(ob, &rows[i], insp, columns, NULL);
+    }
+}
+
+/**
+ * Writes one "task" object. 'change' is how the task changed, with --diff,
+ * or NULL.
+ */
+void write_task_jsonl(struct out_buf *ob, struct task_row *row,
+    struct inspector *insp, unsigned int columns, const char *change) {
+
+    out_put_str(ob, "{\"type\":\"task\",\"pid\":");
+    out_put_u64(ob, row->pid);
+    if ((columns & COL_BIT(TASK_COL_TID)) && row->tid != 0) {
+        out_put_str(ob, ",\"tid\":");
+        out_put_u64(ob, row->tid);
+    }
+    if (columns & COL_BIT(TASK_COL_STATE)) {
+        out_put_str(ob, ",\"state\":");
+        out_put_json_str(ob, task_state_name(row->state_code));
+    }
+    if (columns & COL_BIT(TASK_COL_NAME)) {
+        out_put_str(ob, ",\"name\":");
+        out_put_json_str(ob, row->task_name);
+    }
+    if ((columns & COL_BIT(TASK_COL_USER)) && row->uid != NO_UID) {
+        const char *username = inspector_username(insp, row->uid);
+        out_put_str(ob, ",\"uid\":");
+        out_put_u64(ob, row->uid);
+        if (username != NULL) {
+            out_put_str(ob, ",\"user\":");
+            out_put_json_str(ob, username);
         }
     }
+    if (columns & COL_BIT(TASK_COL_THREADS)) {
+        out_put_str(ob, ",\"threads\":");
+        out_put_u64(ob, row->threads);
+    }
+    if ((columns & COL_BIT(TASK_COL_CPU)) && row->cpu_usage >= 0) {
+        out_put_str(ob, ",\"cpu\":");
+        out_put_float(ob, row->cpu_usage);
+    }
+    if (columns & COL_BIT(TASK_COL_RSS)) {
+        out_put_str(ob, ",\"rss_kb\":");
+        out_put_u64(ob, row->rss_kb);
+    }
+    if (columns & COL_BIT(TASK_COL_VSZ)) {
+        out_put_str(ob, ",\"vsz_kb\":");
+        out_put_u64(ob, row->vsz_kb);
+    }
+    if (columns & COL_BIT(TASK_COL_SWAP)) {
+        out_put_str(ob, ",\"swap_kb\":");
+        out_put_u64(ob, row->swap_kb);
+    }
+    if (change != NULL) {
+        out_put_str(ob, ",\"change\":");
+        out_put_json_str(ob, change);
+    }
+    out_put_str(ob, "}\n");
 }
 
-int is_digit(char d_name[], int len) {
+/**
+ * Appends a zeroed binary record of the given type to the buffer and
+ * returns its payload, to be filled in place.
+ */
+void *out_buf_record(struct out_buf *ob, enum record_type type,
+    size_t payload_sz) {
 
-    //if the string is all digit
-    int i;
-    for(i = 0; i < len; i++) {
-        if(d_name[i]<48 || d_name[i]>57) {
-            return 0;
-        }
+    size_t len = sizeof(struct rec_header) + ((payload_sz + 7) & ~(size_t) 7);
+    char *dst = out_buf_reserve(ob, len);
+    if (dst == NULL) {
+        return NULL;
     }
-    return 1;
+    memset(dst, 0, len);
+
+    struct rec_header header = { len, type, RECORD_VERSION };
+    memcpy(dst, &header, sizeof(header));
+    ob->len += len;
+    return dst + sizeof(header);
 }
 
+/**
+ * Writes every collected section as length-prefixed binary records, in the
+ * same order as write_jsonl().
+ */
+void write_binary(struct out_buf *ob, struct inspector_snapshot *snap) {
+
+    struct system_info *sys_info = snap->system;
+    struct hardware_info *hw_info = snap->hardware;
+    struct cpu_breakdown *breakdown = snap->breakdown;
+    struct task_summary *summary = snap->summary;
+    struct task_row *rows = snap->rows;
+    size_t num_rows = snap->num_rows;
+
+    struct rec_sample *sample = out_buf_record(ob, REC_SAMPLE, sizeof(*sample));
+    if (sample != NULL) {
+        sample->time_ns = (uint64_t) snap->time.tv_sec * 1000000000
+            + snap->time.tv_nsec;
+    }
 
-int get_task_running(char* procfs_loc) {
+    if (sys_info != NULL) {
+        struct rec_system *rec = out_buf_record(ob, REC_SYSTEM, sizeof(*rec));
+        if (rec != NULL) {
+            rec->uptime = sys_info->uptime;
+            memcpy(rec->hostname, sys_info->hostname, HOSTNAME_SZ);
+            memcpy(rec->version, sys_info->version, BUF_SZ);
+        }
+    }
 
-    //read all file and directory
-    DIR *directory;
-    if ((directory = opendir(procfs_loc)) == NULL) {
-        perror("opendir");
-        closedir(directory);
-        return 1;
+    if (hw_info != NULL) {
+        struct rec_hardware *rec = out_buf_record(ob, REC_HARDWARE, sizeof(*rec));
+        if (rec != NULL) {
+            rec->mem_total = hw_info->mem_total;
+            rec->mem_used = hw_info->mem_used;
+            memcpy(rec->load_avg, hw_info->load_avg, sizeof(rec->load_avg));
+            rec->cpu_usage = hw_info->cpu_usage * 100;
+            rec->proc_units = hw_info->proc_units;
+            memcpy(rec->cpu_model, hw_info->cpu_model, BUF_SZ);
+        }
     }
-    int result = 0;
-    struct dirent *entry;
-    while ((entry = readdir(directory)) != NULL) {
-        //if it is a file and not a directory
-        if((is_digit(entry->d_name, strlen(entry->d_name)) == 1) && (entry->d_type == 4)) {
-            result++;
+
+    size_t i;
+    for (i = 0; breakdown != NULL && i < breakdown->count; i++) {
+        struct rec_cpu *rec = out_buf_record(ob, REC_CPU, sizeof(*rec));
+        if (rec != NULL) {
+            rec->id = breakdown->ids[i];
+            rec->busy = breakdown->busy[i];
+            rec->user = breakdown->user[i];
+            rec->system = breakdown->system[i];
+            rec->iowait = breakdown->iowait[i];
+            rec->steal = breakdown->steal[i];
         }
     }
 
-    closedir(directory);
-    return result;
+    if (summary != NULL) {
+        struct rec_task_summary *rec = out_buf_record(ob, REC_TASK_SUMMARY,
+            sizeof(*rec));
+        if (rec != NULL) {
+            rec->interrupts = summary->interrupts;
+            rec->c_switch = summary->c_switch;
+            rec->forks = summary->forks;
+            rec->task_running = summary->task_running;
+        }
+    }
+
+    if (snap->diffs != NULL) {
+        write_task_changes(ob, snap->diffs, snap->num_diffs);
+    } else {
+        write_task_records(ob, rows, num_rows);
+    }
 }
 
-void get_load_avg(char* procfs_loc, char* load_avg_1, char* load_avg_5, char* load_avg_15){
+void write_task_records(struct out_buf *ob, struct task_row *rows,
+    size_t num_rows) {
+
+    size_t i;
+    for (i = 0; i < num_rows; i++) {
+        struct rec_task *rec = out_buf_record(ob, REC_TASK, sizeof(*rec));
+        if (rec != NULL) {
+            fill_task_record(rec, &rows[i]);
+        }
+    }
+}
 
-    char fp[255];
-    strcpy(fp, procfs_loc);
-    strcat(fp, "/loadavg");
+void write_task_changes(struct out_buf *ob, struct task_diff *diffs,
+    size_t num_diffs) {
 
-    char one_line[BUF_SZ];
-    int length = 0;
-    char buf[1];
-    
-    ssize_t read_sz;
+    size_t i;
+    for (i = 0; i < num_diffs; i++) {
+        struct rec_task_change *rec = out_buf_record(ob, REC_TASK_CHANGE,
+            sizeof(*rec));
+        if (rec != NULL) {
+            rec->change = diffs[i].change;
+            fill_task_record(&rec->task, &diffs[i].row);
+        }
+    }
+}
 
-    int fd = open(fp, O_RDONLY);
+void fill_task_record(struct rec_task *rec, const struct task_row *row) {
+    rec->pid = row->pid;
+    rec->uid = row->uid;
+    rec->threads = row->threads;
+    snprintf(rec->state, STATE_SZ, "%s", task_state_name(row->state_code));
+    memcpy(rec->task_name, row->task_name, TASK_NAME_SZ);
+    rec->cpu_usage = row->cpu_usage;
+    rec->rss_kb = row->rss_kb;
+    rec->vsz_kb = row->vsz_kb;
+    rec->swap_kb = row->swap_kb;
+    rec->tid = row->tid;
+}
 
-    while((read_sz = read(fd, buf, 1)) >0) {
+/**
+ * Maps an existing recording, or prepares to create 'rec->path' when the
+ * first sample is appended. Files that exist but aren't recordings are
+ * refused rather than overwritten.
+ */
+int recorder_open(struct recorder *rec) {
 
-        one_line[length] = buf[0];
-        length++;
-        
+    rec->map = NULL;
+    if (out_buf_init(&rec->buf, -1) == -1) {
+        return -1;
+    }
+    rec->fd = open(rec->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (rec->fd == -1) {
+        perror("open");
+        return -1;
     }
-    one_line[length-1] = '\0';
-    close(fd);
 
-    //token string 
-    char *load_tok = one_line;
-    char *temp;
-    int tokens = 0;
-    while((temp = next_token(&load_tok, " ")) != NULL){
-        if(tokens == 0) {
-            strcpy(load_avg_1, temp);
-        }
+    struct stat st;
+    if (fstat(rec->fd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
 
-        if (tokens == 1) {
-            strcpy(load_avg_5, temp);
+    if (recorder_check(rec, st.st_size) == -1) {
+        return -1;
+    }
+    return recorder_map(rec, st.st_size, PROT_READ | PROT_WRITE);
+}
+
+/**
+ * Makes sure the open file is a recording whose layout matches its size.
+ */
+int recorder_check(struct recorder *rec, off_t file_sz) {
+
+    struct ring_header header;
+    if (pread(rec->fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, RING_MAGIC, sizeof(header.magic)) != 0
+        || header.version != RING_VERSION
+        || header.index_cap == 0
+        || header.data_off < RING_HEADER_SZ + header.index_cap * sizeof(struct ring_entry)
+        || header.data_off + header.data_size != (uint64_t) file_sz) {
+        fprintf(stderr, "%s is not an inspector recording.\n", rec->path);
+        return -1;
+    }
+    return 0;
+}
+
+int recorder_map(struct recorder *rec, size_t map_sz, int prot) {
+
+    rec->map = mmap(NULL, map_sz, prot, MAP_SHARED, rec->fd, 0);
+    if (rec->map == MAP_FAILED) {
+        perror("mmap");
+        rec->map = NULL;
+        return -1;
+    }
+    rec->map_sz = map_sz;
+    rec->header = (struct ring_header *) rec->map;
+    rec->index = (struct ring_entry *) (rec->map + RING_HEADER_SZ);
+    rec->data = rec->map + rec->header->data_off;
+    return 0;
+}
+
+/**
+ * Sizes and creates the ring for samples of about 'sample_len' bytes: room
+ * for 'hours' worth of samples at the recording interval (plus headroom for
+ * the task list growing), but never more than 'max_sz' bytes of data. The
+ * space is allocated up front so a full disk can't fault the mapping later.
+ */
+int recorder_create(struct recorder *rec, size_t sample_len) {
+
+    uint64_t samples = (uint64_t) rec->hours * 3600 * 1000 / rec->interval_ms;
+    if (samples == 0) {
+        samples = 1;
+    }
+
+    //room for half as much again as this sample, up to the size cap
+    uint64_t sample_room = sample_len + sample_len / 2;
+    uint64_t data_size = rec->max_sz;
+    if (samples < data_size / sample_room) {
+        data_size = samples * sample_room;
+    }
+    data_size = (data_size + RING_HEADER_SZ - 1) & ~(uint64_t) (RING_HEADER_SZ - 1);
+
+    //no more samples than the data ring can hold
+    if (samples > data_size / sample_len + 1) {
+        samples = data_size / sample_len + 1;
+    }
+    uint64_t index_sz = samples * sizeof(struct ring_entry);
+    uint64_t data_off = RING_HEADER_SZ
+        + ((index_sz + RING_HEADER_SZ - 1) & ~(uint64_t) (RING_HEADER_SZ - 1));
+
+    int err = posix_fallocate(rec->fd, 0, data_off + data_size);
+    if (err != 0) {
+        errno = err;
+        perror("posix_fallocate");
+        return -1;
+    }
+
+    struct ring_header header = {
+        .magic = RING_MAGIC,
+        .version = RING_VERSION,
+        .interval_ms = rec->interval_ms,
+        .index_cap = samples,
+        .data_off = data_off,
+        .data_size = data_size,
+    };
+    if (pwrite(rec->fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("pwrite");
+        return -1;
+    }
+
+    LOG("Created %s: %" PRIu64 " samples, %" PRIu64 " bytes of data\n",
+        rec->path, samples, data_size);
+    return recorder_map(rec, data_off + data_size, PROT_READ | PROT_WRITE);
+}
+
+/**
+ * Copies one serialised sample into the ring, dropping the oldest samples
+ * it overwrites (or whose index slot it takes).
+ */
+int recorder_append(struct recorder *rec, struct timespec *time,
+    const char *sample, size_t len, uint32_t num_tasks) {
+
+    if (rec->map == NULL && recorder_create(rec, len) == -1) {
+        return -1;
+    }
+
+    struct ring_header *header = rec->header;
+    if (len > header->data_size) {
+        LOG("Sample of %zu bytes doesn't fit in the ring\n", len);
+        return -1;
+    }
+
+    uint64_t head = header->head;
+    uint64_t tail = header->tail;
+
+    //samples never straddle the end of the ring: wrapping skips the space
+    //left past 'write_pos', so the samples there (the oldest ones) go first
+    uint64_t pos = header->write_pos;
+    if (pos + len > header->data_size) {
+        while (tail < head
+            && rec->index[tail % header->index_cap].offset >= pos) {
+            tail++;
         }
+        pos = 0;
+    }
 
-        if (tokens == 2) {
-            strcpy(load_avg_15, temp);
+    while (tail < head) {
+        struct ring_entry *oldest = &rec->index[tail % header->index_cap];
+        bool overlaps = oldest->offset < pos + len
+            && pos < oldest->offset + oldest->len;
+        if (overlaps == false && head - tail < header->index_cap) {
             break;
         }
-        tokens++;
+        tail++;
     }
+    __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+
+    memcpy(rec->data + pos, sample, len);
+    struct ring_entry *entry = &rec->index[head % header->index_cap];
+    entry->time_ns = (uint64_t) time->tv_sec * 1000000000 + time->tv_nsec;
+    entry->offset = pos;
+    entry->len = len;
+    entry->num_tasks = num_tasks;
 
+    header->write_pos = pos + len;
+    __atomic_store_n(&header->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
 }
 
-int get_proc_unit(char* procfs_loc) {
+void recorder_close(struct recorder *rec) {
+    if (rec->map != NULL) {
+        munmap(rec->map, rec->map_sz);
+        rec->map = NULL;
+    }
+    if (rec->fd != -1) {
+        close(rec->fd);
+        rec->fd = -1;
+    }
+    out_buf_free(&rec->buf);
+}
 
-    int result = 0;
-    char *pre = "cpu";
-    char *stop = "intr";
-    char fp[255];
-    strcpy(fp, procfs_loc);
-    strcat(fp, "/stat");
-
-    char one_line[BUF_SZ];
-    int length = 0;
-    char buf[1];
-    
-    ssize_t read_sz;
-
-    int fd = open(fp, O_RDONLY);
-    while((read_sz = read(fd, buf, 1)) >0) {
-
-        if(buf[0] == '\n') {
-            //one line has been read
-            one_line[length] = '\0';
-            if(strncmp(pre, one_line, strlen(pre)) == 0) {
-                result++;
-            }
+/**
+ * Serialises the raw counters of one sample as binary records: the
+ * aggregate stat counters, meminfo, loadavg and one row per task.
+ */
+void write_record_sample(struct out_buf *ob, struct inspector_snapshot *snap) {
 
-            //stop reading when find "intr"
-            if(strncmp(stop, one_line, strlen(stop)) == 0) {
-                break;
-            }
+    struct rec_sample *sample = out_buf_record(ob, REC_SAMPLE, sizeof(*sample));
+    if (sample != NULL) {
+        sample->time_ns = (uint64_t) snap->time.tv_sec * 1000000000
+            + snap->time.tv_nsec;
+    }
 
-            one_line[0] = '\0';
-            length = 0;
-        } else {
-            if(strlen(one_line) >= 127) {
-                //previent too many unnessary '0'
-                break;
-            }
+    struct rec_stat *stat = out_buf_record(ob, REC_STAT, sizeof(*stat));
+    if (stat != NULL) {
+        memcpy(stat->cpu, snap->stat->cpu, sizeof(stat->cpu));
+        stat->intr = snap->stat->intr;
+        stat->ctxt = snap->stat->ctxt;
+        stat->btime = snap->stat->btime;
+        stat->processes = snap->stat->processes;
+        stat->procs_running = snap->stat->procs_running;
+        stat->procs_blocked = snap->stat->procs_blocked;
+    }
 
-            //in the middle of the line
-            one_line[length] = buf[0];
-            length++;
-        }
+    struct rec_meminfo *meminfo = out_buf_record(ob, REC_MEMINFO, sizeof(*meminfo));
+    if (meminfo != NULL) {
+        meminfo->mem = *snap->mem;
+    }
+
+    struct rec_loadavg *loadavg = out_buf_record(ob, REC_LOADAVG, sizeof(*loadavg));
+    if (loadavg != NULL) {
+        loadavg->load = *snap->load;
+    }
+
+    write_task_records(ob, snap->rows, snap->num_rows);
+}
+
+/**
+ * Collects the raw counters and task list once and appends them to the
+ * recording. Nothing is printed.
+ */
+int record_sample(struct cli *cli) {
+
+    struct recorder *rec = cli->recorder;
+    struct self_timer timer;
+
+    struct inspector_snapshot snap;
+    if (inspector_collect(cli->insp, &snap) == -1) {
+        return -1;
+    }
+
+    SELF_BEGIN(&timer, SELF_OUTPUT);
+    rec->buf.len = 0;
+    write_record_sample(&rec->buf, &snap);
+    int appended = recorder_append(rec, &snap.time, rec->buf.data,
+        rec->buf.len, snap.num_rows);
+    SELF_END(&timer);
+    if (appended == -1) {
+        return -1;
     }
-    close(fd);
-    return result-1;
+
+    //a new recording also gets the values that never change, for replays
+    struct ring_header *header = rec->header;
+    if (header->proc_units == 0) {
+        struct system_info sys_info;
+        struct hardware_info hw_info;
+        inspector_describe(cli->insp, &sys_info, &hw_info);
+        memcpy(header->hostname, sys_info.hostname, HOSTNAME_SZ);
+        memcpy(header->kernel_version, sys_info.version, BUF_SZ);
+        memcpy(header->cpu_model, hw_info.cpu_model, BUF_SZ);
+        header->proc_units = hw_info.proc_units;
+    }
+    return 0;
 }
 
+/**
+ * Appends a sample to the recording every 'interval_ms' until interrupted,
+ * or just once if 'interval_ms' is 0.
+ */
+int run_record(struct cli *cli, long interval_ms) {
 
+    install_stop_handlers();
 
-void get_CPU_mode(char* procfs_loc, char* CPU_mode){
-    char *pre = "model name";
-    char fp[255];
-    strcpy(fp, procfs_loc);
-    strcat(fp, "/cpuinfo");
+    struct timespec next_tick;
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
 
-    char one_line[BUF_SZ];
-    int length = 0;
-    char buf[1];
-    
-    ssize_t read_sz;
+    int result = 0;
+    while (watch_stop == 0) {
+        if (record_sample(cli) == -1) {
+            result = -1;
+            break;
+        }
+        if (interval_ms == 0) {
+            break;
+        }
+        wait_for_tick(&next_tick, interval_ms);
+    }
+    return result;
+}
 
-    int fd = open(fp, O_RDONLY);
+/**
+ * Maps an existing recording read-only, for replaying it.
+ */
+int recorder_load(struct recorder *rec) {
 
-    while((read_sz = read(fd, buf, 1)) >0) {
+    rec->map = NULL;
+    rec->fd = open(rec->path, O_RDONLY | O_CLOEXEC);
+    if (rec->fd == -1) {
+        perror("open");
+        return -1;
+    }
 
-        if(buf[0] == '\n') {
-            //one line has been read
-            one_line[length] = '\0';
-            int result =strncmp(pre, one_line, strlen(pre));
-            if(result == 0) {
-                strcpy(CPU_mode, one_line);
-                break;
-            }
-            one_line[0] = '\0';
-            length = 0;
+    struct stat st;
+    if (fstat(rec->fd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    if (recorder_check(rec, st.st_size) == -1) {
+        return -1;
+    }
+    return recorder_map(rec, st.st_size, PROT_READ);
+}
+
+/**
+ * Returns the first sample in [first, last) taken at or after 'time_ns', or
+ * 'last' if there is none. Samples are appended in time order, so this is a
+ * binary search over the index.
+ */
+uint64_t ring_lower_bound(struct recorder *rec, uint64_t first, uint64_t last,
+    uint64_t time_ns) {
+
+    uint64_t cap = rec->header->index_cap;
+    while (first < last) {
+        uint64_t mid = first + (last - first) / 2;
+        if (rec->index[mid % cap].time_ns < time_ns) {
+            first = mid + 1;
         } else {
-            //in the middle of the line
-            one_line[length] = buf[0];
-            length++;
+            last = mid;
         }
     }
+    return first;
+}
 
-    close(fd);
-    
-    //token string
-    char *cpu_tok = CPU_mode;
-    char *cpu_mode;
-    int tokens = 0;
-    while((cpu_mode = next_token(&cpu_tok, "\t:")) != NULL){
-        if(tokens == 1) {
+/**
+ * Locates the fixed records at the front of a recorded sample. The task rows
+ * are left where they are; 'tasks' points at the first of them.
+ */
+int replay_decode(struct recorder *rec, uint64_t seq,
+    struct replay_sample *sample) {
+
+    struct ring_entry *entry = &rec->index[seq % rec->header->index_cap];
+    if (entry->offset + entry->len > rec->header->data_size) {
+        return -1;
+    }
+
+    const char *pos = rec->data + entry->offset;
+    const char *end = pos + entry->len;
+    memset(sample, 0, sizeof(*sample));
+    sample->time_ns = entry->time_ns;
+    sample->num_tasks = entry->num_tasks;
+    sample->end = end;
+
+    while (pos + sizeof(struct rec_header) <= end) {
+        struct rec_header header;
+        memcpy(&header, pos, sizeof(header));
+        if (header.len < sizeof(header) || header.len > (size_t) (end - pos)) {
+            return -1;
+        }
+
+        const char *payload = pos + sizeof(header);
+        if (header.type == REC_STAT) {
+            sample->stat = (const struct rec_stat *) payload;
+        } else if (header.type == REC_MEMINFO) {
+            sample->mem = &((const struct rec_meminfo *) payload)->mem;
+        } else if (header.type == REC_LOADAVG) {
+            sample->load = &((const struct rec_loadavg *) payload)->load;
+        } else if (header.type == REC_TASK) {
+            //the rest of the sample is task rows
+            sample->tasks = pos;
             break;
         }
-        tokens++;
+        pos += header.len;
     }
-    strcpy(CPU_mode, cpu_mode+1);
+
+    if (sample->stat == NULL || sample->mem == NULL || sample->load == NULL) {
+        return -1;
+    }
+    return 0;
 }
 
+/**
+ * Copies the task rows of a decoded sample into 'rows', which has room for
+ * sample->num_tasks of them. Returns the number of rows.
+ */
+size_t replay_tasks(struct replay_sample *sample, struct task_row *rows) {
 
+    size_t num_rows = 0;
+    const char *pos = sample->tasks;
+    while (pos != NULL && pos + sizeof(struct rec_header) <= sample->end
+        && num_rows < sample->num_tasks) {
 
-void get_uptime(char* procfs_loc, char* uptime)
-{
+        struct rec_header header;
+        memcpy(&header, pos, sizeof(header));
+        if (header.len < sizeof(header) || header.len > (size_t) (sample->end - pos)) {
+            break;
+        }
+        if (header.type == REC_TASK) {
+            const struct rec_task *rec = (const void *) (pos + sizeof(header));
+            struct task_row *row = &rows[num_rows++];
+            row->pid = rec->pid;
+            row->tid = header.version >= 4 ? rec->tid : 0;
+            row->uid = rec->uid;
+            row->threads = rec->threads;
+            row->state_code = task_state_code(rec->state);
+            memcpy(row->task_name, rec->task_name, TASK_NAME_SZ);
+
+            //older records end before the fields added since
+            row->cpu_usage = -1;
+            if (header.version >= 2) {
+                row->cpu_usage = rec->cpu_usage;
+            }
+            row->rss_kb = 0;
+            row->vsz_kb = 0;
+            row->swap_kb = 0;
+            if (header.version >= 3) {
+                row->rss_kb = rec->rss_kb;
+                row->vsz_kb = rec->vsz_kb;
+                row->swap_kb = rec->swap_kb;
+            }
+            row->cpu_ticks = 0;
+            row->start_time = 0;
+        }
+        pos += header.len;
+    }
+    return num_rows;
+}
 
-    char fp[255];
-    strcpy(fp, procfs_loc);
-    strcat(fp, "/uptime");
-    
-    char *buf = calloc(BUF_SZ, sizeof(char));
-    ssize_t read_sz;
+/**
+ * CPU usage of a recorded sample, measured against the sample before it, or
+ * -1 if that sample is gone.
+ */
+float replay_cpu_usage(struct recorder *rec, uint64_t seq,
+    struct replay_sample *sample) {
 
-    int fd = open(fp, O_RDONLY);
-    int file_size = 0;
-    while((read_sz = read(fd, buf, BUF_SZ)) >0) {
+    struct replay_sample prev;
+    if (seq == 0 || seq - 1 < rec->header->tail
+        || replay_decode(rec, seq - 1, &prev) == -1) {
+        return -1.0;
+    }
 
-        int i;
-        for(i = 0; i < read_sz; ++i) {
-            if(buf[i] == EOF) {
-                //if read to the end of the file
-                file_size+=i;
-                strncat(uptime, buf, i);
-            }
+    return cpu_usage_from_times(prev.stat->cpu, sample->stat->cpu);
+}
+
+/**
+ * Parses a replay time: seconds since the epoch, or an offset back from the
+ * newest sample like "-90", "-15m", "-2h" or "-1d".
+ */
+int parse_replay_time(const char *arg, uint64_t latest_ns, uint64_t *time_ns) {
+
+    char *end;
+    if (arg[0] == '-') {
+        double offset = strtod(arg + 1, &end);
+        double unit = 1;
+        if (*end == 'm') {
+            unit = 60;
+        } else if (*end == 'h') {
+            unit = 3600;
+        } else if (*end == 'd') {
+            unit = 86400;
+        } else if (*end != 's' && *end != '\0') {
+            return -1;
         }
-        strncat(uptime, buf, read_sz);
-        file_size+=read_sz;
+        if (end == arg + 1 || (*end != '\0' && end[1] != '\0')) {
+            return -1;
+        }
+        uint64_t back = offset * unit * 1e9;
+        *time_ns = back > latest_ns ? 0 : latest_ns - back;
+        return 0;
     }
 
-    uptime[file_size-1] = '\0';
-    close(fd);
-    free(buf);
+    double seconds = strtod(arg, &end);
+    if (end == arg || *end != '\0' || seconds < 0) {
+        return -1;
+    }
+    *time_ns = seconds * 1e9;
+    return 0;
+}
 
-    //token string
-    char *up_tok = uptime;
-    char *up_time;
-    int tokens = 0;
-    while((up_time = next_token(&up_tok, " ")) != NULL){
-        if(tokens == 0) {
-            break;
+void format_time_ns(uint64_t time_ns, char *buf, size_t buf_sz) {
+    time_t seconds = time_ns / 1000000000;
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    strftime(buf, buf_sz, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+void range_add(struct range_stat *stat, double value) {
+    if (stat->count == 0 || value < stat->min) {
+        stat->min = value;
+    }
+    if (stat->count == 0 || value > stat->max) {
+        stat->max = value;
+    }
+    stat->sum += value;
+    stat->count++;
+}
+
+double range_avg(struct range_stat *stat) {
+    return stat->count == 0 ? 0.0 : stat->sum / stat->count;
+}
+
+void print_range_summary(FILE *out, struct range_summary *summary) {
+
+    char from[TIME_STR_SZ];
+    char to[TIME_STR_SZ];
+    format_time_ns(summary->from_ns, from, sizeof(from));
+    format_time_ns(summary->to_ns, to, sizeof(to));
+
+    fprintf(out, "Recorded Range\n");
+    fprintf(out, "------------------\n" );
+    fprintf(out, "From: %s\n", from);
+    fprintf(out, "To: %s\n", to);
+    fprintf(out, "Samples: %zu\n", summary->samples);
+    fprintf(out, "%-16s %9s %9s %9s\n", "", "min", "avg", "max");
+
+    struct {
+        const char *label;
+        struct range_stat *stat;
+        const char *format;
+    } rows[] = {
+        { "CPU Usage:", &summary->cpu, "%-16s %8.1f%% %8.1f%% %8.1f%%\n" },
+        { "Memory (GB):", &summary->mem, "%-16s %9.1f %9.1f %9.1f\n" },
+        { "Tasks running:", &summary->tasks, "%-16s %9.0f %9.1f %9.0f\n" },
+        { "Load (1 min):", &summary->load, "%-16s %9.2f %9.2f %9.2f\n" },
+    };
+
+    size_t i;
+    for (i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+        fprintf(out, rows[i].format, rows[i].label, rows[i].stat->min,
+            range_avg(rows[i].stat), rows[i].stat->max);
+    }
+    fprintf(out, "\n");
+}
+
+void write_range_jsonl(struct out_buf *ob, struct range_summary *summary) {
+
+    out_put_str(ob, "{\"type\":\"range\",\"from_ns\":");
+    out_put_u64(ob, summary->from_ns);
+    out_put_str(ob, ",\"to_ns\":");
+    out_put_u64(ob, summary->to_ns);
+    out_put_str(ob, ",\"samples\":");
+    out_put_u64(ob, summary->samples);
+
+    struct {
+        const char *key;
+        struct range_stat *stat;
+    } stats[] = {
+        { "cpu_usage", &summary->cpu },
+        { "mem_used_gb", &summary->mem },
+        { "tasks_running", &summary->tasks },
+        { "load_avg_1", &summary->load },
+    };
+
+    size_t i;
+    for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+        out_put_str(ob, ",\"");
+        out_put_str(ob, stats[i].key);
+        out_put_str(ob, "\":{\"min\":");
+        out_put_float(ob, stats[i].stat->min);
+        out_put_str(ob, ",\"avg\":");
+        out_put_float(ob, range_avg(stats[i].stat));
+        out_put_str(ob, ",\"max\":");
+        out_put_float(ob, stats[i].stat->max);
+        out_put_str(ob, "}");
+    }
+    out_put_str(ob, "}\n");
+}
+
+/**
+ * Summarises every sample in [from_ns, to_ns]. The ends of the range are
+ * found with binary searches over the index, and only the fixed records at
+ * the front of each sample are looked at; the task rows are never decoded.
+ */
+int replay_range(struct cli *cli, struct recorder *rec, FILE *out,
+    uint64_t from_ns, uint64_t to_ns) {
+
+    uint64_t head = __atomic_load_n(&rec->header->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&rec->header->tail, __ATOMIC_ACQUIRE);
+    uint64_t first = ring_lower_bound(rec, tail, head, from_ns);
+    uint64_t last = ring_lower_bound(rec, first, head, to_ns + 1);
+    if (first == last) {
+        fprintf(stderr, "No samples recorded in that range.\n");
+        return -1;
+    }
+
+    struct range_summary summary = {
+        .from_ns = rec->index[first % rec->header->index_cap].time_ns,
+        .to_ns = rec->index[(last - 1) % rec->header->index_cap].time_ns,
+    };
+
+    uint64_t seq;
+    for (seq = first; seq < last; seq++) {
+        struct replay_sample sample;
+        if (replay_decode(rec, seq, &sample) == -1) {
+            continue;
+        }
+        summary.samples++;
+        float usage = replay_cpu_usage(rec, seq, &sample);
+        if (usage >= 0) {
+            range_add(&summary.cpu, usage * 100);
         }
-        tokens++;
+        range_add(&summary.mem, (double) sample.mem->active / 1024 / 1024);
+        range_add(&summary.tasks, sample.num_tasks);
+        range_add(&summary.load, sample.load->avg[0]);
     }
-    
-    strcpy(uptime, up_time);
+
+    if (cli->format == FORMAT_JSONL) {
+        write_range_jsonl(&cli->out, &summary);
+        return out_buf_flush(&cli->out);
+    }
+    print_range_summary(out, &summary);
+    return 0;
 }
 
+/**
+ * Renders the newest sample taken at or before 'time_ns' with the same
+ * printers (and formats) as a live sample.
+ */
+int replay_at(struct cli *cli, struct recorder *rec, FILE *out,
+    uint64_t time_ns) {
+
+    struct inspector_sections *options = &cli->options;
+    struct ring_header *header = rec->header;
+
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    uint64_t seq = ring_lower_bound(rec, tail, head, time_ns + 1);
+    if (seq == tail) {
+        fprintf(stderr, "No sample recorded at or before that time.\n");
+        return -1;
+    }
+    seq--;
 
-void get_kernel_version(char* procfs_loc, char* version)
-{
-    char fp[255];
-    strcpy(fp, procfs_loc);
-    strcat(fp, "/version");
-    
-    char *buf = calloc(BUF_SZ, sizeof(char));
-    ssize_t read_sz;
+    struct replay_sample sample;
+    if (replay_decode(rec, seq, &sample) == -1) {
+        fprintf(stderr, "Sample %" PRIu64 " is damaged.\n", seq);
+        return -1;
+    }
 
-    int fd = open(fp, O_RDONLY);
-    int file_size = 0;
-    while((read_sz = read(fd, buf, BUF_SZ)) >0) {
+    struct system_info sys_info;
+    if (options->system) {
+        memcpy(sys_info.hostname, header->hostname, HOSTNAME_SZ);
+        memcpy(sys_info.version, header->kernel_version, BUF_SZ);
+        sys_info.uptime = sample.time_ns / 1000000000 - sample.stat->btime;
+    }
 
-        int i;
-        for(i = 0; i < read_sz; ++i) {
-            if(buf[i] == EOF) {
-                file_size+=i;
-                strncat(version, buf, i);
-            }
+    struct hardware_info hw;
+    struct hardware_info *hw_info = &hw;
+    if (options->hardware) {
+        memcpy(hw_info->cpu_model, header->cpu_model, BUF_SZ);
+        hw_info->proc_units = header->proc_units;
+        memcpy(hw_info->load_avg, sample.load->avg, sizeof(hw_info->load_avg));
+        hw_info->mem_total = sample.mem->total;
+        hw_info->mem_used = sample.mem->active;
+        hw_info->cpu_usage = replay_cpu_usage(rec, seq, &sample);
+        if (hw_info->cpu_usage < 0) {
+            hw_info->cpu_usage = 0.0;
         }
-        strncat(version, buf, read_sz);
-        file_size+=read_sz;
     }
 
-    version[file_size-1] = '\0';
-    close(fd);
-    free(buf);
+    struct task_summary summary;
+    if (options->task_summary) {
+        summary.task_running = sample.num_tasks;
+        summary.interrupts = sample.stat->intr;
+        summary.c_switch = sample.stat->ctxt;
+        summary.forks = sample.stat->processes;
+    }
 
-    //token version string
-    char *ver_tok = version;
-    char *ker_version;
-    int tokens = 0;
-    while((ker_version = next_token(&ver_tok, " ")) != NULL){
-        if(tokens == 2) {
-            break;
+    size_t num_rows = 0;
+    if (options->task_list) {
+        if (sample.num_tasks > cli->replay_cap) {
+            struct task_row *new_rows = realloc(cli->replay_rows,
+                sample.num_tasks * sizeof(struct task_row));
+            if (new_rows == NULL) {
+                perror("realloc");
+                return -1;
+            }
+            cli->replay_rows = new_rows;
+            cli->replay_cap = sample.num_tasks;
         }
-        tokens++;
+        num_rows = replay_tasks(&sample, cli->replay_rows);
     }
-    strcpy(version, ker_version);
+
+    //a recorder running alongside may have reused the sample meanwhile
+    if (__atomic_load_n(&header->tail, __ATOMIC_ACQUIRE) > seq) {
+        fprintf(stderr, "Sample was overwritten while reading it.\n");
+        return -1;
+    }
+
+    if (cli->format == FORMAT_TEXT) {
+        char when[TIME_STR_SZ];
+        format_time_ns(sample.time_ns, when, sizeof(when));
+        fprintf(out, "Recorded: %s\n\n", when);
+    }
+    struct inspector_snapshot snap = {
+        .time = { sample.time_ns / 1000000000, sample.time_ns % 1000000000 },
+        .system = options->system ? &sys_info : NULL,
+        .hardware = options->hardware ? hw_info : NULL,
+        .summary = options->task_summary ? &summary : NULL,
+        .rows = cli->replay_rows,
+        .num_rows = num_rows,
+    };
+    return emit_sample(cli, out, &snap);
 }
 
-void get_hostname(char* procfs_loc, char* hostname)
-{
-    char fp[255];
-    strcpy(fp, procfs_loc);
-    strcat(fp, "/sys/kernel/hostname");
-    
-    char *buf = calloc(BUF_SZ, sizeof(char));
-    ssize_t read_sz;
-    int fd = open(fp, O_RDONLY);
-    int file_size = 0;
-    while((read_sz = read(fd, buf, BUF_SZ)) >0) {
+/**
+ * Replays a recording: a summary of the samples in 'range' ("from,to") if
+ * given, otherwise the sample at 'at' (or the newest sample).
+ */
+int run_replay(struct cli *cli, struct recorder *rec, FILE *out,
+    const char *at, const char *range) {
 
-        int i;
-        for(i = 0; i < read_sz; ++i) {
-            if(buf[i] == EOF) {
-                file_size+=i;
-                strncat(hostname, buf, i);
-            }
+    uint64_t head = __atomic_load_n(&rec->header->head, __ATOMIC_ACQUIRE);
+    if (head == rec->header->tail) {
+        fprintf(stderr, "%s has no samples.\n", rec->path);
+        return -1;
+    }
+    uint64_t latest_ns = rec->index[(head - 1) % rec->header->index_cap].time_ns;
+
+    if (range != NULL) {
+        if (cli->format == FORMAT_BINARY) {
+            fprintf(stderr, "Ranges can only be printed as text or jsonl.\n");
+            return -1;
         }
-        strncat(hostname, buf, read_sz);
-        file_size+=read_sz;
+
+        char from_arg[TIME_STR_SZ];
+        const char *comma = strchr(range, ',');
+        size_t from_len = comma == NULL ? strlen(range) : (size_t) (comma - range);
+        if (from_len == 0 || from_len >= sizeof(from_arg)) {
+            fprintf(stderr, "Invalid range `%s'.\n", range);
+            return -1;
+        }
+        memcpy(from_arg, range, from_len);
+        from_arg[from_len] = '\0';
+
+        //an open-ended range runs up to the newest sample
+        uint64_t from_ns;
+        uint64_t to_ns = latest_ns;
+        if (parse_replay_time(from_arg, latest_ns, &from_ns) == -1
+            || (comma != NULL && comma[1] != '\0'
+                && parse_replay_time(comma + 1, latest_ns, &to_ns) == -1)) {
+            fprintf(stderr, "Invalid range `%s'.\n", range);
+            return -1;
+        }
+        return replay_range(cli, rec, out, from_ns, to_ns);
     }
 
-    hostname[file_size-1] = '\0';
-    close(fd);
-    free(buf);
+    uint64_t time_ns = latest_ns;
+    if (at != NULL && parse_replay_time(at, latest_ns, &time_ns) == -1) {
+        fprintf(stderr, "Invalid time `%s'.\n", at);
+        return -1;
+    }
+    return replay_at(cli, rec, out, time_ns);
 }
 
+/**
+ * Parses a --user argument, a user name or a numeric uid.
+ */
+int parse_user(const char *arg, uid_t *uid) {
+
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (*arg != '\0' && *end == '\0' && errno == 0 && value < NO_UID) {
+        *uid = value;
+        return 0;
+    }
 
-char *next_token(char **str_ptr, const char *delim)
-{
-    if (*str_ptr == NULL) {
-        return NULL;
+    struct passwd *pw = getpwnam(arg);
+    if (pw == NULL) {
+        return -1;
     }
+    *uid = pw->pw_uid;
+    return 0;
+}
 
-    size_t tok_start = strspn(*str_ptr, delim);
-    size_t tok_end = strcspn(*str_ptr + tok_start, delim);
+/**
+ * Parses a --pid-range argument: "min-max", "min-" or "-max".
+ */
+int parse_pid_range(const char *arg, pid_t *pid_min, pid_t *pid_max) {
 
-    /* Zero length token. We must be finished. */
-    if (tok_end  <= 0) {
-        *str_ptr = NULL;
-        return NULL;
+    const char *dash = strchr(arg, '-');
+    if (dash == NULL) {
+        return -1;
     }
 
-    /* Take note of the start of the current token. We'll return it later. */
-    char *current_ptr = *str_ptr + tok_start;
+    char *end;
+    long min = 0;
+    long max = 0;
+    if (dash != arg) {
+        min = strtol(arg, &end, 10);
+        if (end != dash || min < 0 || min > INT_MAX) {
+            return -1;
+        }
+    }
+    if (dash[1] != '\0') {
+        max = strtol(dash + 1, &end, 10);
+        if (*end != '\0' || max <= 0 || max > INT_MAX || max < min) {
+            return -1;
+        }
+    }
+    *pid_min = min;
+    *pid_max = max;
+    return 0;
+}
 
-    /* Shift pointer forward (to the end of the current token) */
-    *str_ptr += tok_start + tok_end;
+/**
+ * Parses a numeric option argument that must be a whole decimal number in
+ * [min, max]. Empty arguments, leading spaces, trailing junk and values out
+ * of range are all rejected with -1.
+ */
+int parse_long(const char *arg, long min, long max, long *value) {
 
-    if (**str_ptr == '\0') {
-        /* If the end of the current token is also the end of the string, we
-         * must be at the last token. */
-        *str_ptr = NULL;
-    } else {
-        /* Replace the matching delimiter with a NUL character to terminate the
-         * token string. */
-        **str_ptr = '\0';
+    if (arg[0] == '\0' || isspace((unsigned char) arg[0])) {
+        return -1;
+    }
+
+    char *end;
+    errno = 0;
+    long parsed = strtol(arg, &end, 10);
+    if (*end != '\0' || errno == ERANGE || parsed < min || parsed > max) {
+        return -1;
+    }
+    *value = parsed;
+    return 0;
+}
 
-        /* Shift forward one character over the newly-placed NUL so that
-         * next_pointer now points at the first character of the next token. */
-        (*str_ptr)++;
+/**
+ * Like parse_long(), for arguments that may have a fraction. NaN and
+ * infinity are never in range.
+ */
+int parse_double(const char *arg, double min, double max, double *value) {
+
+    if (arg[0] == '\0' || isspace((unsigned char) arg[0])) {
+        return -1;
     }
 
-    return current_ptr;
+    char *end;
+    errno = 0;
+    double parsed = strtod(arg, &end);
+    if (*end != '\0' || errno == ERANGE || !isfinite(parsed)
+        || parsed < min || parsed > max) {
+        return -1;
+    }
+    *value = parsed;
+    return 0;
 }
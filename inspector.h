@@ -0,0 +1,318 @@
+/**
+ * inspector.h
+ *
+ * The collector library behind the inspector command (libinspector.a).
+ *
+ * A program that wants to sample the system in-process sets up a handle
+ * once with inspector_init(), calls inspector_collect() as often as it
+ * likes, and releases everything with inspector_free(). The handle keeps
+ * every buffer, open file and table between collections, so once the task
+ * count has settled a collection allocates nothing. The snapshot a
+ * collection fills in points into the handle and stays valid until the next
+ * collection; all of its values are numbers, except for the names that are
+ * text to begin with (hostname, kernel version, cpu model, task names).
+ */
+
+#ifndef INSPECTOR_H
+#define INSPECTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define BUF_SZ 128
+
+/* Sizes of the fixed strings filled in by the collectors */
+#define NUM_SZ 24
+#define HOSTNAME_SZ 65
+#define STATE_SZ 15
+#define TASK_NAME_SZ 26
+
+/* Default CPU usage sampling window */
+#define CPU_WINDOW_MS 1000
+
+/* Upper bound on the number of task list worker threads (-j) */
+#define MAX_WORKERS 256
+
+/* Stands in for the uid of a task whose status file had no Uid line */
+#define NO_UID ((uid_t) -1)
+
+/* Shared memory snapshots (inspector_shm_*): the default segment name, the
+ * magic and layout version at its start, and how many times a reader tries
+ * for a consistent copy before giving up on a publisher stuck mid-write */
+#define SHM_NAME "/inspector"
+#define SHM_MAGIC "INSPSHM"
+#define SHM_VERSION 1
+#define SHM_READ_TRIES 1000
+
+/* The sections a handle collects, each one enabled or not */
+struct inspector_sections {
+    bool hardware;
+    bool system;
+    bool task_list;
+    bool task_summary;
+    bool per_cpu;
+};
+
+/* Task list filters. The pid range and the owner are checked while the
+ * procfs root is scanned, so tasks outside them are never opened; the
+ * state letters and the name prefix once the status file is parsed. The
+ * owner is the task's effective uid, while a task row's 'uid' is its real
+ * uid, so the two disagree for setuid tasks. A field left at its default
+ * (NO_UID, 0, empty, NULL) matches any task. */
+struct task_filter {
+    uid_t uid;
+    pid_t pid_min;
+    pid_t pid_max;
+    char states[STATE_SZ];
+    const char *name;
+    size_t name_len;
+};
+
+/* Task list columns (-o), in their default order */
+enum task_column {
+    TASK_COL_PID,
+    TASK_COL_TID,
+    TASK_COL_STATE,
+    TASK_COL_NAME,
+    TASK_COL_USER,
+    TASK_COL_THREADS,
+    TASK_COL_CPU,
+    TASK_COL_RSS,
+    TASK_COL_VSZ,
+    TASK_COL_SWAP,
+    NUM_TASK_COLS
+};
+
+#define COL_BIT(col) (1u << (col))
+#define TASK_COLS_BASE (COL_BIT(TASK_COL_PID) | COL_BIT(TASK_COL_STATE) \
+    | COL_BIT(TASK_COL_NAME) | COL_BIT(TASK_COL_USER) \
+    | COL_BIT(TASK_COL_THREADS))
+#define TASK_COLS_MEM (COL_BIT(TASK_COL_RSS) | COL_BIT(TASK_COL_VSZ) \
+    | COL_BIT(TASK_COL_SWAP))
+
+/* Task list orders (--sort). Everything but pid puts the biggest first. */
+enum task_sort {
+    SORT_NONE,
+    SORT_CPU,
+    SORT_MEM,
+    SORT_PID,
+    SORT_THREADS,
+};
+
+/* One row of the task list, as parsed from /proc/<pid>/status (and
+ * /proc/<pid>/stat for the cpu time, /proc/<pid>/statm for the memory
+ * sizes). 'cpu_usage' is -1 until measured; sizes are in kB. 'state_code'
+ * is the one-letter state ('R', 'S', 'D', ...; see task_state_name()), and
+ * a row the filters rejected after parsing has its pid set to 0. In a
+ * thread listing (-L) each row is one thread, 'tid', of process 'pid';
+ * otherwise 'tid' is 0. Only the columns that were asked for are filled in;
+ * the others are left at 0 (or NO_UID, or an empty name). */
+struct task_row {
+    pid_t pid;
+    pid_t tid;
+    char state_code;
+    char task_name[TASK_NAME_SZ];
+    uid_t uid;
+    unsigned int threads;
+    uint64_t cpu_ticks;
+    uint64_t start_time;
+    float cpu_usage;
+    uint64_t rss_kb;
+    uint64_t vsz_kb;
+    uint64_t swap_kb;
+};
+
+/* How a task changed since the previous collection (--diff). A task whose
+ * pid was reused in between is reported as exited, then as added. */
+enum task_change {
+    TASK_ADDED = 1,
+    TASK_EXITED,
+    TASK_CHANGED,
+};
+
+/* One task that was added, exited or changed its state, name, user or
+ * thread count. An exited task's row is the one it had when last seen. */
+struct task_diff {
+    enum task_change change;
+    struct task_row row;
+};
+
+/* The values shown in the System Information section */
+struct system_info {
+    char hostname[HOSTNAME_SZ];
+    char version[BUF_SZ];
+    uint64_t uptime;
+};
+
+/* The values shown in the Hardware Information section. The memory sizes
+ * are in kB and 'cpu_usage' is a fraction of all the cpus, from 0 to 1. */
+struct hardware_info {
+    char cpu_model[BUF_SZ];
+    int proc_units;
+    float load_avg[3];
+    uint64_t mem_total;
+    uint64_t mem_used;
+    float cpu_usage;
+};
+
+/* The memory figures read from the meminfo file, in kB */
+struct meminfo {
+    uint64_t total;
+    uint64_t free;
+    uint64_t available;
+    uint64_t buffers;
+    uint64_t cached;
+    uint64_t active;
+    uint64_t swap_total;
+    uint64_t swap_free;
+};
+
+/* The loadavg file: "0.18 0.06 0.02 1/123 4567" */
+struct loadavg {
+    float avg[3];
+    uint32_t running;
+    uint32_t total;
+    uint32_t last_pid;
+};
+
+/* The values shown in the Task Information section */
+struct task_summary {
+    int task_running;
+    uint64_t interrupts;
+    uint64_t c_switch;
+    uint64_t forks;
+};
+
+/* The per-state columns of a cpu line in the stat file */
+enum cpu_state {
+    CPU_USER,
+    CPU_NICE,
+    CPU_SYSTEM,
+    CPU_IDLE,
+    CPU_IOWAIT,
+    CPU_IRQ,
+    CPU_SOFTIRQ,
+    CPU_STEAL,
+    CPU_GUEST,
+    CPU_GUEST_NICE,
+    NUM_CPU_STATES
+};
+
+/* The aggregate cpu line (in jiffies) and the counters of the stat file */
+struct stat_counters {
+    uint64_t cpu[NUM_CPU_STATES];
+    uint64_t intr;
+    uint64_t ctxt;
+    uint64_t btime;
+    uint64_t processes;
+    uint64_t procs_running;
+    uint64_t procs_blocked;
+};
+
+/* Utilisation of each cpu over one sampling window, in percent, as one
+ * array per column. 'scale' is scratch space for the kernel. */
+struct cpu_breakdown {
+    float *busy;
+    float *user;
+    float *system;
+    float *iowait;
+    float *steal;
+    float *scale;
+    unsigned int *ids;
+    size_t count;
+    size_t cap;
+};
+
+/* What inspector_init() sets a handle up to collect. 'procfs' defaults to
+ * /proc; 'hold_files' keeps the fixed procfs files open between
+ * collections, which pays off when collecting repeatedly. 'task_columns'
+ * is a mask of COL_BITs: the task list columns to fill in, on top of
+ * whatever the filters and the sort order need. With 'raw' set, the stat
+ * counters, meminfo and loadavg are collected as they are, for recordings;
+ * the cpu usage window is only waited for if a section asks for usage.
+ * 'uring' reads the task status files through io_uring, in batches, where
+ * the kernel allows it. With 'diff' set, each collection also lists how the
+ * tasks changed since the one before; tasks seen before then have their
+ * status file read only for the columns it alone has (the user is taken
+ * from the previous collection). */
+struct inspector_config {
+    const char *procfs;
+    struct inspector_sections sections;
+    bool raw;
+    bool hold_files;
+    int num_workers;
+    bool uring;
+    long cpu_window_ms;
+    const char *cpu_state;
+    bool list_threads;
+    unsigned int task_columns;
+    enum task_sort sort;
+    size_t top_n;
+    size_t max_rows;
+    struct task_filter filter;
+    bool diff;
+};
+
+/* One collection. Sections that weren't asked for are NULL (and the task
+ * list empty); everything points into the handle and is overwritten by the
+ * next collection. 'diffs' is only set when the handle was set up with
+ * 'diff'; the first collection lists every task as added. */
+struct inspector_snapshot {
+    struct timespec time;
+    struct system_info *system;
+    struct hardware_info *hardware;
+    struct cpu_breakdown *breakdown;
+    struct task_summary *summary;
+    struct task_row *rows;
+    size_t num_rows;
+    struct task_diff *diffs;
+    size_t num_diffs;
+    const struct stat_counters *stat;
+    const struct meminfo *mem;
+    const struct loadavg *load;
+};
+
+/* The sections of one collection that are published in shared memory,
+ * each flagged with whether it was collected */
+struct inspector_published {
+    uint64_t time_ns;
+    bool has_system;
+    bool has_hardware;
+    bool has_summary;
+    struct system_info system;
+    struct hardware_info hardware;
+    struct task_summary summary;
+};
+
+/* A shared memory segment holding the latest published collection. 'seq'
+ * is a seqlock: the publisher makes it odd before changing 'data' and even
+ * again afterwards, so a reader that sees the same even value before and
+ * after copying 'data' has a consistent copy, without a syscall or a lock.
+ * 'seq' is 0 until the first collection is published. */
+struct inspector_shm {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint64_t seq;
+    struct inspector_published data;
+};
+
+/* A collector set up by inspector_init(); its fields are private */
+struct inspector;
+
+struct inspector *inspector_init(const struct inspector_config *config);
+int inspector_collect(struct inspector *insp, struct inspector_snapshot *snap);
+void inspector_limit_rows(struct inspector *insp, size_t max_rows);
+void inspector_describe(struct inspector *insp, struct system_info *sys_info, struct hardware_info *hw_info);
+const char *inspector_username(struct inspector *insp, uid_t uid);
+void inspector_free(struct inspector *insp);
+struct inspector_shm *inspector_shm_create(const char *name);
+struct inspector_shm *inspector_shm_attach(const char *name);
+void inspector_shm_publish(struct inspector_shm *shm, const struct inspector_snapshot *snap);
+int inspector_shm_read(const struct inspector_shm *shm, struct inspector_published *pub);
+void inspector_shm_detach(struct inspector_shm *shm);
+const char *task_state_name(char code);
+
+#endif
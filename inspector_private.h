@@ -0,0 +1,95 @@
+/**
+ * inspector_private.h
+ *
+ * What the inspector command and libinspector share besides the public API
+ * in inspector.h: logging, the --self-stats probes and their totals, and a
+ * few helpers the command's replays use. Programs using libinspector don't
+ * include this.
+ */
+
+#ifndef INSPECTOR_PRIVATE_H
+#define INSPECTOR_PRIVATE_H
+
+#include <stdio.h>
+
+#include "inspector.h"
+
+/* Preprocessor Directives */
+#ifndef DEBUG
+#define DEBUG 1
+#endif
+
+#ifndef SELF_STATS
+#define SELF_STATS 1
+#endif
+
+/**
+ * Logging functionality. Set DEBUG to 1 to enable logging, 0 to disable.
+ */
+#define LOG(fmt, ...) \
+do { if (DEBUG) fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, \
+    __LINE__, __func__, __VA_ARGS__); } while (0)
+
+/**
+ * Self-instrumentation probes for --self-stats. Set SELF_STATS to 0 to
+ * compile every probe out, the same way LOG disappears without DEBUG.
+ */
+#define SELF_BEGIN(timer, section) \
+do { if (SELF_STATS) self_begin(timer, section); } while (0)
+
+#define SELF_END(timer) \
+do { if (SELF_STATS) self_end(timer); } while (0)
+
+#define SELF_COUNT(field, n) \
+do { if (SELF_STATS && self_current != NULL) \
+    self_current->field += (n); } while (0)
+
+/* The parts of the program measured by --self-stats */
+enum self_section {
+    SELF_STAT,
+    SELF_HOSTNAME,
+    SELF_KERNEL_VERSION,
+    SELF_UPTIME,
+    SELF_CPU_MODEL,
+    SELF_LOAD_AVG,
+    SELF_MEMINFO,
+    SELF_PID_SCAN,
+    SELF_TASK_LIST,
+    SELF_USERNAMES,
+    SELF_CPU_WINDOW,
+    SELF_OUTPUT,
+    NUM_SELF_SECTIONS
+};
+
+/* What one section has cost so far. 'wall_ns' excludes time spent in the
+ * sections nested inside it, so the sections add up to the total. */
+struct self_counts {
+    uint64_t wall_ns;
+    uint64_t calls;
+    uint64_t opens;
+    uint64_t reads;
+    uint64_t bytes;
+    uint64_t allocs;
+};
+
+/* One timed run of a section. 'counts' is NULL when --self-stats is off. */
+struct self_timer {
+    struct self_counts *counts;
+    struct self_counts *outer;
+    struct timespec start;
+};
+
+/* --self-stats totals, and the section the calling thread is charging its
+ * opens, reads and allocations to (NULL: none) */
+extern bool self_stats_on;
+extern struct self_counts self_stats[NUM_SELF_SECTIONS];
+extern __thread struct self_counts *self_current;
+
+char task_state_code(const char *name);
+float cpu_usage_from_times(const uint64_t first[NUM_CPU_STATES], const uint64_t second[NUM_CPU_STATES]);
+void self_begin(struct self_timer *timer, enum self_section section);
+void self_end(struct self_timer *timer);
+void self_counts_add(struct self_counts *dst, const struct self_counts *src);
+void print_self_stats(FILE *out);
+
+#endif
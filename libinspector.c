@@ -0,0 +1,3760 @@
+/**
+ * libinspector.c
+ *
+ * The collectors: everything that reads procfs and turns it into the
+ * snapshot structs of inspector.h. The inspector command is built on top.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <math.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "inspector_private.h"
+
+/* Initial number of slots in the UID-to-username cache (a power of two) */
+#define UID_CACHE_INIT 64
+
+/* The minimum number of jiffies a persisted sample must be behind the
+ * current one to be used instead of a sampling window */
+#define MIN_STATE_JIFFIES 10
+
+/* Size of the buffer handed to getdents64 when scanning for PIDs, and the
+ * longest directory name that is still parsed as one */
+#define DENTS_BUF_SZ (128 * 1024)
+#define MAX_PID_DIGITS 9
+
+/* Initial number of cpus the per-cpu tables have room for */
+#define CPU_TABLE_INIT 16
+
+/* Initial size of a proc_buf, and the bytes kept free (and zeroed) past the
+ * data so numbers can be parsed with 8-byte loads */
+#define PROC_BUF_INIT 4096
+#define PROC_BUF_SLACK 16
+
+/* Every byte of a word set to one, for the SWAR digit routines */
+#define SWAR_ONES 0x0101010101010101ULL
+
+/* Initial number of slots in the per-task cpu time table (a power of two) */
+#define TASK_CPU_INIT 1024
+
+/* Initial number of slots in the --diff task state table (a power of two),
+ * and of entries in the list of changes */
+#define TASK_STATE_INIT 1024
+#define TASK_DIFF_INIT 256
+
+/* Tasks whose status files go into one io_uring submission (--uring), and
+ * the room each gets in the ring's buffer arena and for its path. Status
+ * files are around 1.5 kB; one that fills its slot is read again the usual
+ * way. */
+#define RING_BATCH 64
+#define RING_SLOT_SZ 4096
+#define RING_PATH_SZ (3 * NUM_SZ + 8)
+
+/* A reusable, growable buffer holding the complete contents of one procfs
+ * file. The data is always NUL-terminated so views into it can safely be
+ * passed to the C string functions. */
+struct proc_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/* A non-owning (pointer, length) view into a proc_buf, used to walk lines
+ * and fields without copying them. */
+struct str_view {
+    const char *ptr;
+    size_t len;
+};
+
+/* The fixed-path procfs files read by the collectors */
+enum procfs_file {
+    PROCFS_STAT,
+    PROCFS_MEMINFO,
+    PROCFS_LOADAVG,
+    PROCFS_UPTIME,
+    PROCFS_VERSION,
+    PROCFS_HOSTNAME,
+    PROCFS_CPUINFO,
+    NUM_PROCFS_FILES
+};
+
+/* A procfs mount point, accessed through a descriptor for its root. When
+ * 'hold_files' is set (watch mode), the fixed-path files stay open after
+ * their first read and are re-read from offset 0 on every refresh instead
+ * of being reopened. */
+struct procfs {
+    const char *loc;
+    int dir_fd;
+    bool hold_files;
+    int held_fds[NUM_PROCFS_FILES];
+};
+
+/* The PIDs found by one scan of the procfs root, in directory order. Both
+ * the array and the getdents64 buffer are reused from scan to scan. 'total'
+ * counts every task seen, including the ones the filters left out. */
+struct pid_list {
+    pid_t *pids;
+    size_t count;
+    size_t cap;
+    size_t total;
+    char *dents;
+};
+
+/* A thread found under /proc/<pid>/task */
+struct thread_id {
+    pid_t pid;
+    pid_t tid;
+};
+
+/* The threads found by one -L scan worker, in directory order. Both the
+ * array and the getdents64 buffer are kept from refresh to refresh, so a
+ * steady thread count costs no allocation. */
+struct thread_list {
+    struct thread_id *ids;
+    size_t count;
+    size_t cap;
+    char *dents;
+};
+
+/* Record layout returned by the getdents64 system call */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* The per-task files a task list row can be built from, cheapest to read
+ * and parse first */
+enum task_file {
+    TASK_FILE_COMM = 1 << 0,
+    TASK_FILE_STAT = 1 << 1,
+    TASK_FILE_STATM = 1 << 2,
+    TASK_FILE_STATUS = 1 << 3,
+};
+
+#define NUM_TASK_FILES 4
+
+/* One slot of the task cpu table. 'start_time' tells a reused pid apart
+ * from the task that had it at the previous sample. */
+struct task_cpu_entry {
+    pid_t pid;
+    uint64_t start_time;
+    uint64_t cpu_ticks;
+};
+
+/* Open-addressing (linear probing) hash table of the utime + stime of every
+ * task at the previous sample, keyed by pid. Rebuilt after each sample, so
+ * exited tasks drop out. pid 0 marks a free slot. 'taken_ticks' is when the
+ * previous sample was read in clock ticks since boot, the unit of the
+ * tasks' start times. */
+struct task_cpu_table {
+    struct task_cpu_entry *slots;
+    size_t cap;
+    size_t count;
+    struct timespec taken;
+    uint64_t taken_ticks;
+    bool primed;
+    long ticks_per_sec;
+};
+
+/* One slot of the task state table: the row a task had at the previous
+ * collection, whose start time tells a reused pid apart from the task that
+ * had it, and whether the task has been seen again since. */
+struct task_state_entry {
+    pid_t id;
+    bool seen;
+    struct task_row row;
+};
+
+/* Open-addressing (linear probing) hash table of every task's row at the
+ * previous collection, keyed by pid (tid in a thread listing), for --diff.
+ * Rebuilt after each collection like the task cpu table. id 0 marks a free
+ * slot. */
+struct task_state_table {
+    struct task_state_entry *slots;
+    size_t cap;
+    size_t count;
+};
+
+/* An io_uring instance, set up with the raw syscalls, that reads the status
+ * files of a batch of tasks (--uring). Each task gets a chain of three
+ * linked requests: open its status file into fixed file slot i, read that
+ * into slot i of 'arena', and close the fixed file. The whole batch then
+ * costs one io_uring_enter() instead of an open, a read and a close per
+ * task. 'results' holds the length read into each slot, or -1. */
+struct task_ring {
+    int fd;
+    void *sq_map;
+    size_t sq_map_sz;
+    void *cq_map;
+    size_t cq_map_sz;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    char *arena;
+    char (*paths)[RING_PATH_SZ];
+    ssize_t results[RING_BATCH];
+};
+
+/* The slice of the task list handled by one worker thread. Each worker owns
+ * its read buffer and only writes to its own rows, so no locking is needed
+ * and the rows can be printed in directory order once all workers finish.
+ * With 'uring' set, the worker sets up its own ring the first time it reads
+ * status files, and sticks to plain reads if it can't. With --diff,
+ * 'states' is the table of the previous collection (only read while the
+ * workers run), and 'status_static' is set when the status file has
+ * nothing the columns need that could have changed for a known task.
+ * 'page_kb' is the page size, looked up once for the statm sizes. */
+struct task_worker {
+    pthread_t thread;
+    struct procfs *fs;
+    struct task_row *rows;
+    size_t num_rows;
+    unsigned int files;
+    const struct task_filter *filter;
+    struct proc_buf pb;
+    struct self_counts self;
+    bool uring;
+    bool ring_failed;
+    struct task_ring *ring;
+    struct task_state_table *states;
+    bool status_static;
+    uint64_t page_kb;
+};
+
+/* The slice of the processes one -L scan worker expands into threads.
+ * 'result' is -1 if it ran out of memory. */
+struct thread_scan {
+    pthread_t thread;
+    struct procfs *fs;
+    const pid_t *pids;
+    size_t num_pids;
+    struct thread_list *list;
+    int result;
+    struct self_counts self;
+};
+
+/* One slot of the UID cache. 'name' is NULL for UIDs that have no passwd
+ * entry, so failed lookups are cached too. */
+struct uid_entry {
+    uid_t uid;
+    bool used;
+    char *name;
+};
+
+/* Open-addressing (linear probing) hash table mapping UIDs to usernames.
+ * Each distinct UID is resolved through NSS once; every later lookup is a
+ * probe into 'slots'. The cache lives as long as the program, so repeated
+ * samples never hit NSS again for users they have already seen. */
+struct uid_cache {
+    struct uid_entry *slots;
+    size_t cap;
+    size_t count;
+    char *pw_buf;
+    size_t pw_buf_sz;
+};
+
+/* Jiffies spent in each state, from one cpu line of the stat file */
+struct cpu_times {
+    uint64_t jiffies[NUM_CPU_STATES];
+};
+
+/* Jiffies of every cpu, stored as one array per state (structure of
+ * arrays) so the delta kernel walks each state contiguously across all the
+ * cpus. 'ids' holds the N of each cpuN line, since offline cpus leave gaps. */
+struct cpu_table {
+    uint64_t *jiffies[NUM_CPU_STATES];
+    unsigned int *ids;
+    size_t count;
+    size_t cap;
+};
+
+/* Everything the inspector uses from the stat file, filled in by a single
+ * pass over it. Every section reads from this instead of loading the file
+ * itself, so the file is read once per sample whatever the options. The
+ * per-cpu table is reused from one snapshot to the next. */
+struct stat_snapshot {
+    struct cpu_times total;
+    struct cpu_table cpus;
+    uint64_t intr;
+    uint64_t ctxt;
+    uint64_t btime;
+    uint64_t processes;
+    uint64_t procs_running;
+    uint64_t procs_blocked;
+    struct timespec taken;
+};
+
+/* Idle and total jiffies from the aggregate cpu line of the stat file. The
+ * boot time identifies which boot a persisted sample belongs to. */
+struct cpu_sample {
+    long idle;
+    long total;
+    long btime;
+};
+
+/* Measures CPU usage over a window that starts when the program does, so
+ * the other collectors run while the window is open instead of after a
+ * fixed sleep. With a state file, the previous run's final sample is used
+ * as the starting point and no waiting is needed at all. */
+struct cpu_sampler {
+    struct cpu_sample start;
+    struct timespec start_time;
+    long window_ms;
+    const char *state_path;
+    bool primed;
+    bool per_cpu;
+    struct cpu_table start_cpus;
+    struct cpu_breakdown breakdown;
+};
+
+/* Everything a handle keeps between collections: the procfs (and the files
+ * held open in it), the read buffers of the task list workers, the username
+ * cache, the last cpu sample and the cpu model, which never changes. The
+ * sections of the latest collection live here too, for the snapshot to
+ * point to. */
+struct inspector {
+    struct inspector_sections options;
+    bool raw;
+    int num_workers;
+    struct procfs fs;
+    struct proc_buf pb;
+    struct uid_cache users;
+    struct cpu_sampler sampler;
+    struct stat_snapshot stat;
+
+    struct system_info sys_info;
+    struct hardware_info hw_info;
+    bool have_cpu_model;
+    struct task_summary summary;
+    struct stat_counters counters;
+    struct meminfo mem;
+    struct loadavg load;
+
+    /* One task list worker per -j thread; the first runs on the calling
+     * thread with 'pb', the others keep their own read buffers (and their
+     * own rings, with --uring) */
+    struct task_worker *workers;
+
+    /* PIDs from the latest scan, and the task list rows built from them */
+    struct pid_list pids;
+
+    /* List every thread instead of every process (-L); the threads are
+     * found through one list per worker */
+    bool list_threads;
+    struct thread_list *thread_lists;
+    int num_thread_lists;
+
+    struct task_row *rows;
+    size_t rows_cap;
+
+    /* Collect the status of at most this many tasks (0: no limit) */
+    size_t max_rows;
+
+    /* Which tasks the task list is limited to */
+    struct task_filter filter;
+
+    /* Task list columns to fill in, as a mask of COL_BITs, and the cpu
+     * times the cpu column is measured from */
+    unsigned int task_columns;
+    struct task_cpu_table task_cpu;
+
+    /* With --diff, the rows of the previous collection and the changes
+     * found since */
+    bool diff;
+    struct task_state_table task_states;
+    struct task_diff *diffs;
+    size_t diffs_cap;
+
+    /* Task list order, and how many of its first tasks to keep (0: all).
+     * Unless the order is SORT_NONE, the rows are put in order through
+     * 'sort_keys' and copied to 'sorted_rows'. */
+    enum task_sort sort;
+    size_t top_n;
+    uint64_t *sort_keys;
+    struct task_row *sorted_rows;
+    size_t sorted_cap;
+};
+
+/* --self-stats totals, and the section the calling thread is charging its
+ * opens, reads and allocations to (NULL: none) */
+bool self_stats_on = false;
+struct self_counts self_stats[NUM_SELF_SECTIONS];
+__thread struct self_counts *self_current = NULL;
+
+
+/* Function prototypes */
+ssize_t proc_buf_load_at(struct proc_buf *pb, int dir_fd, const char *name);
+ssize_t proc_buf_read(struct proc_buf *pb, int fd);
+int procfs_open(struct procfs *fs, const char *loc, bool hold_files);
+int procfs_open_task(struct procfs *fs, pid_t pid, pid_t tid);
+void procfs_close(struct procfs *fs);
+ssize_t procfs_load(struct procfs *fs, struct proc_buf *pb, enum procfs_file file);
+ssize_t build_task_rows(struct inspector *insp, unsigned int files);
+int proc_buf_grow(struct proc_buf *pb);
+void proc_buf_free(struct proc_buf *pb);
+struct str_view proc_buf_view(const struct proc_buf *pb);
+struct str_view view_first_line(const struct proc_buf *pb);
+bool view_next_line(struct str_view *rest, struct str_view *line);
+bool view_next_field(struct str_view *rest, struct str_view *field);
+struct str_view view_field(struct str_view line, int n);
+bool view_has_prefix(struct str_view view, const char *prefix);
+bool view_find_line(struct str_view text, const char *prefix, struct str_view *line);
+size_t view_copy(struct str_view view, char *dst, size_t dst_sz);
+int swar_digit_count(uint64_t chunk);
+uint64_t swar_parse_digits(uint64_t chunk, int n);
+uint64_t view_parse_u64(struct str_view *rest);
+uint64_t view_field_u64(struct str_view line, int n);
+int read_stat_snapshot(struct procfs *fs, struct proc_buf *pb, struct stat_snapshot *snap);
+void parse_cpu_times(struct str_view rest, struct cpu_times *times);
+void stat_snapshot_free(struct stat_snapshot *snap);
+int cpu_table_reserve(struct cpu_table *table, size_t count);
+int cpu_table_copy(struct cpu_table *dst, const struct cpu_table *src);
+void cpu_table_free(struct cpu_table *table);
+int cpu_breakdown_reserve(struct cpu_breakdown *breakdown, size_t count);
+void cpu_breakdown_free(struct cpu_breakdown *breakdown);
+void cpu_breakdown_compute(const struct cpu_table *first, const struct cpu_table *second, struct cpu_breakdown *out);
+void cpu_sample_from(struct stat_snapshot *snap, struct cpu_sample *sample);
+void cpu_sample_from_times(const uint64_t jiffies[], uint64_t btime, struct cpu_sample *sample);
+float cpu_usage_between(struct cpu_sample *first, struct cpu_sample *second);
+long timespec_diff_ms(struct timespec *end, struct timespec *start);
+void cpu_sampler_start(struct cpu_sampler *sampler, struct stat_snapshot *snap);
+float cpu_sampler_finish(struct cpu_sampler *sampler, struct procfs *fs, struct proc_buf *pb, struct stat_snapshot *snap);
+int load_cpu_sample(struct proc_buf *pb, const char *path, struct cpu_sample *sample);
+int save_cpu_sample(const char *path, struct cpu_sample *sample);
+void get_hostname(struct procfs *fs, struct proc_buf *pb, char* hostname);
+void get_kernel_version(struct procfs *fs, struct proc_buf *pb, char* version);
+void get_uptime(struct procfs *fs, struct proc_buf *pb, uint64_t *uptime);
+void get_CPU_mode(struct procfs *fs, struct proc_buf *pb, char* CPU_mode);
+int get_loadavg(struct procfs *fs, struct proc_buf *pb, struct loadavg *load);
+size_t uid_hash(uid_t uid, size_t mask);
+void uid_cache_init(struct uid_cache *cache);
+void uid_cache_free(struct uid_cache *cache);
+const char *uid_cache_lookup(struct uid_cache *cache, uid_t uid);
+char *resolve_username(struct uid_cache *cache, uid_t uid);
+int uid_cache_grow(struct uid_cache *cache);
+ssize_t scan_pids(struct procfs *fs, struct pid_list *list, const struct task_filter *filter);
+int pid_list_append(struct pid_list *list, pid_t pid);
+pid_t parse_pid_name(const char *name);
+ssize_t expand_threads(struct inspector *insp);
+void *thread_scan_run(void *arg);
+void *thread_scan_thread(void *arg);
+int scan_threads(struct procfs *fs, pid_t pid, struct thread_list *list);
+int thread_list_append(struct thread_list *list, pid_t pid, pid_t tid);
+void thread_list_free(struct thread_list *list);
+void pid_list_free(struct pid_list *list);
+void *task_worker_run(void *arg);
+void collect_task_list(struct procfs *fs, struct proc_buf *pb, struct task_worker *workers, int num_workers, struct task_row *rows, size_t num_rows, unsigned int files, const struct task_filter *filter);
+void get_task_list(struct proc_buf *pb, int task_fd, char *state_code, char task_name[], uid_t *uid, unsigned int *threads, uint64_t *swap_kb);
+void parse_task_status(struct str_view text, char *state_code, char task_name[], uid_t *uid, unsigned int *threads, uint64_t *swap_kb);
+void read_task_row(struct task_worker *worker, struct task_row *row, const struct str_view *status);
+struct task_ring *task_ring_open(void);
+void task_ring_close(struct task_ring *ring);
+int task_ring_load(struct task_ring *ring, struct procfs *fs, const struct task_row *rows, size_t count, struct task_state_table *known);
+bool task_ring_status(struct task_ring *ring, size_t slot, struct str_view *text);
+bool task_filter_scans(const struct task_filter *filter);
+unsigned int task_filter_columns(const struct task_filter *filter);
+bool task_filter_match(const struct task_filter *filter, const struct task_row *row);
+size_t filter_task_rows(struct task_row *rows, size_t num_rows);
+void get_task_stat(struct proc_buf *pb, int task_fd, uint64_t *cpu_ticks, uint64_t *start_time, char *state_code, char task_name[], unsigned int *threads);
+void get_task_comm(struct proc_buf *pb, int task_fd, char task_name[]);
+size_t pid_hash(pid_t pid, size_t mask);
+struct task_cpu_entry *task_cpu_find(struct task_cpu_table *table, pid_t pid);
+int task_cpu_update(struct task_cpu_table *table, struct task_row *rows, size_t num_rows, struct timespec *taken, struct timespec *taken_boot);
+void task_cpu_free(struct task_cpu_table *table);
+struct task_state_entry *task_state_find(struct task_state_table *table, pid_t id);
+bool task_row_changed(const struct task_row *before, const struct task_row *after, unsigned int columns);
+ssize_t diff_task_rows(struct inspector *insp, size_t num_rows);
+void task_state_free(struct task_state_table *table);
+uint64_t task_sort_key(const struct task_row *row, enum task_sort sort, uint32_t index);
+int compare_u64(const void *a, const void *b);
+void key_heap_sift_down(uint64_t *heap, size_t count, size_t i);
+size_t sort_task_keys(struct task_row *rows, size_t num_rows, size_t n, enum task_sort sort, uint64_t *keys);
+ssize_t order_task_rows(struct inspector *insp, size_t num_rows);
+void get_task_statm(struct proc_buf *pb, int task_fd, uint64_t page_kb,
+    uint64_t *vsz_kb, uint64_t *rss_kb);
+unsigned int task_column_files(unsigned int columns);
+unsigned int task_read_columns(struct inspector *insp);
+int prime_task_cpu(struct inspector *insp);
+void wait_until_elapsed(struct timespec *since, long window_ms);
+void get_meminfo(struct procfs *fs, struct proc_buf *pb, struct meminfo *mem);
+void *task_worker_thread(void *arg);
+
+
+/**
+ * Sets up a collector as described by 'config': opens the procfs root and
+ * allocates the task list workers. Returns NULL if the procfs can't be
+ * opened or memory runs out.
+ */
+struct inspector *inspector_init(const struct inspector_config *config) {
+
+    struct inspector *insp = calloc(1, sizeof(struct inspector));
+    if (insp == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    insp->options = config->sections;
+    insp->raw = config->raw;
+    insp->num_workers = config->num_workers > 0 ? config->num_workers : 1;
+    if (insp->num_workers > MAX_WORKERS) {
+        insp->num_workers = MAX_WORKERS;
+    }
+    insp->list_threads = config->list_threads;
+    insp->task_columns = config->task_columns;
+    insp->sort = config->sort;
+    insp->top_n = config->top_n;
+    insp->max_rows = config->max_rows;
+    insp->filter = config->filter;
+    insp->diff = config->diff;
+    insp->sampler.window_ms = config->cpu_window_ms;
+    insp->sampler.state_path = config->cpu_state;
+    insp->sampler.per_cpu = config->sections.per_cpu;
+
+    //usernames are resolved once per distinct uid
+    uid_cache_init(&insp->users);
+
+    const char *procfs = config->procfs != NULL ? config->procfs : "/proc";
+    if (procfs_open(&insp->fs, procfs, config->hold_files) == -1) {
+        inspector_free(insp);
+        return NULL;
+    }
+
+    //workers (and their read buffers) last as long as the handle
+    insp->workers = calloc(insp->num_workers, sizeof(struct task_worker));
+    if (insp->workers == NULL) {
+        perror("calloc");
+        inspector_free(insp);
+        return NULL;
+    }
+    //a known task's status file is only worth reading for its swap size
+    bool status_static = !(task_read_columns(insp) & COL_BIT(TASK_COL_SWAP));
+    uint64_t page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    int i;
+    for (i = 0; i < insp->num_workers; i++) {
+        insp->workers[i].uring = config->uring;
+        insp->workers[i].page_kb = page_kb;
+        if (insp->diff) {
+            insp->workers[i].states = &insp->task_states;
+            insp->workers[i].status_static = status_static;
+        }
+    }
+
+    if (insp->diff) {
+        insp->diffs = malloc(TASK_DIFF_INIT * sizeof(struct task_diff));
+        if (insp->diffs == NULL) {
+            perror("malloc");
+            inspector_free(insp);
+            return NULL;
+        }
+        insp->diffs_cap = TASK_DIFF_INIT;
+    }
+    return insp;
+}
+
+/**
+ * Collects every section the handle was set up for into 'snap'. The cpu
+ * usage window opens before anything else is read and is waited out last,
+ * so the other collectors run while it is open; later collections measure
+ * usage since the one before and don't wait at all. Returns 0, or -1 if
+ * the task list couldn't be built.
+ */
+int inspector_collect(struct inspector *insp, struct inspector_snapshot *snap) {
+
+    struct inspector_sections *options = &insp->options;
+    struct procfs *fs = &insp->fs;
+    struct proc_buf *pb = &insp->pb;
+    struct self_timer timer;
+
+    memset(snap, 0, sizeof(*snap));
+
+    //one pass over the stat file serves every section
+    struct stat_snapshot *stat = &insp->stat;
+    bool sample_cpu = options->hardware || options->per_cpu;
+    if (sample_cpu || options->task_summary || insp->raw) {
+        SELF_BEGIN(&timer, SELF_STAT);
+        read_stat_snapshot(fs, pb, stat);
+        SELF_END(&timer);
+    }
+
+    //start the cpu usage window first so it overlaps everything else
+    if (sample_cpu && insp->sampler.primed == false) {
+        cpu_sampler_start(&insp->sampler, stat);
+    }
+
+    //per-task cpu usage is measured over the same window, from a first
+    //reading of every task's cpu time (later collections use the previous one)
+    bool task_cpu = options->task_list
+        && (task_read_columns(insp) & COL_BIT(TASK_COL_CPU));
+    bool task_cpu_window = false;
+    if (task_cpu && insp->task_cpu.primed == false) {
+        SELF_BEGIN(&timer, SELF_TASK_LIST);
+        int primed = prime_task_cpu(insp);
+        SELF_END(&timer);
+        if (primed == -1) {
+            return -1;
+        }
+        task_cpu_window = true;
+    }
+
+    struct system_info *sys_info = &insp->sys_info;
+    if (options->system) {
+        SELF_BEGIN(&timer, SELF_HOSTNAME);
+        get_hostname(fs, pb, sys_info->hostname);
+        SELF_END(&timer);
+        SELF_BEGIN(&timer, SELF_KERNEL_VERSION);
+        get_kernel_version(fs, pb, sys_info->version);
+        SELF_END(&timer);
+        SELF_BEGIN(&timer, SELF_UPTIME);
+        get_uptime(fs, pb, &sys_info->uptime);
+        SELF_END(&timer);
+        snap->system = sys_info;
+    }
+
+    struct hardware_info *hw_info = &insp->hw_info;
+    if (options->hardware) {
+        //the cpu model can't change, so it's only read on the first pass
+        if (insp->have_cpu_model == false) {
+            SELF_BEGIN(&timer, SELF_CPU_MODEL);
+            get_CPU_mode(fs, pb, hw_info->cpu_model);
+            SELF_END(&timer);
+            insp->have_cpu_model = true;
+        }
+        hw_info->proc_units = stat->cpus.count;
+    }
+
+    //recordings keep the load average and meminfo as they are
+    if (options->hardware || insp->raw) {
+        SELF_BEGIN(&timer, SELF_LOAD_AVG);
+        if (get_loadavg(fs, pb, &insp->load) == -1) {
+            LOG("Couldn't parse %s/loadavg\n", fs->loc);
+        }
+        SELF_END(&timer);
+        SELF_BEGIN(&timer, SELF_MEMINFO);
+        get_meminfo(fs, pb, &insp->mem);
+        SELF_END(&timer);
+    }
+    if (options->hardware) {
+        memcpy(hw_info->load_avg, insp->load.avg, sizeof(hw_info->load_avg));
+        hw_info->mem_total = insp->mem.total;
+        hw_info->mem_used = insp->mem.active;
+    }
+
+    //one directory scan feeds both the task count and the task list
+    if (options->task_summary || options->task_list) {
+        SELF_BEGIN(&timer, SELF_PID_SCAN);
+        ssize_t scanned = scan_pids(fs, &insp->pids, &insp->filter);
+        SELF_END(&timer);
+        if (scanned == -1) {
+            return -1;
+        }
+    }
+
+    if (options->task_summary) {
+        insp->summary.task_running = insp->pids.total;
+        insp->summary.interrupts = stat->intr;
+        insp->summary.c_switch = stat->ctxt;
+        insp->summary.forks = stat->processes;
+        snap->summary = &insp->summary;
+    }
+
+    //read the status file of each task
+    if (options->task_list) {
+        if (task_cpu_window) {
+            SELF_BEGIN(&timer, SELF_CPU_WINDOW);
+            wait_until_elapsed(&insp->task_cpu.taken,
+                insp->sampler.window_ms);
+            SELF_END(&timer);
+        }
+
+        SELF_BEGIN(&timer, SELF_TASK_LIST);
+        bool ordered = insp->sort != SORT_NONE || insp->top_n > 0;
+        ssize_t built = build_task_rows(insp,
+            task_column_files(task_read_columns(insp)));
+        if (built != -1 && insp->diff) {
+            ssize_t changes = diff_task_rows(insp, built);
+            if (changes == -1) {
+                built = -1;
+            } else {
+                snap->diffs = insp->diffs;
+                snap->num_diffs = changes;
+            }
+        }
+        if (built != -1 && ordered) {
+            built = order_task_rows(insp, built);
+        }
+        SELF_END(&timer);
+        if (built == -1) {
+            return -1;
+        }
+        snap->num_rows = built;
+        snap->rows = ordered ? insp->sorted_rows : insp->rows;
+    }
+
+    //waits out whatever is left of the sampling window
+    if (sample_cpu) {
+        SELF_BEGIN(&timer, SELF_CPU_WINDOW);
+        hw_info->cpu_usage = cpu_sampler_finish(&insp->sampler, fs, pb, stat);
+        SELF_END(&timer);
+    }
+    if (options->hardware) {
+        snap->hardware = hw_info;
+    }
+    if (options->per_cpu) {
+        snap->breakdown = &insp->sampler.breakdown;
+    }
+
+    if (insp->raw) {
+        struct stat_counters *counters = &insp->counters;
+        memcpy(counters->cpu, stat->total.jiffies, sizeof(counters->cpu));
+        counters->intr = stat->intr;
+        counters->ctxt = stat->ctxt;
+        counters->btime = stat->btime;
+        counters->processes = stat->processes;
+        counters->procs_running = stat->procs_running;
+        counters->procs_blocked = stat->procs_blocked;
+        snap->stat = counters;
+        snap->mem = &insp->mem;
+        snap->load = &insp->load;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &snap->time);
+    return 0;
+}
+
+/**
+ * Caps the task list at 'max_rows' rows (0: no cap) from the next
+ * collection on. Without a sort order or filters, only that many status
+ * files are read.
+ */
+void inspector_limit_rows(struct inspector *insp, size_t max_rows) {
+    insp->max_rows = max_rows;
+}
+
+/**
+ * Fills in the values that never change between collections: the hostname
+ * and kernel version (the uptime is left at 0), the cpu model and the
+ * number of cpus.
+ */
+void inspector_describe(struct inspector *insp, struct system_info *sys_info,
+    struct hardware_info *hw_info) {
+
+    struct procfs *fs = &insp->fs;
+    struct proc_buf *pb = &insp->pb;
+
+    memset(sys_info, 0, sizeof(*sys_info));
+    get_hostname(fs, pb, sys_info->hostname);
+    get_kernel_version(fs, pb, sys_info->version);
+
+    memset(hw_info, 0, sizeof(*hw_info));
+    if (insp->have_cpu_model == false) {
+        get_CPU_mode(fs, pb, insp->hw_info.cpu_model);
+        insp->have_cpu_model = true;
+    }
+    memcpy(hw_info->cpu_model, insp->hw_info.cpu_model, BUF_SZ);
+    if (insp->stat.cpus.count == 0) {
+        read_stat_snapshot(fs, pb, &insp->stat);
+    }
+    hw_info->proc_units = insp->stat.cpus.count;
+}
+
+/**
+ * The username of 'uid', or NULL if it has none. Each uid is looked up
+ * once per handle.
+ */
+const char *inspector_username(struct inspector *insp, uid_t uid) {
+    return uid_cache_lookup(&insp->users, uid);
+}
+
+void inspector_free(struct inspector *insp) {
+
+    if (insp == NULL) {
+        return;
+    }
+    proc_buf_free(&insp->pb);
+    uid_cache_free(&insp->users);
+    pid_list_free(&insp->pids);
+    //the first worker borrows 'pb' rather than having its own
+    int i;
+    for (i = 1; insp->workers != NULL && i < insp->num_workers; i++) {
+        proc_buf_free(&insp->workers[i].pb);
+    }
+    for (i = 0; insp->workers != NULL && i < insp->num_workers; i++) {
+        task_ring_close(insp->workers[i].ring);
+    }
+    free(insp->workers);
+    for (i = 0; i < insp->num_thread_lists; i++) {
+        thread_list_free(&insp->thread_lists[i]);
+    }
+    free(insp->thread_lists);
+    stat_snapshot_free(&insp->stat);
+    cpu_table_free(&insp->sampler.start_cpus);
+    cpu_breakdown_free(&insp->sampler.breakdown);
+    free(insp->rows);
+    free(insp->sort_keys);
+    free(insp->sorted_rows);
+    task_cpu_free(&insp->task_cpu);
+    task_state_free(&insp->task_states);
+    free(insp->diffs);
+    procfs_close(&insp->fs);
+    free(insp);
+}
+
+/**
+ * Creates (or takes over) the shared memory segment 'name' and maps it for
+ * inspector_shm_publish(). Returns NULL if it can't be set up.
+ */
+struct inspector_shm *inspector_shm_create(const char *name) {
+
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("shm_open");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct inspector_shm)) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+    struct inspector_shm *shm = mmap(NULL, sizeof(struct inspector_shm),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    //readers check the layout before they look at anything else
+    memcpy(shm->magic, SHM_MAGIC, sizeof(shm->magic));
+    shm->version = SHM_VERSION;
+    shm->size = sizeof(struct inspector_shm);
+    __atomic_store_n(&shm->seq, 0, __ATOMIC_RELEASE);
+    return shm;
+}
+
+/**
+ * Maps the shared memory segment 'name' read-only for
+ * inspector_shm_read(). Returns NULL if there is no such segment or it
+ * wasn't created by inspector_shm_create().
+ */
+struct inspector_shm *inspector_shm_attach(const char *name) {
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        perror("shm_open");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(struct inspector_shm)) {
+        fprintf(stderr, "%s is not an inspector snapshot.\n", name);
+        close(fd);
+        return NULL;
+    }
+    struct inspector_shm *shm = mmap(NULL, sizeof(struct inspector_shm),
+        PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (memcmp(shm->magic, SHM_MAGIC, sizeof(shm->magic)) != 0
+        || shm->version != SHM_VERSION
+        || shm->size != sizeof(struct inspector_shm)) {
+        fprintf(stderr, "%s is not an inspector snapshot.\n", name);
+        inspector_shm_detach(shm);
+        return NULL;
+    }
+    return shm;
+}
+
+/**
+ * Publishes the system, hardware and task summary sections of a
+ * collection. Readers that catch the update halfway retry, so this never
+ * waits for them.
+ */
+void inspector_shm_publish(struct inspector_shm *shm,
+    const struct inspector_snapshot *snap) {
+
+    uint64_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    //the odd count has to be visible before any of the data changes
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct inspector_published *pub = &shm->data;
+    pub->time_ns = snap->time.tv_sec * 1000000000ull + snap->time.tv_nsec;
+    pub->has_system = snap->system != NULL;
+    pub->has_hardware = snap->hardware != NULL;
+    pub->has_summary = snap->summary != NULL;
+    if (snap->system != NULL) {
+        pub->system = *snap->system;
+    }
+    if (snap->hardware != NULL) {
+        pub->hardware = *snap->hardware;
+    }
+    if (snap->summary != NULL) {
+        pub->summary = *snap->summary;
+    }
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies the latest published collection into 'pub'. Returns 0, or -1 if
+ * nothing has been published yet or no consistent copy could be had in
+ * SHM_READ_TRIES attempts.
+ */
+int inspector_shm_read(const struct inspector_shm *shm,
+    struct inspector_published *pub) {
+
+    int tries;
+    for (tries = 0; tries < SHM_READ_TRIES; tries++) {
+        uint64_t before = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (before == 0) {
+            return -1;
+        }
+        if (before & 1) {
+            //mid-update
+            continue;
+        }
+        memcpy(pub, &shm->data, sizeof(*pub));
+        //the copy has to be done before the count is checked again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == before) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void inspector_shm_detach(struct inspector_shm *shm) {
+    if (shm != NULL) {
+        munmap(shm, sizeof(struct inspector_shm));
+    }
+}
+
+
+/**
+ * Builds a task list row for each of the scanned PIDs (up to max_rows) and
+ * reads the given per-task files into them, dropping the rows the state and
+ * name filters reject. When the stat file is read, the cpu usage of each
+ * task since the previous build is worked out as well. Returns the number
+ * of rows.
+ */
+ssize_t build_task_rows(struct inspector *insp, unsigned int files) {
+
+    //when sorting or filtering, the first rows can come from anywhere in
+    //the list; a diff needs every row, or the rest would seem to exit
+    bool parse_filter = task_filter_columns(&insp->filter) != 0;
+    bool capped = insp->max_rows > 0 && insp->sort == SORT_NONE
+        && insp->top_n == 0 && insp->diff == false;
+    if (insp->diff) {
+        //start times tell a known task from one that reused its pid
+        files |= TASK_FILE_STAT;
+    }
+    size_t num_rows = insp->pids.count;
+    if (insp->list_threads) {
+        ssize_t num_threads = expand_threads(insp);
+        if (num_threads == -1) {
+            return -1;
+        }
+        num_rows = num_threads;
+    }
+    if (capped && !parse_filter && num_rows > insp->max_rows) {
+        num_rows = insp->max_rows;
+    }
+    if (num_rows > insp->rows_cap) {
+        struct task_row *new_rows = realloc(insp->rows,
+            num_rows * sizeof(struct task_row));
+        SELF_COUNT(allocs, 1);
+        if (new_rows == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        insp->rows = new_rows;
+        insp->rows_cap = num_rows;
+    }
+
+    size_t i;
+    if (insp->list_threads) {
+        //the slices were cut in process order, so each process's threads
+        //stay together
+        size_t row = 0;
+        int w;
+        for (w = 0; w < insp->num_thread_lists && row < num_rows; w++) {
+            struct thread_list *list = &insp->thread_lists[w];
+            for (i = 0; i < list->count && row < num_rows; i++) {
+                insp->rows[row].pid = list->ids[i].pid;
+                insp->rows[row].tid = list->ids[i].tid;
+                row++;
+            }
+        }
+    } else {
+        for (i = 0; i < num_rows; i++) {
+            insp->rows[i].pid = insp->pids.pids[i];
+            insp->rows[i].tid = 0;
+        }
+    }
+    struct timespec taken;
+    struct timespec taken_boot;
+    clock_gettime(CLOCK_MONOTONIC, &taken);
+    clock_gettime(CLOCK_BOOTTIME, &taken_boot);
+    collect_task_list(&insp->fs, &insp->pb, insp->workers, insp->num_workers,
+        insp->rows, num_rows, files, &insp->filter);
+    if (parse_filter) {
+        num_rows = filter_task_rows(insp->rows, num_rows);
+        if (capped && num_rows > insp->max_rows) {
+            num_rows = insp->max_rows;
+        }
+    }
+
+    if ((files & TASK_FILE_STAT)
+        && task_cpu_update(&insp->task_cpu, insp->rows, num_rows, &taken,
+            &taken_boot) == -1) {
+        return -1;
+    }
+    return num_rows;
+}
+
+/* The per-task files each task list column can be read from (any one of
+ * them will do). The PID needs no file: it's the directory name. */
+const unsigned int task_column_sources[NUM_TASK_COLS] = {
+    [TASK_COL_PID] = 0,
+    [TASK_COL_TID] = 0,
+    [TASK_COL_STATE] = TASK_FILE_STAT | TASK_FILE_STATUS,
+    [TASK_COL_NAME] = TASK_FILE_COMM | TASK_FILE_STAT | TASK_FILE_STATUS,
+    [TASK_COL_USER] = TASK_FILE_STATUS,
+    [TASK_COL_THREADS] = TASK_FILE_STAT | TASK_FILE_STATUS,
+    [TASK_COL_CPU] = TASK_FILE_STAT,
+    [TASK_COL_RSS] = TASK_FILE_STATM,
+    [TASK_COL_VSZ] = TASK_FILE_STATM,
+    [TASK_COL_SWAP] = TASK_FILE_STATUS,
+};
+
+/**
+ * Plans the smallest set of per-task files that has every given column.
+ * The columns with the fewest sources are placed first, since they leave
+ * no choice; each column after that is served by a file already in the
+ * plan when it can be, or else by the cheapest file that has it. A PID and
+ * name listing reads only comm, and the default columns only status.
+ */
+unsigned int task_column_files(unsigned int columns) {
+
+    unsigned int files = 0;
+    int num_sources;
+    for (num_sources = 1; num_sources <= NUM_TASK_FILES; num_sources++) {
+        int col;
+        for (col = 0; col < NUM_TASK_COLS; col++) {
+            unsigned int sources = task_column_sources[col];
+            if ((columns & COL_BIT(col)) == 0
+                || __builtin_popcount(sources) != num_sources) {
+                continue;
+            }
+            if ((sources & files) == 0) {
+                files |= sources & -sources;
+            }
+        }
+    }
+    return files;
+}
+
+/**
+ * The columns a task list row needs read: the ones shown, plus the ones
+ * the sort order and the filters are decided on.
+ */
+unsigned int task_read_columns(struct inspector *insp) {
+
+    unsigned int columns = insp->task_columns
+        | task_filter_columns(&insp->filter);
+    switch (insp->sort) {
+        case SORT_CPU:
+            columns |= COL_BIT(TASK_COL_CPU);
+            break;
+        case SORT_MEM:
+            columns |= COL_BIT(TASK_COL_RSS);
+            break;
+        case SORT_THREADS:
+            columns |= COL_BIT(TASK_COL_THREADS);
+            break;
+        case SORT_NONE:
+            //--top alone ranks by cpu usage
+            if (insp->top_n > 0) {
+                columns |= COL_BIT(TASK_COL_CPU);
+            }
+            break;
+        case SORT_PID:
+            break;
+    }
+    return columns;
+}
+
+/**
+ * Takes the first reading of every task's cpu time, which opens the window
+ * the task list's cpu usage is measured over.
+ */
+int prime_task_cpu(struct inspector *insp) {
+
+    if (scan_pids(&insp->fs, &insp->pids, &insp->filter) == -1) {
+        return -1;
+    }
+    unsigned int columns = COL_BIT(TASK_COL_CPU)
+        | task_filter_columns(&insp->filter);
+    return build_task_rows(insp, task_column_files(columns)) == -1 ? -1 : 0;
+}
+
+/**
+ * Copies the first 'num_rows' rows to 'sorted_rows' in the --sort order
+ * (cpu usage for --top without --sort), keeping only the first 'top_n' if
+ * that is set. Returns the number of rows copied.
+ */
+ssize_t order_task_rows(struct inspector *insp, size_t num_rows) {
+
+    size_t n = num_rows;
+    if (insp->top_n > 0 && insp->top_n < num_rows) {
+        n = insp->top_n;
+    }
+    if (n > insp->sorted_cap) {
+        uint64_t *new_keys = realloc(insp->sort_keys, n * sizeof(uint64_t));
+        SELF_COUNT(allocs, 1);
+        if (new_keys == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        insp->sort_keys = new_keys;
+
+        struct task_row *new_rows = realloc(insp->sorted_rows,
+            n * sizeof(struct task_row));
+        SELF_COUNT(allocs, 1);
+        if (new_rows == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        insp->sorted_rows = new_rows;
+        insp->sorted_cap = n;
+    }
+
+    enum task_sort sort = insp->sort == SORT_NONE ? SORT_CPU : insp->sort;
+    n = sort_task_keys(insp->rows, num_rows, n, sort, insp->sort_keys);
+
+    //the row index is the low half of each key
+    size_t i;
+    for (i = 0; i < n; i++) {
+        insp->sorted_rows[i] = insp->rows[(uint32_t) insp->sort_keys[i]];
+    }
+    return n;
+}
+
+/**
+ * Loads the complete contents of the file 'name' (relative to the directory
+ * open as 'dir_fd') into 'pb', growing the buffer as needed. The buffer is
+ * reused between calls, so after the first few files each load costs one
+ * open, a couple of large reads and a close.
+ *
+ * Returns the number of bytes read, or -1 on error (in which case the buffer
+ * holds an empty string).
+ */
+ssize_t proc_buf_load_at(struct proc_buf *pb, int dir_fd, const char *name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    SELF_COUNT(opens, 1);
+    if (fd == -1) {
+        pb->len = 0;
+        if (pb->data != NULL) {
+            pb->data[0] = '\0';
+        }
+        return -1;
+    }
+
+    ssize_t read_sz = proc_buf_read(pb, fd);
+    close(fd);
+    return read_sz;
+}
+
+/**
+ * Reads an open file into 'pb' from offset 0 to the end. Since the reads are
+ * positional, the same descriptor can be read again later to get fresh
+ * contents (procfs regenerates a file when it is read from the start).
+ */
+ssize_t proc_buf_read(struct proc_buf *pb, int fd)
+{
+    pb->len = 0;
+    if (pb->cap == 0 && proc_buf_grow(pb) == -1) {
+        return -1;
+    }
+    pb->data[0] = '\0';
+
+    ssize_t read_sz;
+    while (true) {
+        if (pb->cap - pb->len <= PROC_BUF_SLACK && proc_buf_grow(pb) == -1) {
+            read_sz = -1;
+            break;
+        }
+
+        //always leave room for the NUL terminator and the slack bytes
+        read_sz = pread(fd, pb->data + pb->len,
+            pb->cap - pb->len - PROC_BUF_SLACK, pb->len);
+        SELF_COUNT(reads, 1);
+        if (read_sz <= 0) {
+            break;
+        }
+        pb->len += read_sz;
+        SELF_COUNT(bytes, read_sz);
+    }
+
+    //NUL-terminate and clear the slack, so loads past the data are defined
+    memset(pb->data + pb->len, 0, PROC_BUF_SLACK);
+    if (read_sz == -1) {
+        return -1;
+    }
+    return pb->len;
+}
+
+/* Paths of the fixed procfs files, relative to the mount point */
+const char *procfs_file_names[NUM_PROCFS_FILES] = {
+    [PROCFS_STAT] = "stat",
+    [PROCFS_MEMINFO] = "meminfo",
+    [PROCFS_LOADAVG] = "loadavg",
+    [PROCFS_UPTIME] = "uptime",
+    [PROCFS_VERSION] = "version",
+    [PROCFS_HOSTNAME] = "sys/kernel/hostname",
+    [PROCFS_CPUINFO] = "cpuinfo",
+};
+
+/**
+ * Opens the procfs mount point. Every later access is relative to this
+ * descriptor, so paths are never rebuilt or walked from the root again.
+ */
+int procfs_open(struct procfs *fs, const char *loc, bool hold_files)
+{
+    fs->loc = loc;
+    fs->hold_files = hold_files;
+    int i;
+    for (i = 0; i < NUM_PROCFS_FILES; i++) {
+        fs->held_fds[i] = -1;
+    }
+
+    fs->dir_fd = open(loc, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fs->dir_fd == -1) {
+        perror("open");
+        return -1;
+    }
+    return 0;
+}
+
+void procfs_close(struct procfs *fs)
+{
+    if (fs->dir_fd != -1) {
+        close(fs->dir_fd);
+        fs->dir_fd = -1;
+    }
+
+    int i;
+    for (i = 0; i < NUM_PROCFS_FILES; i++) {
+        if (fs->held_fds[i] != -1) {
+            close(fs->held_fds[i]);
+            fs->held_fds[i] = -1;
+        }
+    }
+}
+
+/**
+ * Loads one of the fixed procfs files into 'pb', reusing (or keeping) an
+ * open descriptor if the procfs holds its files.
+ */
+ssize_t procfs_load(struct procfs *fs, struct proc_buf *pb,
+    enum procfs_file file)
+{
+    int fd = fs->held_fds[file];
+    if (fd != -1) {
+        return proc_buf_read(pb, fd);
+    }
+
+    const char *name = procfs_file_names[file];
+    if (fs->hold_files == false) {
+        return proc_buf_load_at(pb, fs->dir_fd, name);
+    }
+
+    fd = openat(fs->dir_fd, name, O_RDONLY | O_CLOEXEC);
+    SELF_COUNT(opens, 1);
+    if (fd == -1) {
+        return proc_buf_load_at(pb, fs->dir_fd, name);
+    }
+    fs->held_fds[file] = fd;
+    return proc_buf_read(pb, fd);
+}
+
+/**
+ * Opens the /proc/<pid> directory, or /proc/<pid>/task/<tid> for a thread
+ * (tid not 0). The per-task files are then opened relative to the returned
+ * descriptor with proc_buf_load_at().
+ */
+int procfs_open_task(struct procfs *fs, pid_t pid, pid_t tid)
+{
+    char name[3 * NUM_SZ];
+    if (tid != 0) {
+        snprintf(name, sizeof(name), "%d/task/%d", pid, tid);
+    } else {
+        snprintf(name, sizeof(name), "%d", pid);
+    }
+    SELF_COUNT(opens, 1);
+    return openat(fs->dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Doubles the capacity of a proc_buf (or performs the initial allocation).
+ */
+int proc_buf_grow(struct proc_buf *pb)
+{
+    size_t new_cap = pb->cap == 0 ? PROC_BUF_INIT : pb->cap * 2;
+    char *new_data = realloc(pb->data, new_cap);
+    SELF_COUNT(allocs, 1);
+    if (new_data == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    pb->data = new_data;
+    pb->cap = new_cap;
+    return 0;
+}
+
+void proc_buf_free(struct proc_buf *pb)
+{
+    free(pb->data);
+    pb->data = NULL;
+    pb->len = 0;
+    pb->cap = 0;
+}
+
+/**
+ * Returns a view spanning the entire contents of a proc_buf.
+ */
+struct str_view proc_buf_view(const struct proc_buf *pb)
+{
+    struct str_view view = { pb->data, pb->len };
+    return view;
+}
+
+/**
+ * Returns the first line of a proc_buf, without its trailing newline.
+ */
+struct str_view view_first_line(const struct proc_buf *pb)
+{
+    struct str_view text = proc_buf_view(pb);
+    struct str_view line = { pb->data, 0 };
+    view_next_line(&text, &line);
+    return line;
+}
+
+/**
+ * Splits the next line (without its trailing newline) off the front of
+ * 'rest'. Returns false once 'rest' is exhausted.
+ */
+bool view_next_line(struct str_view *rest, struct str_view *line)
+{
+    if (rest->len == 0) {
+        return false;
+    }
+
+    const char *nl = memchr(rest->ptr, '\n', rest->len);
+    size_t line_len = nl == NULL ? rest->len : (size_t) (nl - rest->ptr);
+
+    line->ptr = rest->ptr;
+    line->len = line_len;
+
+    //skip over the newline, if there was one
+    size_t consumed = nl == NULL ? line_len : line_len + 1;
+    rest->ptr += consumed;
+    rest->len -= consumed;
+    return true;
+}
+
+/**
+ * Splits the next space- or tab-delimited field off the front of 'rest'.
+ * Returns false when there are no fields left.
+ */
+bool view_next_field(struct str_view *rest, struct str_view *field)
+{
+    size_t i = 0;
+    while (i < rest->len && (rest->ptr[i] == ' ' || rest->ptr[i] == '\t')) {
+        i++;
+    }
+    if (i == rest->len) {
+        rest->ptr += i;
+        rest->len = 0;
+        return false;
+    }
+
+    size_t start = i;
+    while (i < rest->len && rest->ptr[i] != ' ' && rest->ptr[i] != '\t') {
+        i++;
+    }
+
+    field->ptr = rest->ptr + start;
+    field->len = i - start;
+    rest->ptr += i;
+    rest->len -= i;
+    return true;
+}
+
+/**
+ * Returns the 'n'th (zero-based) field of a line, or an empty view if the
+ * line is shorter than that.
+ */
+struct str_view view_field(struct str_view line, int n)
+{
+    struct str_view field = { line.ptr, 0 };
+    int i;
+    for (i = 0; i <= n; i++) {
+        if (view_next_field(&line, &field) == false) {
+            field.len = 0;
+            break;
+        }
+    }
+    return field;
+}
+
+bool view_has_prefix(struct str_view view, const char *prefix)
+{
+    size_t prefix_len = strlen(prefix);
+    return view.len >= prefix_len && memcmp(view.ptr, prefix, prefix_len) == 0;
+}
+
+/**
+ * Finds the first line in 'text' starting with 'prefix'. Returns false (and
+ * an empty line) if there is no such line.
+ */
+bool view_find_line(struct str_view text, const char *prefix,
+    struct str_view *line)
+{
+    while (view_next_line(&text, line)) {
+        if (view_has_prefix(*line, prefix)) {
+            return true;
+        }
+    }
+    line->ptr = text.ptr;
+    line->len = 0;
+    return false;
+}
+
+/**
+ * Copies a view into a NUL-terminated string of at most 'dst_sz' bytes,
+ * truncating if necessary. Returns the number of characters copied.
+ */
+size_t view_copy(struct str_view view, char *dst, size_t dst_sz)
+{
+    size_t copy_len = view.len < dst_sz - 1 ? view.len : dst_sz - 1;
+    memcpy(dst, view.ptr, copy_len);
+    dst[copy_len] = '\0';
+    return copy_len;
+}
+
+/* Powers of ten up to the eight digits converted by one SWAR step */
+const uint64_t pow10_table[9] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+};
+
+/**
+ * Returns the number of leading ASCII digits in an 8-byte chunk loaded
+ * from memory (little-endian, so the first character is the lowest byte).
+ * A byte is a digit if both it and the byte plus 6 have 0x3 as their high
+ * nibble. The addition can carry into the next byte, but only out of a
+ * byte that is already a non-digit.
+ */
+int swar_digit_count(uint64_t chunk)
+{
+    uint64_t high = chunk & (0xF0 * SWAR_ONES);
+    uint64_t plus_6 = (chunk + 0x06 * SWAR_ONES) & (0xF0 * SWAR_ONES);
+    uint64_t non_digit = (high ^ (0x30 * SWAR_ONES))
+        | (plus_6 ^ (0x30 * SWAR_ONES));
+    return non_digit == 0 ? 8 : __builtin_ctzll(non_digit) / 8;
+}
+
+/**
+ * Converts the first 'n' (1-8) digit characters of a chunk to their value.
+ * The digits are shifted up against the top of the word so the missing
+ * ones read as leading zeros, then adjacent pairs, quads and octets are
+ * combined with three multiplies.
+ */
+uint64_t swar_parse_digits(uint64_t chunk, int n)
+{
+    //bytes past the digits may borrow, but they are shifted out below
+    chunk -= 0x30 * SWAR_ONES;
+    chunk <<= 8 * (8 - n);
+
+    chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FFULL;
+    chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFFULL;
+    chunk = (chunk * 10000 + (chunk >> 32)) & 0x00000000FFFFFFFFULL;
+    return chunk;
+}
+
+/**
+ * Parses the unsigned decimal number at the front of 'rest' (after any
+ * blanks) and advances 'rest' past it. Returns 0 if there is no number.
+ * The digits are read eight at a time straight out of the view; the loads
+ * may run past the end of the view, but never past the slack bytes that
+ * follow the data in a proc_buf.
+ */
+uint64_t view_parse_u64(struct str_view *rest)
+{
+    const char *p = rest->ptr;
+    const char *end = p + rest->len;
+
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+
+    uint64_t value = 0;
+    while (p < end) {
+        int n;
+        uint64_t digits;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        uint64_t chunk;
+        memcpy(&chunk, p, sizeof(chunk));
+        n = swar_digit_count(chunk);
+        if (n > end - p) {
+            n = end - p;
+        }
+        if (n == 0) {
+            break;
+        }
+        digits = swar_parse_digits(chunk, n);
+#else
+        digits = 0;
+        for (n = 0; n < 8 && p + n < end && p[n] >= '0' && p[n] <= '9'; n++) {
+            digits = digits * 10 + (p[n] - '0');
+        }
+        if (n == 0) {
+            break;
+        }
+#endif
+        value = value * pow10_table[n] + digits;
+        p += n;
+        if (n < 8) {
+            break;
+        }
+    }
+
+    rest->len = end - p;
+    rest->ptr = p;
+    return value;
+}
+
+/**
+ * Parses the 'n'th (zero-based) field of a line as a number.
+ */
+uint64_t view_field_u64(struct str_view line, int n)
+{
+    struct str_view field = view_field(line, n);
+    return view_parse_u64(&field);
+}
+
+/**
+ * Fills in a stat_snapshot with one pass over the stat file.
+ */
+int read_stat_snapshot(struct procfs *fs, struct proc_buf *pb,
+    struct stat_snapshot *snap)
+{
+    memset(&snap->total, 0, sizeof(snap->total));
+    snap->cpus.count = 0;
+    snap->intr = 0;
+    snap->ctxt = 0;
+    snap->btime = 0;
+    snap->processes = 0;
+    snap->procs_running = 0;
+    snap->procs_blocked = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &snap->taken);
+    if (procfs_load(fs, pb, PROCFS_STAT) == -1) {
+        return -1;
+    }
+
+    struct str_view text = proc_buf_view(pb);
+    struct str_view line;
+    while (view_next_line(&text, &line)) {
+
+        if (view_has_prefix(line, "cpu")) {
+            //"cpu" is the aggregate line, "cpuN" the per-cpu lines
+            struct str_view rest = { line.ptr + 3, line.len - 3 };
+            if (line.len > 3 && isdigit((unsigned char) line.ptr[3])) {
+                struct cpu_table *cpus = &snap->cpus;
+                if (cpu_table_reserve(cpus, cpus->count + 1) == -1) {
+                    return -1;
+                }
+                cpus->ids[cpus->count] = view_parse_u64(&rest);
+
+                //scatter the row into the per-state columns
+                struct cpu_times times;
+                parse_cpu_times(rest, &times);
+                int j;
+                for (j = 0; j < NUM_CPU_STATES; j++) {
+                    cpus->jiffies[j][cpus->count] = times.jiffies[j];
+                }
+                cpus->count++;
+            } else {
+                parse_cpu_times(rest, &snap->total);
+            }
+
+        } else if (view_has_prefix(line, "intr ")) {
+            //the first number on the intr line is the total
+            snap->intr = view_field_u64(line, 1);
+        } else if (view_has_prefix(line, "ctxt ")) {
+            snap->ctxt = view_field_u64(line, 1);
+        } else if (view_has_prefix(line, "btime ")) {
+            snap->btime = view_field_u64(line, 1);
+        } else if (view_has_prefix(line, "processes ")) {
+            snap->processes = view_field_u64(line, 1);
+        } else if (view_has_prefix(line, "procs_running ")) {
+            snap->procs_running = view_field_u64(line, 1);
+        } else if (view_has_prefix(line, "procs_blocked ")) {
+            snap->procs_blocked = view_field_u64(line, 1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parses the jiffies columns that follow the "cpuN" label of a cpu line.
+ * Columns missing on older kernels are left at zero.
+ */
+void parse_cpu_times(struct str_view rest, struct cpu_times *times)
+{
+    int i;
+    for (i = 0; i < NUM_CPU_STATES; i++) {
+        times->jiffies[i] = view_parse_u64(&rest);
+    }
+}
+
+void stat_snapshot_free(struct stat_snapshot *snap)
+{
+    cpu_table_free(&snap->cpus);
+}
+
+/**
+ * Makes room for at least 'count' cpus, keeping the current contents.
+ */
+int cpu_table_reserve(struct cpu_table *table, size_t count)
+{
+    if (count <= table->cap) {
+        return 0;
+    }
+
+    size_t new_cap = table->cap == 0 ? CPU_TABLE_INIT : table->cap;
+    while (new_cap < count) {
+        new_cap *= 2;
+    }
+
+    int i;
+    for (i = 0; i < NUM_CPU_STATES; i++) {
+        uint64_t *column = realloc(table->jiffies[i], new_cap * sizeof(uint64_t));
+        SELF_COUNT(allocs, 1);
+        if (column == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        table->jiffies[i] = column;
+    }
+    unsigned int *ids = realloc(table->ids, new_cap * sizeof(unsigned int));
+    SELF_COUNT(allocs, 1);
+    if (ids == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    table->ids = ids;
+    table->cap = new_cap;
+    return 0;
+}
+
+int cpu_table_copy(struct cpu_table *dst, const struct cpu_table *src)
+{
+    if (cpu_table_reserve(dst, src->count) == -1) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < NUM_CPU_STATES; i++) {
+        memcpy(dst->jiffies[i], src->jiffies[i], src->count * sizeof(uint64_t));
+    }
+    memcpy(dst->ids, src->ids, src->count * sizeof(unsigned int));
+    dst->count = src->count;
+    return 0;
+}
+
+void cpu_table_free(struct cpu_table *table)
+{
+    int i;
+    for (i = 0; i < NUM_CPU_STATES; i++) {
+        free(table->jiffies[i]);
+        table->jiffies[i] = NULL;
+    }
+    free(table->ids);
+    table->ids = NULL;
+    table->count = 0;
+    table->cap = 0;
+}
+
+/**
+ * Makes room for at least 'count' cpus. All the columns live in a single
+ * allocation, which is only replaced when it has to grow.
+ */
+int cpu_breakdown_reserve(struct cpu_breakdown *breakdown, size_t count)
+{
+    if (count <= breakdown->cap) {
+        return 0;
+    }
+
+    float *block = malloc(count * (6 * sizeof(float) + sizeof(unsigned int)));
+    SELF_COUNT(allocs, 1);
+    if (block == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    free(breakdown->busy);
+
+    breakdown->busy = block;
+    breakdown->user = block + count;
+    breakdown->system = block + 2 * count;
+    breakdown->iowait = block + 3 * count;
+    breakdown->steal = block + 4 * count;
+    breakdown->scale = block + 5 * count;
+    breakdown->ids = (unsigned int *) (block + 6 * count);
+    breakdown->cap = count;
+    return 0;
+}
+
+void cpu_breakdown_free(struct cpu_breakdown *breakdown)
+{
+    free(breakdown->busy);
+    memset(breakdown, 0, sizeof(*breakdown));
+}
+
+/**
+ * Computes the utilisation of every cpu between two tables. Each step is a
+ * flat loop over one column with no branches or calls in its body, so the
+ * compiler turns them into vector code. The guest columns are left out of
+ * the total since the kernel already counts guest time as user time.
+ */
+void cpu_breakdown_compute(const struct cpu_table *first,
+    const struct cpu_table *second, struct cpu_breakdown *out)
+{
+    //a cpu coming online or going offline shifts the rows, so only
+    //compare tables that line up
+    size_t n = second->count;
+    if (first->count != n || cpu_breakdown_reserve(out, n) == -1) {
+        out->count = 0;
+        return;
+    }
+    out->count = n;
+    memcpy(out->ids, second->ids, n * sizeof(unsigned int));
+
+    float *restrict scale = out->scale;
+    size_t i;
+    int j;
+
+    //total jiffies per cpu over the window. Deltas over one window easily
+    //fit in 32 bits, and int32 to float converts in vector registers where
+    //uint64 to float does not
+    for (i = 0; i < n; i++) {
+        scale[i] = 0;
+    }
+    for (j = 0; j < CPU_GUEST; j++) {
+        const uint64_t *restrict a = first->jiffies[j];
+        const uint64_t *restrict b = second->jiffies[j];
+        for (i = 0; i < n; i++) {
+            scale[i] += (float) (int32_t) (b[i] - a[i]);
+        }
+    }
+
+    //turn it into a per-cpu factor from jiffies to percent
+    for (i = 0; i < n; i++) {
+        scale[i] = scale[i] > 0 ? 100.0f / scale[i] : 0.0f;
+    }
+
+    struct {
+        float *dst;
+        int state;
+    } columns[] = {
+        { out->user, CPU_USER },
+        { out->system, CPU_SYSTEM },
+        { out->iowait, CPU_IOWAIT },
+        { out->steal, CPU_STEAL },
+        { out->busy, CPU_IDLE },
+    };
+
+    size_t k;
+    for (k = 0; k < sizeof(columns) / sizeof(columns[0]); k++) {
+        float *restrict dst = columns[k].dst;
+        const uint64_t *restrict a = first->jiffies[columns[k].state];
+        const uint64_t *restrict b = second->jiffies[columns[k].state];
+        for (i = 0; i < n; i++) {
+            dst[i] = (float) (int32_t) (b[i] - a[i]) * scale[i];
+        }
+    }
+
+    //busy is everything but idle and iowait; 'busy' holds idle so far
+    float *restrict busy = out->busy;
+    const float *restrict iowait = out->iowait;
+    for (i = 0; i < n; i++) {
+        float idle = busy[i] + iowait[i];
+        busy[i] = scale[i] > 0 ? 100.0f - idle : 0.0f;
+    }
+}
+
+/**
+ * Reduces a snapshot to the idle and total jiffies used for CPU usage.
+ */
+void cpu_sample_from(struct stat_snapshot *snap, struct cpu_sample *sample)
+{
+    cpu_sample_from_times(snap->total.jiffies, snap->btime, sample);
+}
+
+void cpu_sample_from_times(const uint64_t jiffies[], uint64_t btime,
+    struct cpu_sample *sample)
+{
+    sample->idle = jiffies[CPU_IDLE];
+    sample->total = 0;
+    int i;
+    for (i = 0; i < NUM_CPU_STATES; i++) {
+        sample->total += jiffies[i];
+    }
+    sample->btime = btime;
+}
+
+/**
+ * Fraction of non-idle time between two samples, or 0 if no time passed.
+ */
+float cpu_usage_between(struct cpu_sample *first, struct cpu_sample *second) {
+
+    //calculate usage
+    float usage = 1-(float)(second->idle-first->idle)/(second->total-first->total);
+    if (isnan(usage) || isinf(usage)) {
+        return 0.0;
+    } else {
+        return usage;
+    }
+}
+
+/**
+ * Fraction of non-idle time between two readings of the aggregate cpu line.
+ */
+float cpu_usage_from_times(const uint64_t first[NUM_CPU_STATES],
+    const uint64_t second[NUM_CPU_STATES]) {
+
+    struct cpu_sample a;
+    struct cpu_sample b;
+    cpu_sample_from_times(first, 0, &a);
+    cpu_sample_from_times(second, 0, &b);
+    return cpu_usage_between(&a, &b);
+}
+
+long timespec_diff_ms(struct timespec *end, struct timespec *start) {
+    return (end->tv_sec - start->tv_sec) * 1000
+        + (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/**
+ * Sleeps until 'window_ms' have passed since 'since' (monotonic).
+ */
+void wait_until_elapsed(struct timespec *since, long window_ms) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long remaining = window_ms - timespec_diff_ms(&now, since);
+    if (remaining > 0) {
+        struct timespec pause = { remaining / 1000,
+            (remaining % 1000) * 1000000 };
+        while (nanosleep(&pause, &pause) == -1 && errno == EINTR);
+    }
+}
+
+/**
+ * Starts the sampling window at the given snapshot.
+ */
+void cpu_sampler_start(struct cpu_sampler *sampler, struct stat_snapshot *snap) {
+
+    cpu_sample_from(snap, &sampler->start);
+    sampler->start_time = snap->taken;
+    sampler->primed = true;
+    if (sampler->per_cpu) {
+        cpu_table_copy(&sampler->start_cpus, &snap->cpus);
+    }
+}
+
+/**
+ * Returns the CPU usage measured by the sampler, given the snapshot taken
+ * for the current sample. If a sample persisted by a previous run is
+ * available (and from the same boot), usage is computed against it right
+ * away. Otherwise, if the snapshot is too recent to close the sampling
+ * window, this sleeps for whatever remains of the window and refreshes the
+ * snapshot. The latest sample then starts the next window, so repeated
+ * calls (watch mode) measure usage since the last call without waiting.
+ */
+float cpu_sampler_finish(struct cpu_sampler *sampler, struct procfs *fs,
+    struct proc_buf *pb, struct stat_snapshot *snap) {
+
+    float usage;
+    struct cpu_sample latest;
+    struct cpu_sample previous;
+
+    //only the aggregate line is persisted, so the per-cpu breakdown
+    //always needs a full window
+    if (sampler->state_path != NULL && sampler->per_cpu == false
+        && load_cpu_sample(pb, sampler->state_path, &previous) == 0
+        && previous.btime == sampler->start.btime
+        && sampler->start.total - previous.total >= MIN_STATE_JIFFIES) {
+
+        LOG("Using persisted cpu sample from %s\n", sampler->state_path);
+        latest = sampler->start;
+        usage = cpu_usage_between(&previous, &latest);
+    } else {
+        //the snapshot only closes the window if it was taken late enough
+        if (timespec_diff_ms(&snap->taken, &sampler->start_time) < sampler->window_ms) {
+            wait_until_elapsed(&sampler->start_time, sampler->window_ms);
+            read_stat_snapshot(fs, pb, snap);
+        }
+
+        cpu_sample_from(snap, &latest);
+        usage = cpu_usage_between(&sampler->start, &latest);
+    }
+
+    if (sampler->state_path != NULL) {
+        save_cpu_sample(sampler->state_path, &latest);
+
+        //later windows start from our own samples
+        sampler->state_path = NULL;
+    }
+
+    if (sampler->per_cpu) {
+        cpu_breakdown_compute(&sampler->start_cpus, &snap->cpus,
+            &sampler->breakdown);
+        cpu_table_copy(&sampler->start_cpus, &snap->cpus);
+    }
+
+    sampler->start = latest;
+    sampler->start_time = snap->taken;
+    return usage;
+}
+
+/**
+ * Reads a cpu sample written by save_cpu_sample().
+ */
+int load_cpu_sample(struct proc_buf *pb, const char *path,
+    struct cpu_sample *sample) {
+
+    if (proc_buf_load_at(pb, AT_FDCWD, path) <= 0) {
+        return -1;
+    }
+
+    //"btime idle total"
+    struct str_view line = view_first_line(pb);
+    sample->btime = view_parse_u64(&line);
+    sample->idle = view_parse_u64(&line);
+    sample->total = view_parse_u64(&line);
+    return sample->total > 0 ? 0 : -1;
+}
+
+/**
+ * Persists a cpu sample for the next run. The sample is written to a
+ * temporary file and renamed into place, so concurrent runs never see a
+ * partial file.
+ */
+int save_cpu_sample(const char *path, struct cpu_sample *sample) {
+
+    char tmp_path[PATH_MAX];
+    int len = snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+    if (len < 0 || (size_t) len >= sizeof(tmp_path)) {
+        return -1;
+    }
+
+    char line[3 * NUM_SZ];
+    len = snprintf(line, sizeof(line), "%ld %ld %ld\n", sample->btime,
+        sample->idle, sample->total);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    ssize_t write_sz = write(fd, line, len);
+    close(fd);
+
+    if (write_sz != len || rename(tmp_path, path) == -1) {
+        perror("save_cpu_sample");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+void get_meminfo(struct procfs *fs, struct proc_buf *pb, struct meminfo *mem){
+
+    memset(mem, 0, sizeof(*mem));
+    if (procfs_load(fs, pb, PROCFS_MEMINFO) == -1) {
+        return;
+    }
+
+    //"MemTotal:    6160000 kB"
+    struct {
+        const char *prefix;
+        uint64_t *value;
+    } fields[] = {
+        { "MemTotal:", &mem->total },
+        { "MemFree:", &mem->free },
+        { "MemAvailable:", &mem->available },
+        { "Buffers:", &mem->buffers },
+        { "Cached:", &mem->cached },
+        { "Active:", &mem->active },
+        { "SwapTotal:", &mem->swap_total },
+        { "SwapFree:", &mem->swap_free },
+    };
+    size_t num_fields = sizeof(fields) / sizeof(fields[0]);
+
+    struct str_view text = proc_buf_view(pb);
+    struct str_view line;
+    size_t found = 0;
+    while (found < num_fields && view_next_line(&text, &line)) {
+        size_t i;
+        for (i = 0; i < num_fields; i++) {
+            if (view_has_prefix(line, fields[i].prefix)) {
+                *fields[i].value = view_field_u64(line, 1);
+                found++;
+                break;
+            }
+        }
+    }
+}
+
+void get_task_list(struct proc_buf *pb, int task_fd, char *state_code,
+    char task_name[], uid_t *uid, unsigned int *threads, uint64_t *swap_kb) {
+
+    struct str_view text = { "", 0 };
+    if (proc_buf_load_at(pb, task_fd, "status") != -1) {
+        text = proc_buf_view(pb);
+    }
+    parse_task_status(text, state_code, task_name, uid, threads, swap_kb);
+}
+
+/**
+ * Parses the contents of a status file, which must be followed by
+ * PROC_BUF_SLACK zero bytes like a proc_buf's. Fields missing from it are
+ * left at their defaults.
+ */
+void parse_task_status(struct str_view text, char *state_code,
+    char task_name[], uid_t *uid, unsigned int *threads, uint64_t *swap_kb) {
+
+    *state_code = '\0';
+    task_name[0] = '\0';
+    *uid = NO_UID;
+    *threads = 0;
+    *swap_kb = 0;
+
+    struct str_view line;
+    while (view_next_line(&text, &line)) {
+
+        if (view_has_prefix(line, "Name:")) {
+            //the name may contain spaces, so take everything after the tab
+            struct str_view name = { line.ptr + 6, line.len - 6 };
+            if (line.len < 6) {
+                name.len = 0;
+            }
+            view_copy(name, task_name, TASK_NAME_SZ);
+
+        } else if (view_has_prefix(line, "State:")) {
+            //"State:\tS (sleeping)": the word follows from the letter
+            struct str_view code = view_field(line, 1);
+            if (code.len > 0) {
+                *state_code = code.ptr[0];
+            }
+
+        } else if (view_has_prefix(line, "Uid:")) {
+            //real uid is the first of the four ids
+            *uid = view_field_u64(line, 1);
+
+        } else if (view_has_prefix(line, "VmSwap:")) {
+            //"VmSwap:\t     128 kB", absent for kernel threads
+            *swap_kb = view_field_u64(line, 1);
+
+        } else if (view_has_prefix(line, "Threads:")) {
+            *threads = view_field_u64(line, 1);
+            //no information needed after this line
+            break;
+        }
+    }
+}
+
+/**
+ * Reads a task's virtual and resident set sizes from /proc/<pid>/statm,
+ * which holds nothing but page counts: "size resident shared text lib data
+ * dt", converted with 'page_kb' (the page size in KB). Both are 0 if it
+ * can't be read.
+ */
+void get_task_statm(struct proc_buf *pb, int task_fd, uint64_t page_kb,
+    uint64_t *vsz_kb, uint64_t *rss_kb) {
+
+    *vsz_kb = 0;
+    *rss_kb = 0;
+    if (proc_buf_load_at(pb, task_fd, "statm") == -1) {
+        return;
+    }
+
+    struct str_view rest = proc_buf_view(pb);
+    *vsz_kb = view_parse_u64(&rest) * page_kb;
+    *rss_kb = view_parse_u64(&rest) * page_kb;
+}
+
+/**
+ * Reads a task's cpu time (utime + stime, in clock ticks) and its start time
+ * (ticks after boot) from /proc/<pid>/stat. Both are 0 if it can't be read.
+ * Unless 'task_name' is NULL, the state letter, name and thread count are
+ * taken from the same line, which spares reading status for them.
+ */
+void get_task_stat(struct proc_buf *pb, int task_fd, uint64_t *cpu_ticks,
+    uint64_t *start_time, char *state_code, char task_name[],
+    unsigned int *threads) {
+
+    *cpu_ticks = 0;
+    *start_time = 0;
+    if (proc_buf_load_at(pb, task_fd, "stat") == -1) {
+        return;
+    }
+
+    //"1234 (name) S 1 ...": the name may hold spaces and parentheses, so
+    //the fields are counted from the last ')'
+    const char *close_paren = pb->data + pb->len;
+    while (close_paren > pb->data && *close_paren != ')') {
+        close_paren--;
+    }
+    if (*close_paren != ')') {
+        return;
+    }
+    if (task_name != NULL) {
+        const char *open_paren = memchr(pb->data, '(', close_paren - pb->data);
+        if (open_paren != NULL) {
+            struct str_view name = { open_paren + 1,
+                close_paren - open_paren - 1 };
+            view_copy(name, task_name, TASK_NAME_SZ);
+        }
+    }
+
+    //after the name: state (0), ..., utime (11), stime (12), ...,
+    //num_threads (17), ..., starttime (19)
+    struct str_view rest = { close_paren + 1,
+        pb->len - (close_paren + 1 - pb->data) };
+    struct str_view field;
+    int i;
+    for (i = 0; i <= 19 && view_next_field(&rest, &field); i++) {
+        if (i == 0 && task_name != NULL) {
+            *state_code = field.ptr[0];
+        } else if (i == 11 || i == 12) {
+            *cpu_ticks += view_parse_u64(&field);
+        } else if (i == 17 && task_name != NULL) {
+            *threads = view_parse_u64(&field);
+        } else if (i == 19) {
+            *start_time = view_parse_u64(&field);
+        }
+    }
+}
+
+/**
+ * Reads a task's name from /proc/<pid>/comm, the cheapest file that has it.
+ */
+void get_task_comm(struct proc_buf *pb, int task_fd, char task_name[]) {
+
+    task_name[0] = '\0';
+    if (proc_buf_load_at(pb, task_fd, "comm") == -1) {
+        return;
+    }
+    view_copy(view_first_line(pb), task_name, TASK_NAME_SZ);
+}
+
+/**
+ * The word the status file shows for a one-letter task state, or "" for a
+ * letter it doesn't know.
+ */
+const char *task_state_name(char code) {
+
+    switch (code) {
+        case 'R':
+            return "running";
+        case 'S':
+            return "sleeping";
+        case 'D':
+            return "disk sleep";
+        case 'T':
+            return "stopped";
+        case 't':
+            return "tracing stop";
+        case 'X':
+            return "dead";
+        case 'Z':
+            return "zombie";
+        case 'P':
+            return "parked";
+        case 'I':
+            return "idle";
+        default:
+            return "";
+    }
+}
+
+/**
+ * The one-letter task state shown as 'name' by the status file (the reverse
+ * of task_state_name()), or '\0' if there is none.
+ */
+char task_state_code(const char *name) {
+
+    static const char codes[] = "RSDTtXZPI";
+    const char *code;
+    for (code = codes; *code != '\0'; code++) {
+        if (strcmp(task_state_name(*code), name) == 0) {
+            return *code;
+        }
+    }
+    return '\0';
+}
+
+
+/**
+ * Fibonacci hashing: multiplies by 2^32 / phi and keeps the top bits of the
+ * 32-bit product, which every bit of the uid feeds into, so the mostly-
+ * sequential uids spread across the table. 'mask' is the table size less
+ * one, so it has as many bits set as the hash needs.
+ */
+size_t uid_hash(uid_t uid, size_t mask) {
+    int bits = __builtin_popcountl(mask);
+    return bits == 0 ? 0 : ((uint32_t) uid * 2654435769u) >> (32 - bits);
+}
+
+void uid_cache_init(struct uid_cache *cache) {
+    cache->slots = calloc(UID_CACHE_INIT, sizeof(struct uid_entry));
+    cache->cap = cache->slots == NULL ? 0 : UID_CACHE_INIT;
+    cache->count = 0;
+
+    long pw_buf_sz = sysconf(_SC_GETPW_R_SIZE_MAX);
+    cache->pw_buf_sz = pw_buf_sz > 0 ? pw_buf_sz : 1024;
+    cache->pw_buf = NULL;
+}
+
+void uid_cache_free(struct uid_cache *cache) {
+    size_t i;
+    for (i = 0; i < cache->cap; i++) {
+        free(cache->slots[i].name);
+    }
+    free(cache->slots);
+    free(cache->pw_buf);
+    cache->slots = NULL;
+    cache->cap = 0;
+    cache->count = 0;
+}
+
+/**
+ * Returns the username for 'uid', or NULL if it has no passwd entry. Only
+ * the first lookup of each uid goes to NSS; the returned string is owned by
+ * the cache.
+ */
+const char *uid_cache_lookup(struct uid_cache *cache, uid_t uid) {
+
+    if (cache->cap == 0) {
+        //no table (allocation failed): usernames go unresolved
+        return NULL;
+    }
+
+    size_t mask = cache->cap - 1;
+    size_t i = uid_hash(uid, mask);
+    while (cache->slots[i].used) {
+        if (cache->slots[i].uid == uid) {
+            return cache->slots[i].name;
+        }
+        i = (i + 1) & mask;
+    }
+
+    struct self_timer timer;
+    SELF_BEGIN(&timer, SELF_USERNAMES);
+    char *name = resolve_username(cache, uid);
+    SELF_END(&timer);
+
+    //keep the load factor at or below one half
+    if ((cache->count + 1) * 2 > cache->cap) {
+        if (uid_cache_grow(cache) == -1) {
+            free(name);
+            return NULL;
+        }
+        mask = cache->cap - 1;
+        i = uid_hash(uid, mask);
+        while (cache->slots[i].used) {
+            i = (i + 1) & mask;
+        }
+    }
+
+    cache->slots[i].uid = uid;
+    cache->slots[i].used = true;
+    cache->slots[i].name = name;
+    cache->count++;
+    return name;
+}
+
+/**
+ * Looks a uid up in the passwd database, returning a newly-allocated copy
+ * of its name or NULL if there isn't one.
+ */
+char *resolve_username(struct uid_cache *cache, uid_t uid) {
+
+    struct passwd pwd;
+    struct passwd *result = NULL;
+    int err;
+
+    while (true) {
+        if (cache->pw_buf == NULL) {
+            cache->pw_buf = malloc(cache->pw_buf_sz);
+            SELF_COUNT(allocs, 1);
+            if (cache->pw_buf == NULL) {
+                perror("malloc");
+                return NULL;
+            }
+        }
+
+        err = getpwuid_r(uid, &pwd, cache->pw_buf, cache->pw_buf_sz, &result);
+        if (err != ERANGE) {
+            break;
+        }
+
+        //the entry didn't fit: retry with a bigger buffer
+        free(cache->pw_buf);
+        cache->pw_buf = NULL;
+        cache->pw_buf_sz *= 2;
+    }
+
+    if (err != 0 || result == NULL) {
+        return NULL;
+    }
+    SELF_COUNT(allocs, 1);
+    return strdup(pwd.pw_name);
+}
+
+/**
+ * Fibonacci hashing again, for the (also mostly sequential) pids.
+ */
+size_t pid_hash(pid_t pid, size_t mask) {
+    int bits = __builtin_popcountl(mask);
+    return bits == 0 ? 0 : ((uint32_t) pid * 2654435769u) >> (32 - bits);
+}
+
+struct task_cpu_entry *task_cpu_find(struct task_cpu_table *table, pid_t pid) {
+
+    if (table->cap == 0) {
+        return NULL;
+    }
+
+    size_t mask = table->cap - 1;
+    size_t i = pid_hash(pid, mask);
+    while (table->slots[i].pid != 0) {
+        if (table->slots[i].pid == pid) {
+            return &table->slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/**
+ * Works out the cpu usage of every row from its cpu time and the time the
+ * same task had at the previous update, 'taken' (and 'taken_boot', on the
+ * boot clock) being when the rows were read. The table is then refilled
+ * from the rows for the next update. Rows stay at -1 on the first update,
+ * since there is nothing to compare with, and so does a task that was
+ * running at the previous update but not among its rows (a filter or the
+ * row cap left it out).
+ */
+int task_cpu_update(struct task_cpu_table *table, struct task_row *rows,
+    size_t num_rows, struct timespec *taken, struct timespec *taken_boot) {
+
+    if (table->ticks_per_sec == 0) {
+        table->ticks_per_sec = sysconf(_SC_CLK_TCK);
+        if (table->ticks_per_sec <= 0) {
+            table->ticks_per_sec = 100;
+        }
+    }
+
+    double elapsed = (taken->tv_sec - table->taken.tv_sec)
+        + (taken->tv_nsec - table->taken.tv_nsec) / 1e9;
+    size_t i;
+    for (i = 0; i < num_rows; i++) {
+        struct task_row *row = &rows[i];
+        row->cpu_usage = -1;
+        if (table->primed == false || row->start_time == 0 || elapsed <= 0) {
+            continue;
+        }
+
+        //a task started since last time used all its cpu time since;
+        //threads are keyed by their own id
+        uint64_t prev_ticks = 0;
+        struct task_cpu_entry *entry = task_cpu_find(table,
+            row->tid != 0 ? row->tid : row->pid);
+        if (entry != NULL && entry->start_time == row->start_time) {
+            prev_ticks = entry->cpu_ticks;
+        } else if (row->start_time < table->taken_ticks) {
+            continue;
+        }
+        if (row->cpu_ticks >= prev_ticks) {
+            row->cpu_usage = (row->cpu_ticks - prev_ticks) * 100.0
+                / (elapsed * table->ticks_per_sec);
+        }
+    }
+
+    //keep the load factor at or below one half
+    size_t new_cap = table->cap == 0 ? TASK_CPU_INIT : table->cap;
+    while (new_cap < num_rows * 2) {
+        new_cap *= 2;
+    }
+    if (new_cap != table->cap) {
+        struct task_cpu_entry *new_slots = realloc(table->slots,
+            new_cap * sizeof(struct task_cpu_entry));
+        SELF_COUNT(allocs, 1);
+        if (new_slots == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        table->slots = new_slots;
+        table->cap = new_cap;
+    }
+
+    memset(table->slots, 0, table->cap * sizeof(struct task_cpu_entry));
+    table->count = 0;
+    size_t mask = table->cap - 1;
+    for (i = 0; i < num_rows; i++) {
+        if (rows[i].start_time == 0) {
+            continue;
+        }
+        pid_t id = rows[i].tid != 0 ? rows[i].tid : rows[i].pid;
+        size_t j = pid_hash(id, mask);
+        while (table->slots[j].pid != 0) {
+            j = (j + 1) & mask;
+        }
+        table->slots[j].pid = id;
+        table->slots[j].start_time = rows[i].start_time;
+        table->slots[j].cpu_ticks = rows[i].cpu_ticks;
+        table->count++;
+    }
+
+    table->taken = *taken;
+    table->taken_ticks = (uint64_t) taken_boot->tv_sec * table->ticks_per_sec
+        + (uint64_t) taken_boot->tv_nsec * table->ticks_per_sec / 1000000000;
+    table->primed = true;
+    return 0;
+}
+
+void task_cpu_free(struct task_cpu_table *table) {
+    free(table->slots);
+    table->slots = NULL;
+    table->cap = 0;
+    table->count = 0;
+}
+
+struct task_state_entry *task_state_find(struct task_state_table *table,
+    pid_t id) {
+
+    if (table->cap == 0) {
+        return NULL;
+    }
+
+    size_t mask = table->cap - 1;
+    size_t i = pid_hash(id, mask);
+    while (table->slots[i].id != 0) {
+        if (table->slots[i].id == id) {
+            return &table->slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/**
+ * Whether any of the state, name, user and thread count columns among
+ * 'columns' differ between two rows of the same task.
+ */
+bool task_row_changed(const struct task_row *before,
+    const struct task_row *after, unsigned int columns) {
+
+    return ((columns & COL_BIT(TASK_COL_STATE))
+            && before->state_code != after->state_code)
+        || ((columns & COL_BIT(TASK_COL_NAME))
+            && strcmp(before->task_name, after->task_name) != 0)
+        || ((columns & COL_BIT(TASK_COL_USER)) && before->uid != after->uid)
+        || ((columns & COL_BIT(TASK_COL_THREADS))
+            && before->threads != after->threads);
+}
+
+/**
+ * Lists how the first 'num_rows' rows differ from the previous collection
+ * in 'diffs': the tasks that are new (or have a different start time, their
+ * pid having been reused), the ones with a changed column, then the ones
+ * that are gone. The state table is then refilled from the rows for the
+ * next collection. Returns the number of changes.
+ */
+ssize_t diff_task_rows(struct inspector *insp, size_t num_rows) {
+
+    struct task_state_table *table = &insp->task_states;
+    struct task_row *rows = insp->rows;
+
+    //at worst every task is new and every known one gone
+    size_t most = num_rows + table->count;
+    if (most > insp->diffs_cap) {
+        struct task_diff *new_diffs = realloc(insp->diffs,
+            most * sizeof(struct task_diff));
+        SELF_COUNT(allocs, 1);
+        if (new_diffs == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        insp->diffs = new_diffs;
+        insp->diffs_cap = most;
+    }
+
+    size_t count = 0;
+    size_t i;
+    for (i = 0; i < num_rows; i++) {
+        //a task without a start time exited before its stat file was read
+        struct task_row *row = &rows[i];
+        if (row->start_time == 0) {
+            continue;
+        }
+        enum task_change change = TASK_ADDED;
+        struct task_state_entry *entry = task_state_find(table,
+            row->tid != 0 ? row->tid : row->pid);
+        if (entry != NULL && entry->row.start_time == row->start_time) {
+            entry->seen = true;
+            if (!task_row_changed(&entry->row, row, insp->task_columns)) {
+                continue;
+            }
+            change = TASK_CHANGED;
+        }
+        insp->diffs[count].change = change;
+        insp->diffs[count].row = *row;
+        count++;
+    }
+    for (i = 0; i < table->cap; i++) {
+        if (table->slots[i].id != 0 && table->slots[i].seen == false) {
+            insp->diffs[count].change = TASK_EXITED;
+            insp->diffs[count].row = table->slots[i].row;
+            count++;
+        }
+    }
+
+    //keep the load factor at or below one half
+    size_t new_cap = table->cap == 0 ? TASK_STATE_INIT : table->cap;
+    while (new_cap < num_rows * 2) {
+        new_cap *= 2;
+    }
+    if (new_cap != table->cap) {
+        struct task_state_entry *new_slots = realloc(table->slots,
+            new_cap * sizeof(struct task_state_entry));
+        SELF_COUNT(allocs, 1);
+        if (new_slots == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        table->slots = new_slots;
+        table->cap = new_cap;
+    }
+
+    memset(table->slots, 0, table->cap * sizeof(struct task_state_entry));
+    table->count = 0;
+    size_t mask = table->cap - 1;
+    for (i = 0; i < num_rows; i++) {
+        if (rows[i].start_time == 0) {
+            continue;
+        }
+        pid_t id = rows[i].tid != 0 ? rows[i].tid : rows[i].pid;
+        size_t j = pid_hash(id, mask);
+        while (table->slots[j].id != 0) {
+            j = (j + 1) & mask;
+        }
+        table->slots[j].id = id;
+        table->slots[j].row = rows[i];
+        table->count++;
+    }
+    return count;
+}
+
+void task_state_free(struct task_state_table *table) {
+    free(table->slots);
+    table->slots = NULL;
+    table->cap = 0;
+    table->count = 0;
+}
+
+/**
+ * Packs the sort order of a row into one integer: its rank under 'sort' in
+ * the high half and its index in the low half, so ties keep directory
+ * order and the row can be found again from the key alone. Sorting these
+ * 8-byte keys moves far less memory than sorting the rows themselves.
+ */
+uint64_t task_sort_key(const struct task_row *row, enum task_sort sort,
+    uint32_t index) {
+
+    uint32_t rank;
+    switch (sort) {
+        case SORT_CPU:
+            //busiest first, then the tasks that weren't measured
+            rank = UINT32_MAX;
+            if (row->cpu_usage >= 0) {
+                double scaled = row->cpu_usage * 100.0 + 1;
+                rank = UINT32_MAX - (scaled < UINT32_MAX - 1 ? (uint32_t) scaled
+                    : UINT32_MAX - 1);
+            }
+            break;
+        case SORT_MEM:
+            rank = UINT32_MAX - (row->rss_kb < UINT32_MAX ? row->rss_kb
+                : UINT32_MAX);
+            break;
+        case SORT_THREADS:
+            rank = UINT32_MAX - row->threads;
+            break;
+        case SORT_PID:
+        default:
+            rank = row->pid;
+            break;
+    }
+    return ((uint64_t) rank << 32) | index;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Restores the heap property below slot 'i' of a heap whose root is its
+ * largest key.
+ */
+void key_heap_sift_down(uint64_t *heap, size_t count, size_t i) {
+
+    while (true) {
+        size_t largest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < count && heap[left] > heap[largest]) {
+            largest = left;
+        }
+        if (right < count && heap[right] > heap[largest]) {
+            largest = right;
+        }
+        if (largest == i) {
+            return;
+        }
+        uint64_t tmp = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = tmp;
+        i = largest;
+    }
+}
+
+/**
+ * Leaves the keys of the first 'n' rows under 'sort' in 'keys', in order.
+ * With fewer than all the rows wanted, a bounded heap keeps the n smallest
+ * keys seen so far (the largest of them at the root, ready to be replaced),
+ * which is O(rows log n) instead of sorting every row. Returns the number
+ * of keys.
+ */
+size_t sort_task_keys(struct task_row *rows, size_t num_rows, size_t n,
+    enum task_sort sort, uint64_t *keys) {
+
+    if (n >= num_rows) {
+        size_t i;
+        for (i = 0; i < num_rows; i++) {
+            keys[i] = task_sort_key(&rows[i], sort, i);
+        }
+        qsort(keys, num_rows, sizeof(uint64_t), compare_u64);
+        return num_rows;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    size_t count = 0;
+    size_t i;
+    for (i = 0; i < num_rows; i++) {
+        uint64_t key = task_sort_key(&rows[i], sort, i);
+        if (count < n) {
+            //sift the new key up from the bottom
+            size_t pos = count++;
+            keys[pos] = key;
+            while (pos > 0 && keys[(pos - 1) / 2] < keys[pos]) {
+                size_t parent = (pos - 1) / 2;
+                uint64_t tmp = keys[pos];
+                keys[pos] = keys[parent];
+                keys[parent] = tmp;
+                pos = parent;
+            }
+        } else if (key < keys[0]) {
+            keys[0] = key;
+            key_heap_sift_down(keys, count, 0);
+        }
+    }
+
+    //heapsort: moving the largest key to the back each time leaves them
+    //in ascending order
+    size_t end;
+    for (end = count; end > 1; end--) {
+        uint64_t tmp = keys[0];
+        keys[0] = keys[end - 1];
+        keys[end - 1] = tmp;
+        key_heap_sift_down(keys, end - 1, 0);
+    }
+    return count;
+}
+
+/**
+ * Doubles the size of the uid cache and rehashes its entries.
+ */
+int uid_cache_grow(struct uid_cache *cache) {
+
+    size_t new_cap = cache->cap * 2;
+    struct uid_entry *new_slots = calloc(new_cap, sizeof(struct uid_entry));
+    SELF_COUNT(allocs, 1);
+    if (new_slots == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    size_t mask = new_cap - 1;
+    size_t i;
+    for (i = 0; i < cache->cap; i++) {
+        if (cache->slots[i].used == false) {
+            continue;
+        }
+        size_t j = uid_hash(cache->slots[i].uid, mask);
+        while (new_slots[j].used) {
+            j = (j + 1) & mask;
+        }
+        new_slots[j] = cache->slots[i];
+    }
+
+    free(cache->slots);
+    cache->slots = new_slots;
+    cache->cap = new_cap;
+    return 0;
+}
+
+/**
+ * Lists the PIDs in the procfs with one pass of large getdents64 calls on
+ * the root descriptor, parsing each numeric directory name as it goes.
+ * PIDs outside the filter's range are dropped as soon as they are parsed,
+ * and with a uid filter the owner of each remaining directory is checked
+ * with fstatat (it is the task's effective uid), so no task file is opened for
+ * the tasks left out.
+ *
+ * Returns the number of PIDs kept, or -1 on error.
+ */
+ssize_t scan_pids(struct procfs *fs, struct pid_list *list,
+    const struct task_filter *filter) {
+
+    bool scan_filter = task_filter_scans(filter);
+    list->count = 0;
+    list->total = 0;
+    if (list->dents == NULL) {
+        list->dents = malloc(DENTS_BUF_SZ);
+        SELF_COUNT(allocs, 1);
+        if (list->dents == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+
+    //the root descriptor is rescanned on every refresh in watch mode
+    if (lseek(fs->dir_fd, 0, SEEK_SET) == -1) {
+        perror("lseek");
+        return -1;
+    }
+
+    long read_sz;
+    while ((read_sz = syscall(SYS_getdents64, fs->dir_fd, list->dents,
+        DENTS_BUF_SZ)) > 0) {
+
+        SELF_COUNT(reads, 1);
+        SELF_COUNT(bytes, read_sz);
+
+        long pos = 0;
+        while (pos < read_sz) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *) (list->dents + pos);
+            pos += entry->d_reclen;
+
+            if (entry->d_type != DT_DIR) {
+                continue;
+            }
+
+            //only directories whose names are all digits are tasks
+            pid_t pid = parse_pid_name(entry->d_name);
+            if (pid == -1) {
+                continue;
+            }
+            list->total++;
+
+            if (scan_filter) {
+                if (pid < filter->pid_min
+                    || (filter->pid_max > 0 && pid > filter->pid_max)) {
+                    continue;
+                }
+                struct stat st;
+                if (filter->uid != NO_UID
+                    && (fstatat(fs->dir_fd, entry->d_name, &st,
+                        AT_SYMLINK_NOFOLLOW) == -1 || st.st_uid != filter->uid)) {
+                    continue;
+                }
+            }
+
+            if (pid_list_append(list, pid) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    if (read_sz == -1) {
+        perror("getdents64");
+        return -1;
+    }
+    return list->count;
+}
+
+int pid_list_append(struct pid_list *list, pid_t pid) {
+
+    if (list->count == list->cap) {
+        size_t new_cap = list->cap == 0 ? 1024 : list->cap * 2;
+        pid_t *new_pids = realloc(list->pids, new_cap * sizeof(pid_t));
+        SELF_COUNT(allocs, 1);
+        if (new_pids == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        list->pids = new_pids;
+        list->cap = new_cap;
+    }
+    list->pids[list->count++] = pid;
+    return 0;
+}
+
+void pid_list_free(struct pid_list *list) {
+    free(list->pids);
+    free(list->dents);
+    list->pids = NULL;
+    list->dents = NULL;
+    list->count = 0;
+    list->cap = 0;
+}
+
+/**
+ * Parses a procfs directory name made only of digits (a pid or tid).
+ * Returns -1 for any other name.
+ */
+pid_t parse_pid_name(const char *name) {
+
+    const char *c = name;
+    pid_t pid = 0;
+    while (*c >= '0' && *c <= '9') {
+        pid = pid * 10 + (*c - '0');
+        c++;
+    }
+    long digits = c - name;
+    if (*c != '\0' || digits == 0 || digits > MAX_PID_DIGITS) {
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Lists the threads of every scanned process for -L. The processes are
+ * split into contiguous slices, one per worker, and each worker reads the
+ * /proc/<pid>/task directories of its slice into its own thread list, so
+ * the threads of many processes are found in parallel without locking.
+ * The lists are then read back in slice order by build_task_rows().
+ *
+ * Returns the number of threads found, or -1 on error.
+ */
+ssize_t expand_threads(struct inspector *insp) {
+
+    if (insp->thread_lists == NULL) {
+        insp->thread_lists = calloc(insp->num_workers,
+            sizeof(struct thread_list));
+        SELF_COUNT(allocs, 1);
+        if (insp->thread_lists == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        insp->num_thread_lists = insp->num_workers;
+    }
+
+    size_t num_pids = insp->pids.count;
+    int num_scans = insp->num_thread_lists;
+    if ((size_t) num_scans > num_pids) {
+        num_scans = num_pids > 0 ? num_pids : 1;
+    }
+
+    struct thread_scan scans[MAX_WORKERS];
+    size_t slice = num_pids / num_scans;
+    size_t extra = num_pids % num_scans;
+    size_t start = 0;
+    int i;
+    for (i = 0; i < insp->num_thread_lists; i++) {
+        insp->thread_lists[i].count = 0;
+    }
+    for (i = 0; i < num_scans; i++) {
+        scans[i] = (struct thread_scan) {
+            .fs = &insp->fs,
+            .pids = insp->pids.pids + start,
+            .num_pids = slice + ((size_t) i < extra ? 1 : 0),
+            .list = &insp->thread_lists[i],
+        };
+        start += scans[i].num_pids;
+    }
+
+    //the first slice is expanded on this thread
+    int started;
+    for (started = 1; started < num_scans; started++) {
+        if (pthread_create(&scans[started].thread, NULL, thread_scan_thread,
+            &scans[started]) != 0) {
+            LOG("Could only start %d thread scans\n", started);
+            break;
+        }
+    }
+    thread_scan_run(&scans[0]);
+    for (i = started; i < num_scans; i++) {
+        thread_scan_run(&scans[i]);
+    }
+
+    ssize_t num_threads = 0;
+    for (i = 0; i < num_scans; i++) {
+        if (i > 0 && i < started) {
+            pthread_join(scans[i].thread, NULL);
+            if (SELF_STATS && self_current != NULL) {
+                self_counts_add(self_current, &scans[i].self);
+            }
+        }
+        if (scans[i].result == -1) {
+            num_threads = -1;
+        } else if (num_threads != -1) {
+            num_threads += scans[i].list->count;
+        }
+    }
+    return num_threads;
+}
+
+/**
+ * Expands one slice of processes into threads.
+ */
+void *thread_scan_run(void *arg) {
+
+    struct thread_scan *scan = arg;
+    scan->result = 0;
+    size_t i;
+    for (i = 0; i < scan->num_pids && scan->result == 0; i++) {
+        scan->result = scan_threads(scan->fs, scan->pids[i], scan->list);
+    }
+    return NULL;
+}
+
+/**
+ * Entry point of the -L scan threads, whose counts are kept per scan like
+ * those of the task list workers.
+ */
+void *thread_scan_thread(void *arg) {
+
+    struct thread_scan *scan = arg;
+    if (SELF_STATS && self_stats_on) {
+        self_current = &scan->self;
+    }
+    return thread_scan_run(scan);
+}
+
+/**
+ * Appends the threads of one process, read from /proc/<pid>/task with
+ * large getdents64 calls, to 'list'. A process that exited in the meantime
+ * simply has no threads.
+ */
+int scan_threads(struct procfs *fs, pid_t pid, struct thread_list *list) {
+
+    if (list->dents == NULL) {
+        list->dents = malloc(DENTS_BUF_SZ);
+        SELF_COUNT(allocs, 1);
+        if (list->dents == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+
+    char name[NUM_SZ + 8];
+    snprintf(name, sizeof(name), "%d/task", pid);
+    SELF_COUNT(opens, 1);
+    int task_dir = openat(fs->dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (task_dir == -1) {
+        return 0;
+    }
+
+    int result = 0;
+    long read_sz;
+    while (result == 0 && (read_sz = syscall(SYS_getdents64, task_dir,
+        list->dents, DENTS_BUF_SZ)) > 0) {
+
+        SELF_COUNT(reads, 1);
+        SELF_COUNT(bytes, read_sz);
+
+        long pos = 0;
+        while (pos < read_sz) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *) (list->dents + pos);
+            pos += entry->d_reclen;
+
+            //skips "." and ".."
+            pid_t tid = parse_pid_name(entry->d_name);
+            if (tid == -1) {
+                continue;
+            }
+            if (thread_list_append(list, pid, tid) == -1) {
+                result = -1;
+                break;
+            }
+        }
+    }
+    close(task_dir);
+    return result;
+}
+
+int thread_list_append(struct thread_list *list, pid_t pid, pid_t tid) {
+
+    if (list->count == list->cap) {
+        size_t new_cap = list->cap == 0 ? 1024 : list->cap * 2;
+        struct thread_id *new_ids = realloc(list->ids,
+            new_cap * sizeof(struct thread_id));
+        SELF_COUNT(allocs, 1);
+        if (new_ids == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        list->ids = new_ids;
+        list->cap = new_cap;
+    }
+    list->ids[list->count].pid = pid;
+    list->ids[list->count].tid = tid;
+    list->count++;
+    return 0;
+}
+
+void thread_list_free(struct thread_list *list) {
+    free(list->ids);
+    free(list->dents);
+    list->ids = NULL;
+    list->dents = NULL;
+    list->count = 0;
+    list->cap = 0;
+}
+
+/**
+ * Whether the filter limits the PIDs kept by scan_pids().
+ */
+bool task_filter_scans(const struct task_filter *filter) {
+    return filter->uid != NO_UID || filter->pid_min > 0 || filter->pid_max > 0;
+}
+
+/**
+ * The columns the filter needs read to decide on a task once it has been
+ * scanned (none if it only has a pid range and a user).
+ */
+unsigned int task_filter_columns(const struct task_filter *filter) {
+
+    unsigned int columns = 0;
+    if (filter->states[0] != '\0') {
+        columns |= COL_BIT(TASK_COL_STATE);
+    }
+    if (filter->name != NULL) {
+        columns |= COL_BIT(TASK_COL_NAME);
+    }
+    return columns;
+}
+
+bool task_filter_match(const struct task_filter *filter,
+    const struct task_row *row) {
+
+    if (filter->states[0] != '\0'
+        && (row->state_code == '\0' || strchr(filter->states, row->state_code) == NULL)) {
+        return false;
+    }
+    if (filter->name != NULL
+        && strncmp(row->task_name, filter->name, filter->name_len) != 0) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Moves the rows the workers kept (pid not 0) to the front, in order.
+ * Returns how many there are.
+ */
+size_t filter_task_rows(struct task_row *rows, size_t num_rows) {
+
+    size_t kept = 0;
+    size_t i;
+    for (i = 0; i < num_rows; i++) {
+        if (rows[i].pid == 0) {
+            continue;
+        }
+        if (kept != i) {
+            rows[kept] = rows[i];
+        }
+        kept++;
+    }
+    return kept;
+}
+
+void *task_worker_run(void *arg) {
+
+    struct task_worker *worker = arg;
+
+    //with --uring the status files are read a batch at a time ahead of
+    //the rows that need them
+    struct task_ring *ring = NULL;
+    if (worker->uring && (worker->files & TASK_FILE_STATUS)
+        && worker->ring_failed == false) {
+        if (worker->ring == NULL) {
+            worker->ring = task_ring_open();
+            worker->ring_failed = worker->ring == NULL;
+        }
+        ring = worker->ring;
+    }
+
+    size_t start = 0;
+    while (start < worker->num_rows) {
+        size_t count = worker->num_rows - start;
+        if (ring != NULL) {
+            if (count > RING_BATCH) {
+                count = RING_BATCH;
+            }
+            if (task_ring_load(ring, worker->fs, worker->rows + start, count,
+                worker->status_static ? worker->states : NULL) == -1) {
+                //plain reads from here on
+                ring = NULL;
+                worker->ring_failed = true;
+            }
+        }
+
+        size_t i;
+        for (i = 0; i < count; i++) {
+            struct str_view status;
+            bool loaded = ring != NULL && task_ring_status(ring, i, &status);
+            read_task_row(worker, &worker->rows[start + i],
+                loaded ? &status : NULL);
+        }
+        start += count;
+    }
+    return NULL;
+}
+
+/**
+ * Fills in one row from the per-task files in the worker's plan. 'status'
+ * is the task's status file if it has been read already, or NULL.
+ */
+void read_task_row(struct task_worker *worker, struct task_row *row,
+    const struct str_view *status) {
+
+    row->state_code = '\0';
+    row->task_name[0] = '\0';
+    row->uid = NO_UID;
+    row->threads = 0;
+    row->cpu_ticks = 0;
+    row->start_time = 0;
+    row->cpu_usage = -1;
+    row->rss_kb = 0;
+    row->vsz_kb = 0;
+    row->swap_kb = 0;
+    if (worker->files == 0) {
+        return;
+    }
+
+    //only the files in the plan are opened; status has the most, so
+    //stat and comm aren't asked for what it already gave. A status file
+    //that was read ahead needs no directory.
+    int task_fd = -1;
+    if (status == NULL || (worker->files & ~TASK_FILE_STATUS) != 0) {
+        task_fd = procfs_open_task(worker->fs, row->pid, row->tid);
+    }
+    bool have_status = worker->files & TASK_FILE_STATUS;
+
+    //with --diff, stat comes first: its start time tells whether the task
+    //was there at the previous collection, in which case its user can't
+    //have changed and status may not be needed at all. The name from stat
+    //is kept either way, so a task's name always comes from the same file.
+    bool stat_first = worker->states != NULL
+        && (worker->files & TASK_FILE_STAT);
+    bool read_status = have_status;
+    char stat_name[TASK_NAME_SZ] = "";
+    if (stat_first) {
+        get_task_stat(&worker->pb, task_fd, &row->cpu_ticks,
+            &row->start_time, &row->state_code, stat_name, &row->threads);
+        struct task_state_entry *entry = task_state_find(worker->states,
+            row->tid != 0 ? row->tid : row->pid);
+        if (worker->status_static && entry != NULL && row->start_time != 0
+            && entry->row.start_time == row->start_time) {
+            row->uid = entry->row.uid;
+            read_status = false;
+        }
+    }
+
+    if (read_status && status != NULL) {
+        parse_task_status(*status, &row->state_code, row->task_name,
+            &row->uid, &row->threads, &row->swap_kb);
+    } else if (read_status) {
+        get_task_list(&worker->pb, task_fd, &row->state_code,
+            row->task_name, &row->uid, &row->threads, &row->swap_kb);
+    }
+    if (stat_first) {
+        memcpy(row->task_name, stat_name, TASK_NAME_SZ);
+    } else if (worker->files & TASK_FILE_STAT) {
+        get_task_stat(&worker->pb, task_fd, &row->cpu_ticks,
+            &row->start_time, &row->state_code,
+            have_status ? NULL : row->task_name, &row->threads);
+    }
+    if (worker->files & TASK_FILE_COMM) {
+        get_task_comm(&worker->pb, task_fd, row->task_name);
+    }
+
+    //a rejected task's other files aren't worth reading
+    if (!task_filter_match(worker->filter, row)) {
+        row->pid = 0;
+        if (task_fd != -1) {
+            close(task_fd);
+        }
+        return;
+    }
+    if (worker->files & TASK_FILE_STATM) {
+        get_task_statm(&worker->pb, task_fd, worker->page_kb, &row->vsz_kb,
+            &row->rss_kb);
+    }
+    if (task_fd != -1) {
+        close(task_fd);
+    }
+}
+
+/**
+ * Sets up an io_uring instance for reading status files: maps its rings,
+ * registers RING_BATCH empty fixed file slots for the opens to fill, and
+ * allocates the buffer arena. Returns NULL if the kernel (or a seccomp
+ * filter, or the io_uring_disabled sysctl) won't allow it.
+ */
+struct task_ring *task_ring_open(void) {
+
+    struct task_ring *ring = calloc(1, sizeof(struct task_ring));
+    SELF_COUNT(allocs, 1);
+    if (ring == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    ring->sq_map = MAP_FAILED;
+    ring->cq_map = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(SYS_io_uring_setup, RING_BATCH * 3, &params);
+    if (ring->fd == -1) {
+        LOG("io_uring unavailable: %s\n", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_map_sz = params.sq_off.array
+        + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_sz = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_sz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_map_sz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED
+        || ring->sqes == MAP_FAILED) {
+        perror("mmap");
+        task_ring_close(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    //-1 leaves a slot empty for an open to install its file in
+    int slots[RING_BATCH];
+    memset(slots, -1, sizeof(slots));
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES,
+        slots, RING_BATCH) == -1) {
+        LOG("io_uring file slots unavailable: %s\n", strerror(errno));
+        task_ring_close(ring);
+        return NULL;
+    }
+
+    ring->arena = malloc(RING_BATCH * RING_SLOT_SZ);
+    ring->paths = malloc(RING_BATCH * RING_PATH_SZ);
+    SELF_COUNT(allocs, 2);
+    if (ring->arena == NULL || ring->paths == NULL) {
+        perror("malloc");
+        task_ring_close(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void task_ring_close(struct task_ring *ring) {
+
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_sz);
+    }
+    if (ring->cq_map != MAP_FAILED) {
+        munmap(ring->cq_map, ring->cq_map_sz);
+    }
+    if (ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_sz);
+    }
+    close(ring->fd);
+    free(ring->arena);
+    free(ring->paths);
+    free(ring);
+}
+
+/**
+ * Reads the status files of 'count' (at most RING_BATCH) tasks into the
+ * arena with one submission, and waits for all of them. Tasks in 'known'
+ * (a --diff state table, or NULL) are skipped, since they will most likely
+ * not need theirs. Returns 0, or -1 if the ring can't be used (a kernel
+ * without opens into fixed file slots, for one); the tasks are then left
+ * for plain reads.
+ */
+int task_ring_load(struct task_ring *ring, struct procfs *fs,
+    const struct task_row *rows, size_t count, struct task_state_table *known) {
+
+    unsigned int tail = *ring->sq_tail;
+    unsigned int mask = *ring->sq_mask;
+    size_t queued = 0;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        ring->results[i] = -1;
+        if (known != NULL && task_state_find(known,
+            rows[i].tid != 0 ? rows[i].tid : rows[i].pid) != NULL) {
+            continue;
+        }
+        if (rows[i].tid != 0) {
+            snprintf(ring->paths[i], RING_PATH_SZ, "%d/task/%d/status",
+                rows[i].pid, rows[i].tid);
+        } else {
+            snprintf(ring->paths[i], RING_PATH_SZ, "%d/status", rows[i].pid);
+        }
+
+        //open -> read -> close, each only once the one before is done; the
+        //close is hard linked so it runs even if the read fails
+        struct io_uring_sqe *sqe = &ring->sqes[(tail + 3 * queued) & mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = fs->dir_fd;
+        sqe->addr = (uintptr_t) ring->paths[i];
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = i + 1;
+        sqe->user_data = 3 * i;
+
+        sqe = &ring->sqes[(tail + 3 * queued + 1) & mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->fd = i;
+        sqe->addr = (uintptr_t) (ring->arena + i * RING_SLOT_SZ);
+        sqe->len = RING_SLOT_SZ - PROC_BUF_SLACK;
+        sqe->user_data = 3 * i + 1;
+
+        sqe = &ring->sqes[(tail + 3 * queued + 2) & mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = i + 1;
+        sqe->user_data = 3 * i + 2;
+        queued++;
+    }
+    if (queued == 0) {
+        return 0;
+    }
+    unsigned int total = 3 * queued;
+    for (i = 0; i < total; i++) {
+        ring->sq_array[(tail + i) & mask] = (tail + i) & mask;
+    }
+    __atomic_store_n(ring->sq_tail, tail + total, __ATOMIC_RELEASE);
+    SELF_COUNT(opens, queued);
+    SELF_COUNT(reads, queued);
+
+    //submit the batch and wait for all of it, usually in a single call
+    bool unsupported = false;
+    unsigned int to_submit = total;
+    unsigned int reaped = 0;
+    while (reaped < total) {
+        unsigned int head = *ring->cq_head;
+        unsigned int cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (to_submit > 0 || head == cq_tail) {
+            long entered = syscall(SYS_io_uring_enter, ring->fd, to_submit,
+                total - reaped - (cq_tail - head), IORING_ENTER_GETEVENTS,
+                NULL, 0);
+            if (entered == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("io_uring_enter");
+                return -1;
+            }
+            to_submit -= entered;
+            continue;
+        }
+
+        for (; head != cq_tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            size_t slot = cqe->user_data / 3;
+            if (cqe->user_data % 3 == 0 && cqe->res == -EINVAL) {
+                unsupported = true;
+            } else if (cqe->user_data % 3 == 1 && cqe->res >= 0) {
+                ring->results[slot] = cqe->res;
+                SELF_COUNT(bytes, cqe->res);
+            }
+            reaped++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (unsupported) {
+        LOG("io_uring can't open into fixed file slots, %s\n",
+            "using plain reads");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Points 'text' at the status file read into 'slot', zero padded like a
+ * proc_buf. Returns false if it couldn't be read, or may not have fit.
+ */
+bool task_ring_status(struct task_ring *ring, size_t slot,
+    struct str_view *text) {
+
+    ssize_t len = ring->results[slot];
+    if (len < 0 || len >= RING_SLOT_SZ - PROC_BUF_SLACK) {
+        return false;
+    }
+    char *data = ring->arena + slot * RING_SLOT_SZ;
+    memset(data + len, 0, PROC_BUF_SLACK);
+    text->ptr = data;
+    text->len = len;
+    return true;
+}
+
+/**
+ * Entry point of the task list threads. Their opens, reads and allocations
+ * are kept per worker and added to the caller's section once they finish.
+ */
+void *task_worker_thread(void *arg) {
+
+    struct task_worker *worker = arg;
+    if (SELF_STATS && self_stats_on) {
+        self_current = &worker->self;
+    }
+    return task_worker_run(worker);
+}
+
+/**
+ * Fills in the fields of every row from the given per-task files. With more
+ * than one worker, the rows are split into contiguous slices and each slice
+ * is parsed on its own thread; the calling thread handles the first slice
+ * using 'pb'. The workers keep their read buffers for the next call.
+ */
+void collect_task_list(struct procfs *fs, struct proc_buf *pb,
+    struct task_worker *workers, int num_workers, struct task_row *rows,
+    size_t num_rows, unsigned int files, const struct task_filter *filter) {
+
+    if ((size_t) num_workers > num_rows) {
+        num_workers = num_rows;
+    }
+    if (num_workers <= 1) {
+        workers[0].fs = fs;
+        workers[0].rows = rows;
+        workers[0].num_rows = num_rows;
+        workers[0].files = files;
+        workers[0].filter = filter;
+        workers[0].pb = *pb;
+        task_worker_run(&workers[0]);
+        *pb = workers[0].pb;
+        return;
+    }
+
+    size_t slice = num_rows / num_workers;
+    size_t extra = num_rows % num_workers;
+    size_t start = 0;
+    int i;
+    for (i = 0; i < num_workers; i++) {
+        workers[i].fs = fs;
+        workers[i].files = files;
+        workers[i].filter = filter;
+        workers[i].rows = rows + start;
+        workers[i].num_rows = slice + ((size_t) i < extra ? 1 : 0);
+        memset(&workers[i].self, 0, sizeof(workers[i].self));
+        start += workers[i].num_rows;
+    }
+
+    //the first slice runs on this thread with the caller's buffer
+    workers[0].pb = *pb;
+
+    int started;
+    for (started = 1; started < num_workers; started++) {
+        if (pthread_create(&workers[started].thread, NULL, task_worker_thread,
+            &workers[started]) != 0) {
+            LOG("Could only start %d workers\n", started);
+            break;
+        }
+    }
+    task_worker_run(&workers[0]);
+
+    //any slices that didn't get a thread are parsed here as well
+    for (i = started; i < num_workers; i++) {
+        workers[0].rows = workers[i].rows;
+        workers[0].num_rows = workers[i].num_rows;
+        task_worker_run(&workers[0]);
+    }
+
+    for (i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (SELF_STATS && self_current != NULL) {
+            self_counts_add(self_current, &workers[i].self);
+        }
+    }
+
+    *pb = workers[0].pb;
+}
+
+/**
+ * Reads the load averages and task counts. Returns 0, or -1 (with 'load'
+ * zeroed) if the file can't be read or is missing a field.
+ */
+int get_loadavg(struct procfs *fs, struct proc_buf *pb, struct loadavg *load){
+
+    memset(load, 0, sizeof(*load));
+    if (procfs_load(fs, pb, PROCFS_LOADAVG) == -1) {
+        return -1;
+    }
+
+    //"0.18 0.06 0.02 1/123 4567"
+    struct str_view line = view_first_line(pb);
+    if (view_field(line, 4).len == 0) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < 3; i++) {
+        load->avg[i] = strtof(view_field(line, i).ptr, NULL);
+    }
+
+    struct str_view tasks = view_field(line, 3);
+    load->running = view_parse_u64(&tasks);
+    if (tasks.len > 0 && tasks.ptr[0] == '/') {
+        tasks.ptr++;
+        tasks.len--;
+        load->total = view_parse_u64(&tasks);
+    }
+    load->last_pid = view_field_u64(line, 4);
+    return 0;
+}
+
+void get_CPU_mode(struct procfs *fs, struct proc_buf *pb, char* CPU_mode){
+
+    CPU_mode[0] = '\0';
+    if (procfs_load(fs, pb, PROCFS_CPUINFO) == -1) {
+        return;
+    }
+
+    //"model name\t: Intel(R) Xeon(R) ..."
+    struct str_view line;
+    if (view_find_line(proc_buf_view(pb), "model name", &line) == false) {
+        return;
+    }
+
+    const char *colon = memchr(line.ptr, ':', line.len);
+    if (colon == NULL) {
+        return;
+    }
+
+    struct str_view model = { colon + 1, line.len - (colon + 1 - line.ptr) };
+    while (model.len > 0 && model.ptr[0] == ' ') {
+        model.ptr++;
+        model.len--;
+    }
+    view_copy(model, CPU_mode, BUF_SZ);
+}
+
+
+
+void get_uptime(struct procfs *fs, struct proc_buf *pb, uint64_t *uptime)
+{
+
+
+    *uptime = 0;
+    if (procfs_load(fs, pb, PROCFS_UPTIME) == -1) {
+        return;
+    }
+
+    //"193.27 180.44": the first value is the uptime in seconds, and only
+    //whole seconds are shown
+    struct str_view line = view_first_line(pb);
+    *uptime = view_parse_u64(&line);
+}
+
+
+void get_kernel_version(struct procfs *fs, struct proc_buf *pb, char* version)
+{
+
+    version[0] = '\0';
+    if (procfs_load(fs, pb, PROCFS_VERSION) == -1) {
+        return;
+    }
+
+    //"Linux version 6.1.0 (...)": the version is the third token
+    struct str_view line = view_first_line(pb);
+    view_copy(view_field(line, 2), version, BUF_SZ);
+}
+
+void get_hostname(struct procfs *fs, struct proc_buf *pb, char* hostname)
+{
+
+    hostname[0] = '\0';
+    if (procfs_load(fs, pb, PROCFS_HOSTNAME) == -1) {
+        return;
+    }
+
+    struct str_view line = view_first_line(pb);
+    view_copy(line, hostname, HOSTNAME_SZ);
+}
+
+/* Row labels of the --self-stats report */
+const char *self_section_names[NUM_SELF_SECTIONS] = {
+    [SELF_STAT] = "stat",
+    [SELF_HOSTNAME] = "hostname",
+    [SELF_KERNEL_VERSION] = "kernel version",
+    [SELF_UPTIME] = "uptime",
+    [SELF_CPU_MODEL] = "cpu model",
+    [SELF_LOAD_AVG] = "load average",
+    [SELF_MEMINFO] = "meminfo",
+    [SELF_PID_SCAN] = "pid scan",
+    [SELF_TASK_LIST] = "task status",
+    [SELF_USERNAMES] = "username lookup",
+    [SELF_CPU_WINDOW] = "cpu window",
+    [SELF_OUTPUT] = "output",
+};
+
+/**
+ * Starts timing 'section' and charges the calling thread's opens, reads and
+ * allocations to it until the matching self_end(). Does nothing unless
+ * --self-stats was given.
+ */
+void self_begin(struct self_timer *timer, enum self_section section) {
+
+    timer->counts = NULL;
+    if (self_stats_on == false) {
+        return;
+    }
+
+    timer->counts = &self_stats[section];
+    timer->outer = self_current;
+    self_current = timer->counts;
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+}
+
+void self_end(struct self_timer *timer) {
+
+    if (timer->counts == NULL) {
+        return;
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t elapsed = (end.tv_sec - timer->start.tv_sec) * 1000000000ULL
+        + end.tv_nsec - timer->start.tv_nsec;
+    timer->counts->wall_ns += elapsed;
+    timer->counts->calls++;
+
+    //the outer section gets the time back when it ends, so it is only
+    //charged for the work it did itself (unsigned wraparound cancels out)
+    if (timer->outer != NULL) {
+        timer->outer->wall_ns -= elapsed;
+    }
+    self_current = timer->outer;
+}
+
+void self_counts_add(struct self_counts *dst, const struct self_counts *src) {
+    dst->opens += src->opens;
+    dst->reads += src->reads;
+    dst->bytes += src->bytes;
+    dst->allocs += src->allocs;
+}
+
+/**
+ * Prints the --self-stats report: one row per section that ran, and the
+ * totals. Times are in milliseconds.
+ */
+void print_self_stats(FILE *out) {
+
+    struct self_counts total = { 0 };
+    fprintf(out, "Self Stats:\n");
+    fprintf(out, "%-16s %8s %10s %8s %8s %12s %8s\n", "section", "calls",
+        "wall ms", "opens", "reads", "bytes", "allocs");
+
+    int i;
+    for (i = 0; i < NUM_SELF_SECTIONS; i++) {
+        struct self_counts *counts = &self_stats[i];
+        if (counts->calls == 0) {
+            continue;
+        }
+        fprintf(out, "%-16s %8" PRIu64 " %10.3f %8" PRIu64 " %8" PRIu64
+            " %12" PRIu64 " %8" PRIu64 "\n", self_section_names[i],
+            counts->calls, counts->wall_ns / 1e6, counts->opens,
+            counts->reads, counts->bytes, counts->allocs);
+
+        total.calls += counts->calls;
+        total.wall_ns += counts->wall_ns;
+        self_counts_add(&total, counts);
+    }
+
+    fprintf(out, "%-16s %8" PRIu64 " %10.3f %8" PRIu64 " %8" PRIu64
+        " %12" PRIu64 " %8" PRIu64 "\n", "total", total.calls,
+        total.wall_ns / 1e6, total.opens, total.reads, total.bytes,
+        total.allocs);
+}